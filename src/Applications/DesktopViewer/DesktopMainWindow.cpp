@@ -30,6 +30,7 @@
 #include <Godzi/Application>
 #include <Godzi/Project>
 #include <Godzi/Actions>
+#include <Godzi/KML/KMLLiveLink>
 #include "OpenFileDialog"
 #include "AppSettingsDialog"
 #include "AboutDialog"
@@ -56,6 +57,9 @@ void DesktopMainWindow::initUi()
     
 	_osgViewer = new Godzi::UI::ViewerWidget( this, 0, 0, true );
     _app->setView( _osgViewer );
+
+    // view-refreshing KML NetworkLinks fetch for wherever the camera stops
+    _osgViewer->getView()->addEventHandler( new Godzi::KML::KMLViewRefreshHandler() );
 	setCentralWidget(_osgViewer);
 
 	createActions();
@@ -25,6 +25,8 @@
 #include <QDropEvent>
 #include <QDragEnterEvent>
 #include <QModelIndex>
+#include <QMap>
+#include <QSet>
 #include <Godzi/Application>
 #include "ServerTreeWidget"
 #include "DataObjectActionAdapter"
@@ -44,6 +46,12 @@ ServerTreeWidget::ServerTreeWidget(Godzi::Application *app)
 	connect(_app, SIGNAL(projectChanged(osg::ref_ptr<Godzi::Project>, osg::ref_ptr<Godzi::Project>)), this, SLOT(onProjectChanged(osg::ref_ptr<Godzi::Project>, osg::ref_ptr<Godzi::Project>)));
 	connect(this, SIGNAL(itemChanged(QTreeWidgetItem*, int)), this, SLOT(onTreeItemChanged(QTreeWidgetItem*, int)));
   connect(this, SIGNAL(itemDoubleClicked(QTreeWidgetItem*,int)), this, SLOT(onItemDoubleClicked(QTreeWidgetItem*,int)));
+	connect(this, SIGNAL(itemExpanded(QTreeWidgetItem*)), this, SLOT(onItemExpanded(QTreeWidgetItem*)));
+
+	Godzi::DataSourceLoadNotifier* notifier = Godzi::DataSourceLoadNotifier::instance();
+	connect(notifier, SIGNAL(loadProgress(const QString&, unsigned int, unsigned int)), this, SLOT(onDataSourceLoadProgress(const QString&, unsigned int, unsigned int)));
+	connect(notifier, SIGNAL(loadFinished(const QString&, bool)), this, SLOT(onDataSourceLoadFinished(const QString&, bool)));
+	connect(notifier, SIGNAL(objectsChanged(const QString&)), this, SLOT(onDataSourceObjectsChanged(const QString&)));
 }
 
 void ServerTreeWidget::processDataSource(osg::ref_ptr<const Godzi::DataSource> source, int position)
@@ -95,6 +103,11 @@ void ServerTreeWidget::updateDataSourceTreeItem(osg::ref_ptr<const Godzi::DataSo
 
 	item->setCheckState(0, source->visible() ? Qt::Checked : Qt::Unchecked);
 
+    populateDataObjectItems(source, item);
+}
+
+void ServerTreeWidget::populateDataObjectItems(osg::ref_ptr<const Godzi::DataSource> source, CustomDataSourceTreeItem* item)
+{
     //Remove old child items and free memory
     QList<QTreeWidgetItem*> oldChildren = item->takeChildren();
     //while (!oldChildren.isEmpty())
@@ -106,28 +119,21 @@ void ServerTreeWidget::updateDataSourceTreeItem(osg::ref_ptr<const Godzi::DataSo
     {
         for( Godzi::DataObjectSpecVector::const_iterator i = objSpecs.begin(); i != objSpecs.end(); ++i )
         {
-            const Godzi::DataObjectSpec& spec = *i;
-
-            QTreeWidgetItem* child = new QTreeWidgetItem( QStringList( QString( spec.getText().c_str() ) ) );
-
-            WidgetUserDataToken token;
-            token._source = source.get();
-            token._spec = spec;
-
-            // store the object spec in the data so we can reference it later during an action:
-            child->setData( 0, Qt::UserRole, QVariant::fromValue(token) );
-
-            // disable the drop zone:
-            child->setFlags( child->flags() & ~(Qt::ItemIsDropEnabled));
-
-            // set a CheckState iff the data object is hideable
-            if ( token._spec.canHide() )
-                child->setCheckState(0, token._source->getObjectSpecVisibility(token._spec.getObjectUID()) ? Qt::Checked : Qt::Unchecked);
-
-            item->addChild( child );
+            item->addChild( createDataObjectItem(source, *i) );
         }
     }
 
+    // the source is reading its objects in the background; a placeholder
+    // stands in until onDataSourceLoadFinished fills in the real children.
+    else if ( source->isLoading() )
+    {
+        QTreeWidgetItem* child = new QTreeWidgetItem( QStringList( tr("Loading...") ) );
+        child->setFlags( child->flags() & ~(Qt::ItemIsDropEnabled));
+        child->setForeground( 0, Qt::gray );
+        child->setData( 0, LOADING_ROLE, true );
+        item->addChild( child );
+    }
+
 #if 0
     else
     {
@@ -148,6 +154,104 @@ void ServerTreeWidget::updateDataSourceTreeItem(osg::ref_ptr<const Godzi::DataSo
 
 }
 
+QTreeWidgetItem* ServerTreeWidget::createDataObjectItem(osg::ref_ptr<const Godzi::DataSource> source, const Godzi::DataObjectSpec& spec)
+{
+    QTreeWidgetItem* child = new QTreeWidgetItem( QStringList( QString( spec.getText().c_str() ) ) );
+
+    WidgetUserDataToken token;
+    token._source = source.get();
+    token._spec = spec;
+
+    // store the object spec in the data so we can reference it later during an action:
+    child->setData( 0, Qt::UserRole, QVariant::fromValue(token) );
+
+    // disable the drop zone:
+    child->setFlags( child->flags() & ~(Qt::ItemIsDropEnabled));
+
+    // set a CheckState iff the data object is hideable
+    if ( token._spec.canHide() )
+        child->setCheckState(0, token._source->getObjectSpecVisibility(token._spec.getObjectUID()) ? Qt::Checked : Qt::Unchecked);
+
+    // objects grouped under it are listed when it's expanded:
+    if ( token._spec.hasChildren() )
+        child->setChildIndicatorPolicy( QTreeWidgetItem::ShowIndicator );
+
+    return child;
+}
+
+void ServerTreeWidget::onItemExpanded(QTreeWidgetItem* item)
+{
+    if ( !item || item->childCount() > 0 )
+        return;
+
+    QVariant qdata = item->data( 0, Qt::UserRole );
+    if ( !qdata.canConvert<WidgetUserDataToken>() )
+        return;
+
+    WidgetUserDataToken token = qdata.value<WidgetUserDataToken>();
+    if ( !token._spec.hasChildren() )
+        return;
+
+    Godzi::DataObjectSpecVector objSpecs;
+    if ( !token._source->getDataObjectChildSpecs( token._spec.getObjectUID(), objSpecs ) )
+        return;
+
+    bool wasBlocked = blockSignals(true);
+    for( Godzi::DataObjectSpecVector::const_iterator i = objSpecs.begin(); i != objSpecs.end(); ++i )
+        item->addChild( createDataObjectItem(token._source, *i) );
+    blockSignals(wasBlocked);
+}
+
+void ServerTreeWidget::patchDataObjectItems(osg::ref_ptr<const Godzi::DataSource> source, CustomDataSourceTreeItem* item)
+{
+    Godzi::DataObjectSpecVector objSpecs;
+    if ( !source->getDataObjectSpecs( objSpecs ) )
+        return;
+
+    QMap<int, Godzi::DataObjectSpec> current;
+    for( Godzi::DataObjectSpecVector::const_iterator i = objSpecs.begin(); i != objSpecs.end(); ++i )
+        current.insert( i->getObjectUID(), *i );
+
+    // drop the items whose objects are gone, and note the ones still here:
+    QSet<int> shown;
+    for( int i = item->childCount() - 1; i >= 0; --i )
+    {
+        QVariant qdata = item->child(i)->data( 0, Qt::UserRole );
+        if ( !qdata.canConvert<WidgetUserDataToken>() )
+            continue;
+
+        int uid = qdata.value<WidgetUserDataToken>()._spec.getObjectUID();
+        if ( current.contains(uid) )
+        {
+            shown.insert( uid );
+
+            // a group (e.g. a cluster) keeps its item, but what's in it may
+            // have changed: update its text and list its members afresh when
+            // it's next expanded.
+            const Godzi::DataObjectSpec& spec = current[uid];
+            if ( spec.hasChildren() )
+            {
+                QTreeWidgetItem* child = item->child(i);
+                WidgetUserDataToken token = qdata.value<WidgetUserDataToken>();
+                token._spec = spec;
+                child->setData( 0, Qt::UserRole, QVariant::fromValue(token) );
+                child->setText( 0, QString( spec.getText().c_str() ) );
+                child->setExpanded( false );
+                qDeleteAll( child->takeChildren() );
+            }
+        }
+        else
+            delete item->takeChild( i );
+    }
+
+    // and add the new ones:
+    for( Godzi::DataObjectSpecVector::const_iterator i = objSpecs.begin(); i != objSpecs.end(); ++i )
+    {
+        if ( !shown.contains( i->getObjectUID() ) )
+            item->addChild( createDataObjectItem(source, *i) );
+    }
+}
+
 
 int ServerTreeWidget::findDataSourceTreeItem(osg::ref_ptr<const Godzi::DataSource> source, CustomDataSourceTreeItem** out_item)
 {
@@ -317,11 +421,106 @@ void ServerTreeWidget::onDataSourceToggled(unsigned int id, bool visible)
 		item->setCheckState(0, visible ? Qt::Checked : Qt::Unchecked);
 }
 
+void ServerTreeWidget::onDataSourceLoadProgress(const QString& location, unsigned int bytesRead, unsigned int objectsRead)
+{
+	// only the placeholder's text changes; don't let that look like an edit
+	bool wasBlocked = blockSignals(true);
+
+	for (int i=0; i < topLevelItemCount(); i++)
+	{
+		CustomDataSourceTreeItem* item = dynamic_cast<CustomDataSourceTreeItem*>(topLevelItem(i));
+		if (item && item->childCount() == 1 && item->child(0)->data(0, LOADING_ROLE).toBool() &&
+			  location == QString::fromUtf8(item->getSource()->getLocation().c_str()))
+		{
+			item->child(0)->setText(0, tr("Loading... %1 objects (%2 KB)").arg(objectsRead).arg(bytesRead / 1024));
+		}
+	}
+
+	blockSignals(wasBlocked);
+}
+
+void ServerTreeWidget::onDataSourceLoadFinished(const QString& location, bool canceled)
+{
+	bool wasBlocked = blockSignals(true);
+
+	for (int i=0; i < topLevelItemCount(); i++)
+	{
+		CustomDataSourceTreeItem* item = dynamic_cast<CustomDataSourceTreeItem*>(topLevelItem(i));
+		if (item && location == QString::fromUtf8(item->getSource()->getLocation().c_str()))
+		{
+			// canceled, the source kept nothing; asking it for its objects
+			// again would start over, so that's left to the user.
+			if (canceled)
+			{
+				qDeleteAll(item->takeChildren());
+				QTreeWidgetItem* child = new QTreeWidgetItem( QStringList( tr("Not loaded") ) );
+				child->setFlags( child->flags() & ~(Qt::ItemIsDropEnabled));
+				child->setForeground( 0, Qt::gray );
+				child->setData( 0, CANCELED_ROLE, true );
+				item->addChild( child );
+				item->setToolTip(0, tr("Loading was canceled; choose Load objects to read the source."));
+			}
+			else
+			{
+				populateDataObjectItems(item->getSource(), item);
+			}
+		}
+	}
+
+	blockSignals(wasBlocked);
+}
+
+void ServerTreeWidget::onDataSourceObjectsChanged(const QString& location)
+{
+	// only the changed objects' items are touched, so the rest of the tree
+	// keeps its selection and expansion.
+	bool wasBlocked = blockSignals(true);
+
+	for (int i=0; i < topLevelItemCount(); i++)
+	{
+		CustomDataSourceTreeItem* item = dynamic_cast<CustomDataSourceTreeItem*>(topLevelItem(i));
+		if (item && location == QString::fromUtf8(item->getSource()->getLocation().c_str()))
+			patchDataObjectItems(item->getSource(), item);
+	}
+
+	blockSignals(wasBlocked);
+}
+
 void
 ServerTreeWidget::contextMenuEvent( QContextMenuEvent* e )
 {
     // pull the data token associated with the item under the mouse:
     QTreeWidgetItem* item = this->itemAt( e->pos() );
+
+    // a source that's still loading can be told to stop:
+    CustomDataSourceTreeItem* sourceItem = findParentSourceItem( item );
+    if ( sourceItem && sourceItem->getSource()->isLoading() && (item == sourceItem || item->data(0, LOADING_ROLE).toBool()) )
+    {
+        QMenu* contextMenu = new QMenu(this);
+        QAction* cancelAction = contextMenu->addAction( tr("Cancel loading") );
+        if ( contextMenu->exec( e->globalPos() ) == cancelAction )
+            sourceItem->getSource()->cancelLoading();
+        delete contextMenu;
+        return;
+    }
+
+    // one whose load was canceled can be loaded again:
+    if ( sourceItem && sourceItem->childCount() == 1 && sourceItem->child(0)->data(0, CANCELED_ROLE).toBool() &&
+         (item == sourceItem || item == sourceItem->child(0)) )
+    {
+        QMenu* contextMenu = new QMenu(this);
+        QAction* loadAction = contextMenu->addAction( tr("Load objects") );
+        if ( contextMenu->exec( e->globalPos() ) == loadAction )
+        {
+            bool wasBlocked = blockSignals(true);
+            sourceItem->setToolTip(0, tr(""));
+            populateDataObjectItems(sourceItem->getSource(), sourceItem);
+            blockSignals(wasBlocked);
+        }
+        delete contextMenu;
+        return;
+    }
+
     if ( item )
     {
         QVariant qdata = item->data( 0, Qt::UserRole );
@@ -24,6 +24,8 @@
 #include <Godzi/Earth>
 #include <Godzi/Application>
 #include <Godzi/Project>
+#include <Godzi/KML/KMLFeatureCache>
+#include <Godzi/KML/KMLIconService>
 #include "GodziQtApplication"
 #include "GodziApp"
 #include "DesktopMainWindow"
@@ -32,6 +34,8 @@
 #define LOCAL_EARTH_FILE "./data/default.earth"
 #define GODZI_CONFIG_FILE "godzi.config"
 #define GODZI_CACHE_FILE "godzi.cache"
+#define GODZI_KML_CACHE_DIR "kmlcache"
+#define GODZI_ICON_CACHE_DIR "iconcache"
 
 int
 main( int argc, char** argv )
@@ -73,6 +77,14 @@ main( int argc, char** argv )
     if (!cacheOpt.maxSize().isSet())
       cacheOpt.maxSize() = 1024;
 
+    // Compiled KML goes beside the tile cache
+    if (homedir.exists() && (homedir.exists(GODZI_KML_CACHE_DIR) || homedir.mkdir(GODZI_KML_CACHE_DIR)))
+      Godzi::KML::KMLFeatureCache::setDirectory(homepath + GODZI_KML_CACHE_DIR);
+
+    // ...and so do downloaded placemark icons
+    if (homedir.exists() && (homedir.exists(GODZI_ICON_CACHE_DIR) || homedir.mkdir(GODZI_ICON_CACHE_DIR)))
+      Godzi::KML::KMLIconService::setDirectory(homepath + GODZI_ICON_CACHE_DIR);
+
 
     osg::ref_ptr<GodziApp> app = new GodziApp(cacheOpt, appConf);
 
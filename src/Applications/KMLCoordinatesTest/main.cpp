@@ -0,0 +1,278 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLCoordinates>
+#include <osg/Timer>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Checks KMLCoordinates::parse against strtod over a generated corpus, both
+ * in one piece and cut at every byte (the way the stream reader hands over
+ * <coordinates> text), then reports parse speed in vertices per second.
+ *
+ * Usage: godzi_kmlcoordinates_test [num_benchmark_vertices]
+ */
+
+using namespace Godzi::KML;
+
+namespace
+{
+    /** Small deterministic generator so failures reproduce. */
+    struct Random
+    {
+        unsigned int _state;
+        Random( unsigned int seed ) : _state(seed) { }
+        unsigned int next() { _state = _state * 1103515245u + 12345u; return (_state >> 8) & 0xFFFFFF; }
+        unsigned int next( unsigned int n ) { return next() % n; }
+    };
+
+    /**
+     * Number spellings the parser has to agree with strtod on. "typical"
+     * sticks to the fixed-point output of the usual KML writers.
+     */
+    std::string
+    s_number( Random& r, double range, bool typical )
+    {
+        char buf[64];
+        double v = (((double)r.next() / (double)0xFFFFFF) * 2.0 - 1.0) * range;
+        switch( typical ? 1 : r.next(8) )
+        {
+        case 0:  sprintf( buf, "%.0f", v ); break;
+        case 1:  sprintf( buf, "%.6f", v ); break;
+        case 2:  sprintf( buf, "%.15f", v ); break;           // exact fast path
+        case 3:  sprintf( buf, "%.17g", v ); break;           // full precision
+        case 4:  sprintf( buf, "%.25f", v ); break;           // too many digits: strtod fallback
+        case 5:  sprintf( buf, "%.8e", v ); break;            // exponent
+        case 6:  sprintf( buf, "%+.4f", v ); break;           // explicit sign
+        default: sprintf( buf, "%.3E", v * 1e-30 ); break;    // exponent out of fast range
+        }
+        return buf;
+    }
+
+    /** Whitespace between tuples, as real files spell it. */
+    const char*
+    s_separator( Random& r )
+    {
+        static const char* seps[] = { " ", "\n", "\r\n", "\t", "  ", "\n\t\t\t\t\t\t", "\n                                " };
+        return seps[r.next(7)];
+    }
+
+    /** Separator between the numbers of one tuple. */
+    const char*
+    s_comma( Random& r )
+    {
+        static const char* commas[] = { ",", ",", ",", ", ", ",  ", ",\t" };
+        return commas[r.next(6)];
+    }
+
+    /** Builds a corpus and the values strtod gives for it. */
+    void
+    s_makeCorpus( unsigned int seed, int numVertices, bool typical, std::string& text, Vec3dVector& expected )
+    {
+        Random r( seed );
+        text = s_separator( r );
+        for( int i = 0; i < numVertices; ++i )
+        {
+            std::string x = s_number( r, 180.0, typical );
+            std::string y = s_number( r, 90.0, typical );
+            std::string z = r.next(2) ? s_number( r, 9000.0, typical ) : std::string();
+
+            text += x + s_comma( r ) + y;
+            if ( !z.empty() )
+                text += s_comma( r ) + z;
+            text += s_separator( r );
+
+            expected.push_back( osg::Vec3d(
+                ::strtod( x.c_str(), 0L ),
+                ::strtod( y.c_str(), 0L ),
+                z.empty() ? 0.0 : ::strtod( z.c_str(), 0L ) ) );
+        }
+    }
+
+    /** Parses text in chunks of the given sizes, carrying the unconsumed tail. */
+    void
+    s_parseChunked( const std::string& text, const std::vector<std::size_t>& cuts, Vec3dVector& output )
+    {
+        std::string pending;
+        std::size_t start = 0;
+        for( std::vector<std::size_t>::const_iterator i = cuts.begin(); i != cuts.end(); ++i )
+        {
+            pending.append( text, start, *i - start );
+            start = *i;
+            std::size_t used = KMLCoordinates::parse( pending, false, output );
+            pending.erase( 0, used );
+        }
+        pending.append( text, start, std::string::npos );
+        KMLCoordinates::parse( pending, true, output );
+    }
+
+    /** Bitwise comparison, so a last-bit rounding difference counts. */
+    bool
+    s_same( const Vec3dVector& a, const Vec3dVector& b, std::string& why )
+    {
+        if ( a.size() != b.size() )
+        {
+            char buf[128];
+            sprintf( buf, "%u vertices, expected %u", (unsigned)a.size(), (unsigned)b.size() );
+            why = buf;
+            return false;
+        }
+        for( unsigned i = 0; i < a.size(); ++i )
+        {
+            if ( memcmp( a[i].ptr(), b[i].ptr(), sizeof(double) * 3 ) != 0 )
+            {
+                char buf[256];
+                sprintf( buf, "vertex %u is (%.17g,%.17g,%.17g), expected (%.17g,%.17g,%.17g)", i,
+                    a[i].x(), a[i].y(), a[i].z(), b[i].x(), b[i].y(), b[i].z() );
+                why = buf;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int
+    s_testCorrectness()
+    {
+        int failures = 0;
+
+        for( unsigned int seed = 1; seed <= 200; ++seed )
+        {
+            std::string text;
+            Vec3dVector expected;
+            s_makeCorpus( seed, 1 + seed % 12, false, text, expected );
+
+            std::string why;
+            Vec3dVector whole;
+            KMLCoordinates::parse( text, true, whole );
+            if ( !s_same( whole, expected, why ) )
+            {
+                printf( "FAIL seed %u, whole text: %s\n", seed, why.c_str() );
+                ++failures;
+            }
+
+            // one cut at every byte:
+            for( std::size_t k = 0; k <= text.size(); ++k )
+            {
+                Vec3dVector output;
+                s_parseChunked( text, std::vector<std::size_t>(1, k), output );
+                if ( !s_same( output, expected, why ) )
+                {
+                    printf( "FAIL seed %u, cut at %u: %s\n", seed, (unsigned)k, why.c_str() );
+                    ++failures;
+                }
+            }
+
+            // and many small random chunks:
+            Random r( seed * 7919u );
+            std::vector<std::size_t> cuts;
+            for( std::size_t k = r.next(8); k < text.size(); k += 1 + r.next(8) )
+                cuts.push_back( k );
+            Vec3dVector output;
+            s_parseChunked( text, cuts, output );
+            if ( !s_same( output, expected, why ) )
+            {
+                printf( "FAIL seed %u, random chunks: %s\n", seed, why.c_str() );
+                ++failures;
+            }
+        }
+
+        // malformed tuples are skipped, not misread:
+        const char* junk = "1,2 abc 3 4,x 5,6,7,8 nan,1 9,10";
+        Vec3dVector output;
+        KMLCoordinates::parse( junk, strlen(junk), true, output );
+        if ( output.size() != 4 || output[0].x() != 1.0 || output[1].y() != 6.0 || output[3].x() != 9.0 )
+        {
+            printf( "FAIL malformed input gave %u vertices\n", (unsigned)output.size() );
+            ++failures;
+        }
+
+        return failures;
+    }
+
+    void
+    s_benchmark( int numVertices, bool typical )
+    {
+        std::string text;
+        Vec3dVector expected;
+        s_makeCorpus( 12345u, numVertices, typical, text, expected );
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        Vec3dVector output;
+        output.reserve( numVertices );
+        KMLCoordinates::parse( text, true, output );
+        double parseTime = osg::Timer::instance()->delta_s( t0, osg::Timer::instance()->tick() );
+
+        // baseline: the strtod loop the tokenizer replaced.
+        t0 = osg::Timer::instance()->tick();
+        Vec3dVector baseline;
+        baseline.reserve( numVertices );
+        const char* p = text.c_str();
+        while( *p )
+        {
+            char* next;
+            double v[3] = { 0.0, 0.0, 0.0 };
+            int n = 0;
+            for( ; n < 3; ++n )
+            {
+                v[n] = ::strtod( p, &next );
+                if ( next == p ) break;
+                p = next;
+                if ( *p != ',' ) { ++n; break; }
+                ++p;
+            }
+            if ( n >= 2 )
+                baseline.push_back( osg::Vec3d(v[0], v[1], v[2]) );
+            while( *p && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t' ) ++p;
+            while( *p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' ) ++p;
+        }
+        double strtodTime = osg::Timer::instance()->delta_s( t0, osg::Timer::instance()->tick() );
+
+        printf( "%s corpus: %u vertices, %.1f MB, %s scanner\n",
+            typical ? "typical" : "mixed", (unsigned)output.size(), text.size() / 1048576.0,
+            KMLCoordinates::isVectorized() ? "SSE2" : "scalar" );
+        printf( "  KMLCoordinates: %.0f vertices/s\n", output.size() / (parseTime > 0.0 ? parseTime : 1e-9) );
+        printf( "  strtod loop:    %.0f vertices/s\n", baseline.size() / (strtodTime > 0.0 ? strtodTime : 1e-9) );
+    }
+}
+
+int
+main( int argc, char** argv )
+{
+    int numVertices = argc > 1 ? atoi( argv[1] ) : 1000000;
+
+    int failures = s_testCorrectness();
+    if ( failures )
+        printf( "%d failures\n", failures );
+    else
+        printf( "correctness: ok\n" );
+
+    if ( numVertices > 0 )
+    {
+        s_benchmark( numVertices, true );
+        s_benchmark( numVertices, false );
+    }
+
+    return failures ? 1 : 0;
+}
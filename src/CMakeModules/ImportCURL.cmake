@@ -0,0 +1,10 @@
+# Finds and imports the CURL library.
+
+create_imported_library(
+    CURL
+    curl/curl.h curl SHARED
+    INCLUDE_SEARCH_PATH
+        ${CURL_DIR}/include ENV{CURL_DIR}/include
+    LIBRARY_SEARCH_PATH 
+        ${CURL_DIR}/lib ENV{CURL_DIR}/lib
+)
@@ -44,7 +44,10 @@ create_imported_library(
 
 create_imported_library(
     MINIZIP
-    minizip.lib STATIC
+    minizip/unzip.h minizip STATIC
+    INCLUDE_SEARCH_PATH ${KML_DIR}/third_party/zlib-1.2.3/contrib ENV{KML_DIR}/third_party/zlib-1.2.3/contrib
+    LIBRARY_SEARCH_PATH ${KML_DIR}/lib ${KML_DIR}/msvc ENV{KML_DIR}/lib
+    INCLUDE_PATH ${KML_DIR}/third_party/zlib-1.2.3
 )
 
 create_imported_library(
@@ -0,0 +1,209 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/CompactGeometry>
+#include <osg/Math>
+
+using namespace Godzi;
+
+// size of a quantization step, in degrees (about 1.1cm at the equator):
+#define STEP 1e-7
+
+// geometry with fewer vertices than this takes less room as is:
+#define MIN_VERTICES 16
+
+namespace
+{
+    /** Largest offset from the origin, in steps, that fits in an int. */
+    const double MAX_STEPS = 2147483647.0;
+}
+
+//------------------------------------------------------------------------
+
+CompactGeometry*
+CompactGeometry::create( const Geometry* geom )
+{
+    if ( !geom )
+        return 0L;
+
+    unsigned int numVertices = countVertices( geom );
+    if ( numVertices < MIN_VERTICES )
+        return 0L;
+
+    osg::ref_ptr<CompactGeometry> result = new CompactGeometry();
+    result->_bounds = geom->getBounds();
+
+    // from the center, half the extent must fit in an int either way:
+    const Bounds& b = result->_bounds;
+    if ( 0.5 * (b.xMax() - b.xMin()) / STEP >= MAX_STEPS || 0.5 * (b.yMax() - b.yMin()) / STEP >= MAX_STEPS )
+        return 0L;
+
+    result->_origin.set( 0.5 * (b.xMin() + b.xMax()), 0.5 * (b.yMin() + b.yMax()) );
+
+    result->_xy.reserve( 2 * numVertices );
+    result->_z.reserve( numVertices );
+    if ( !result->encode( geom ) )
+        return 0L;
+
+    // altitude only takes room if there is any:
+    bool hasZ = false;
+    for( std::vector<float>::const_iterator i = result->_z.begin(); i != result->_z.end() && !hasZ; ++i )
+        hasZ = *i != 0.0f;
+    if ( !hasZ )
+        std::vector<float>().swap( result->_z );
+
+    return result.release();
+}
+
+unsigned int
+CompactGeometry::countVertices( const Geometry* geom )
+{
+    if ( geom->getType() == Geometry::TYPE_MULTI )
+    {
+        unsigned int count = 0;
+        const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+        for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+            count += countVertices( i->get() );
+        return count;
+    }
+
+    unsigned int count = geom->size();
+    if ( geom->getType() == Geometry::TYPE_POLYGON )
+    {
+        const Polygon* poly = static_cast<const Polygon*>( geom );
+        for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+            count += (*i)->size();
+    }
+    return count;
+}
+
+bool
+CompactGeometry::encode( const Geometry* geom )
+{
+    Part part;
+    part._type = (unsigned char)geom->getType();
+    part._size = 0;
+    part._children = 0;
+
+    switch( geom->getType() )
+    {
+    case Geometry::TYPE_LINESTRING:
+    case Geometry::TYPE_RING:
+    case Geometry::TYPE_POLYGON:
+        part._size = geom->size();
+        if ( geom->getType() == Geometry::TYPE_POLYGON )
+            part._children = static_cast<const Polygon*>( geom )->getHoles().size();
+        _parts.push_back( part );
+
+        for( Geometry::const_iterator i = geom->begin(); i != geom->end(); ++i )
+        {
+            _xy.push_back( (int)osg::round( (i->x() - _origin.x()) / STEP ) );
+            _xy.push_back( (int)osg::round( (i->y() - _origin.y()) / STEP ) );
+            _z.push_back( (float)i->z() );
+        }
+
+        if ( geom->getType() == Geometry::TYPE_POLYGON )
+        {
+            const Polygon* poly = static_cast<const Polygon*>( geom );
+            for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+            {
+                if ( !encode( i->get() ) )
+                    return false;
+            }
+        }
+        return true;
+
+    case Geometry::TYPE_MULTI:
+        {
+            const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+            part._children = multi->getComponents().size();
+            _parts.push_back( part );
+
+            for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+            {
+                if ( !encode( i->get() ) )
+                    return false;
+            }
+        }
+        return true;
+
+    default:
+        // points are left as they are, for the symbol layer
+        return false;
+    }
+}
+
+Geometry*
+CompactGeometry::decode() const
+{
+    unsigned int part = 0, vertex = 0;
+    return _parts.empty() ? 0L : decode( part, vertex );
+}
+
+Geometry*
+CompactGeometry::decode( unsigned int& part, unsigned int& vertex ) const
+{
+    const Part& p = _parts[part++];
+
+    osg::ref_ptr<Geometry> geom;
+    switch( p._type )
+    {
+    case Geometry::TYPE_LINESTRING: geom = new LineString(); break;
+    case Geometry::TYPE_RING:       geom = new Ring(); break;
+    case Geometry::TYPE_POLYGON:    geom = new Polygon(); break;
+
+    case Geometry::TYPE_MULTI:
+        {
+            osg::ref_ptr<MultiGeometry> multi = new MultiGeometry();
+            for( unsigned int i = 0; i < p._children; ++i )
+            {
+                Geometry* component = decode( part, vertex );
+                if ( component )
+                    multi->getComponents().push_back( component );
+            }
+            return multi.release();
+        }
+
+    default:
+        return 0L;
+    }
+
+    geom->asVector().resize( p._size );
+    for( unsigned int i = 0; i < p._size; ++i, ++vertex )
+    {
+        (*geom)[i].set(
+            _origin.x() + (double)_xy[2*vertex] * STEP,
+            _origin.y() + (double)_xy[2*vertex+1] * STEP,
+            _z.empty() ? 0.0 : (double)_z[vertex] );
+    }
+
+    if ( p._type == Geometry::TYPE_POLYGON )
+    {
+        Polygon* poly = static_cast<Polygon*>( geom.get() );
+        for( unsigned int i = 0; i < p._children; ++i )
+        {
+            Geometry* hole = decode( part, vertex );
+            if ( hole )
+                poly->getHoles().push_back( static_cast<Ring*>( hole ) );
+        }
+    }
+
+    return geom.release();
+}
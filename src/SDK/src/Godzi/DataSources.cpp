@@ -24,6 +24,9 @@
 #include <Godzi/Application>
 #include <Godzi/Project>
 #include <Godzi/DataSources>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <QCoreApplication>
 
 using namespace Godzi;
 
@@ -50,6 +53,42 @@ Godzi::Config DataSource::toConfig() const
 
 /* --------------------------------------------- */
 
+DataSourceLoadNotifier::DataSourceLoadNotifier()
+{
+	// loader threads may be the first to ask for the notifier; its signals
+	// must still be delivered from the main thread's event loop.
+	if (QCoreApplication::instance())
+		moveToThread(QCoreApplication::instance()->thread());
+}
+
+DataSourceLoadNotifier* DataSourceLoadNotifier::instance()
+{
+	static OpenThreads::Mutex s_mutex;
+	static DataSourceLoadNotifier* s_instance = 0L;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_mutex);
+	if (!s_instance)
+		s_instance = new DataSourceLoadNotifier();
+	return s_instance;
+}
+
+void DataSourceLoadNotifier::notifyProgress(const std::string& location, unsigned int bytesRead, unsigned int objectsRead)
+{
+	emit loadProgress(QString::fromUtf8(location.c_str()), bytesRead, objectsRead);
+}
+
+void DataSourceLoadNotifier::notifyFinished(const std::string& location, bool canceled)
+{
+	emit loadFinished(QString::fromUtf8(location.c_str()), canceled);
+}
+
+void DataSourceLoadNotifier::notifyObjectsChanged(const std::string& location)
+{
+	emit objectsChanged(QString::fromUtf8(location.c_str()));
+}
+
+/* --------------------------------------------- */
+
 const std::string TMSSource::TYPE_TMS = "TMS";
 
 TMSSource::TMSSource(const osgEarth::Drivers::TMSOptions& opt, bool visible)
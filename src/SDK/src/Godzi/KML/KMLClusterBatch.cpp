@@ -0,0 +1,268 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLClusterBatch>
+#include <Godzi/KML/KMLIconBatch>
+#include <Godzi/KML/KMLLabelBatch>
+#include <Godzi/KML/KMLSymbolSource>
+#include <Godzi/Tasks>
+#include <osgEarth/SpatialReference>
+#include <osgUtil/CullVisitor>
+#include <osg/Group>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <cmath>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMLClusterBatch] "
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+// clusters are drawn at the level whose cells are about this many pixels across:
+#define CLUSTER_PIXELS 64.0
+
+// meters per degree of latitude, near enough:
+#define METERS_PER_DEGREE 111320.0
+
+namespace
+{
+    /** Icons and labels for one list of point features. */
+    osg::Node*
+    s_createPoints( const FeatureList& features, const osgEarth::Map* map )
+    {
+        osg::Group* group = new osg::Group();
+
+        osg::Node* icons = KMLIconBatch::create( features, map );
+        if ( icons )
+            group->addChild( icons );
+
+        osg::Node* labels = KMLLabelBatch::create( features, map );
+        if ( labels )
+            group->addChild( labels );
+
+        return group;
+    }
+
+    /** Runs level builds, off the cull and draw threads. */
+    Godzi::TaskPool*
+    s_levelPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( 1 );
+        return s_pool.get();
+    }
+
+    /**
+     * A batch's levels: built as tasks when first asked for, and handed to
+     * the update traversal to add to the graph. Cull only reads which levels
+     * are in the graph and asks for the ones it's missing.
+     */
+    class Levels : public osg::Referenced
+    {
+    public:
+        /** Builds one level's icons and labels. */
+        class Build : public Godzi::Task
+        {
+        public:
+            Build( Levels* levels, unsigned int level ) : _levels( levels ), _level( level ) { }
+
+            void run()
+            {
+                _node = _levels->createLevel( _level );
+                _levels = 0L;
+            }
+
+            osg::ref_ptr<Levels>      _levels;  // until run
+            unsigned int              _level;
+            osg::ref_ptr<osg::Node>   _node;
+        };
+
+        Levels( KMLClusterIndex* index, const FeatureList& features, const osgEarth::Map* map ) :
+        _index( index ),
+        _map( map )
+        {
+            for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+            {
+                if ( KMLSymbolSource::isSymbol(i->get()) )
+                    _points.push_back( i->get() );
+            }
+            _nodes.resize( index->getNumLevels() + 1 );
+            _builds.resize( index->getNumLevels() + 1 );
+        }
+
+        unsigned int getNumLevels() const { return _nodes.size(); }
+
+        /**
+         * From cull: the level to draw for the one wanted, which is asked for
+         * if it isn't built yet; meanwhile the nearest built level stands in.
+         * NULL when none is built.
+         */
+        osg::Node* select( unsigned int level )
+        {
+            ScopedLock lock( _mutex );
+            if ( _nodes[level].valid() )
+                return _nodes[level].get();
+
+            if ( !_builds[level].valid() )
+            {
+                _builds[level] = new Build( this, level );
+                s_levelPool()->add( _builds[level].get() );
+            }
+
+            for( unsigned int d = 1; d < _nodes.size(); ++d )
+            {
+                if ( level >= d && _nodes[level - d].valid() )
+                    return _nodes[level - d].get();
+                if ( level + d < _nodes.size() && _nodes[level + d].valid() )
+                    return _nodes[level + d].get();
+            }
+            return 0L;
+        }
+
+        /** From update: adds the levels built since the last call to the group. */
+        void update( osg::Group* group )
+        {
+            ScopedLock lock( _mutex );
+            for( unsigned int i = 0; i < _builds.size(); ++i )
+            {
+                Build* build = _builds[i].get();
+                if ( build && !_nodes[i].valid() && build->isDone() && build->_node.valid() )
+                {
+                    _nodes[i] = build->_node.get();
+                    build->_node = 0L;
+                    group->addChild( _nodes[i].get() );
+                }
+            }
+        }
+
+        osg::Node* createLevel( unsigned int level ) const
+        {
+            if ( level == _index->getNumLevels() )
+                return s_createPoints( _points, _map );
+
+            FeatureList features;
+            for( unsigned int i = _index->getLevelBegin(level); i < _index->getLevelEnd(level); ++i )
+            {
+                if ( _index->getCluster(i).getCount() == 1 )
+                    features.push_back( _index->getFirstMember(i) );
+                else
+                    features.push_back( _index->createPlacemark(i) );
+            }
+
+            OE_INFO << LC << "Level " << level << ": " << features.size() << " clusters" << std::endl;
+            return s_createPoints( features, _map );
+        }
+
+    protected:
+        osg::ref_ptr<KMLClusterIndex>          _index;
+        const osgEarth::Map*                   _map;
+        FeatureList                            _points;
+        OpenThreads::Mutex                     _mutex;
+        std::vector< osg::ref_ptr<osg::Node> > _nodes;  // in the graph
+        std::vector< osg::ref_ptr<Build> >     _builds;
+    };
+
+    /** Picks the level to draw, among those already built. */
+    class LevelCallback : public osg::NodeCallback
+    {
+    public:
+        LevelCallback( Levels* levels, const osgEarth::Map* map ) :
+        _levels( levels ),
+        _map( map )
+        {
+            //nop
+        }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( nv );
+            if ( !cv || !cv->getViewport() || !cv->getProjectionMatrix() )
+                return;
+
+            osg::Node* child = _levels->select( getLevel(cv) );
+            if ( child )
+                child->accept( *nv );
+        }
+
+    protected:
+        /**
+         * The level whose cells are about CLUSTER_PIXELS across when seen
+         * from the eye's height, or one past the last for the points.
+         */
+        unsigned int getLevel( osgUtil::CullVisitor* cv ) const
+        {
+            osg::Vec3d eye = cv->getEyeLocal();
+            double height = _map->isGeocentric() ?
+                eye.length() - _map->getProfile()->getSRS()->getEllipsoid()->getRadiusEquator() :
+                eye.z();
+            height = std::max( height, 1.0 );
+
+            double fovy, aspect, zNear, zFar;
+            if ( !cv->getProjectionMatrix()->getPerspective(fovy, aspect, zNear, zFar) )
+                fovy = 30.0;
+
+            double pixelMeters = height * 2.0 * ::tan( osg::DegreesToRadians(0.5 * fovy) ) / cv->getViewport()->height();
+            double cellDegrees = CLUSTER_PIXELS * pixelMeters / METERS_PER_DEGREE;
+            double level = ::floor( ::log(180.0 / cellDegrees) / ::log(2.0) );
+
+            return (unsigned int)osg::clampBetween( level, 0.0, (double)(_levels->getNumLevels() - 1) );
+        }
+
+        osg::ref_ptr<Levels> _levels;
+        const osgEarth::Map* _map;
+    };
+
+    /** Adds the levels to the graph as they're built. */
+    class LevelUpdateCallback : public osg::NodeCallback
+    {
+    public:
+        LevelUpdateCallback( Levels* levels ) : _levels( levels ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            _levels->update( node->asGroup() );
+            traverse( node, nv );
+        }
+
+    protected:
+        osg::ref_ptr<Levels> _levels;
+    };
+}
+
+//------------------------------------------------------------------------
+
+osg::Node*
+KMLClusterBatch::create( KMLClusterIndex* index, const FeatureList& features, const osgEarth::Map* map )
+{
+    if ( !index || !map )
+        return 0L;
+
+    // the callback picks the one child to traverse; the group's own bound
+    // (empty until a level is built) mustn't cull it first. Levels are
+    // built on a worker and added on the update traversal:
+    osg::Group* group = new osg::Group();
+    group->setCullingActive( false );
+    osg::ref_ptr<Levels> levels = new Levels( index, features, map );
+    group->setCullCallback( new LevelCallback(levels.get(), map) );
+    group->setUpdateCallback( new LevelUpdateCallback(levels.get()) );
+    return group;
+}
@@ -0,0 +1,239 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLClusterIndex>
+#include <Godzi/KML/KMLIconService>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/KML/KMLSymbolSource>
+#include <osgEarthSymbology/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLClusterIndex] "
+
+// finest grid level the Morton codes resolve (cells of about a meter):
+#define MAX_LEVEL 24
+
+// sources with more point placemarks than this are clustered by default:
+#define DEFAULT_CLUSTER_POINTS 1000
+
+// meters per degree of latitude, near enough:
+#define METERS_PER_DEGREE 111320.0
+
+namespace
+{
+    /** Spreads the low 24 bits of v over the even bits of the result. */
+    unsigned long long
+    s_spread( unsigned long long v )
+    {
+        unsigned long long out = 0;
+        for( int bit = 0; bit < MAX_LEVEL; ++bit )
+            out |= ( (v >> bit) & 1ULL ) << (2 * bit);
+        return out;
+    }
+
+    /**
+     * Morton code of a location's cell at MAX_LEVEL. There are twice as many
+     * columns as rows, so the column's extra top bit goes above the rest;
+     * the code of the cell at level L is then this code >> 2*(MAX_LEVEL-L).
+     */
+    unsigned long long
+    s_getCode( const osg::Vec2d& location )
+    {
+        double cells = (double)(1ULL << MAX_LEVEL);
+        unsigned long long col = (unsigned long long)osg::clampBetween( ::floor((location.x() + 180.0) / 180.0 * cells), 0.0, 2.0 * cells - 1.0 );
+        unsigned long long row = (unsigned long long)osg::clampBetween( ::floor((location.y() + 90.0) / 180.0 * cells), 0.0, cells - 1.0 );
+        unsigned long long mask = (1ULL << MAX_LEVEL) - 1ULL;
+        return ( (col >> MAX_LEVEL) << (2 * MAX_LEVEL) ) | ( s_spread(col & mask) << 1 ) | s_spread( row );
+    }
+}
+
+//------------------------------------------------------------------------
+
+KMLClusterIndex*
+KMLClusterIndex::create( const FeatureList& features, const KMLFeatureSourceOptions& options )
+{
+    unsigned int threshold = options.clusterPoints().isSet() ? *options.clusterPoints() : DEFAULT_CLUSTER_POINTS;
+    if ( threshold == 0 )
+        return 0L;
+
+    FeatureList points;
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        if ( KMLSymbolSource::isSymbol(i->get()) )
+            points.push_back( i->get() );
+    }
+
+    if ( points.size() <= threshold )
+        return 0L;
+
+    osg::ref_ptr<KMLClusterIndex> index = new KMLClusterIndex( points );
+    return index->getNumLevels() > 0 ? index.release() : 0L;
+}
+
+KMLClusterIndex::KMLClusterIndex( const FeatureList& points )
+{
+    _points.reserve( points.size() );
+    for( FeatureList::const_iterator i = points.begin(); i != points.end(); ++i )
+    {
+        const Geometry* geom = (*i)->getGeometry();
+        if ( !geom )
+            continue;
+
+        Point p;
+        p._feature  = i->get();
+        p._location = osg::Vec2d( geom->getBounds().center().x(), geom->getBounds().center().y() );
+        p._code     = s_getCode( p._location );
+        _points.push_back( p );
+    }
+
+    std::stable_sort( _points.begin(), _points.end() );
+
+    _sums.resize( _points.size() + 1 );
+    _sums[0] = osg::Vec2d( 0, 0 );
+    for( unsigned int i = 0; i < _points.size(); ++i )
+        _sums[i+1] = _sums[i] + _points[i]._location;
+
+    // a level at a time, until clustering would no longer thin things out:
+    unsigned int n = _points.size();
+    for( unsigned int level = 0; level <= MAX_LEVEL && n > 0; ++level )
+    {
+        unsigned int shift = 2 * (MAX_LEVEL - level);
+        unsigned int levelBegin = _clusters.size();
+
+        for( unsigned int first = 0; first < n; )
+        {
+            unsigned long long key = _points[first]._code >> shift;
+            unsigned int end = first + 1;
+            while( end < n && (_points[end]._code >> shift) == key )
+                ++end;
+
+            Cluster c;
+            c._level  = level;
+            c._first  = first;
+            c._end    = end;
+            c._center = ( _sums[end] - _sums[first] ) / (double)(end - first);
+            for( unsigned int i = first; i < end; ++i )
+                c._bounds.expandBy( _points[i]._location.x(), _points[i]._location.y() );
+            _clusters.push_back( c );
+
+            first = end;
+        }
+
+        if ( 2 * (_clusters.size() - levelBegin) >= n )
+        {
+            _clusters.resize( levelBegin );
+            break;
+        }
+        _levelEnds.push_back( _clusters.size() );
+    }
+
+    OE_INFO << LC << n << " points in " << _clusters.size() << " clusters over " << _levelEnds.size() << " levels" << std::endl;
+}
+
+void
+KMLClusterIndex::getMembers( unsigned int index, FeatureList& output ) const
+{
+    const Cluster& c = _clusters[index];
+    for( unsigned int i = c._first; i < c._end; ++i )
+        output.push_back( _points[i]._feature.get() );
+}
+
+void
+KMLClusterIndex::getChildren( unsigned int index, std::vector<unsigned int>& output ) const
+{
+    const Cluster& c = _clusters[index];
+    unsigned int level = c._level + 1;
+    if ( level >= getNumLevels() )
+        return;
+
+    // a level's clusters are in curve order, so its children are the run
+    // that starts where it does:
+    unsigned int lo = getLevelBegin( level ), hi = getLevelEnd( level );
+    while( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if ( _clusters[mid]._first < c._first )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for( unsigned int i = lo; i < getLevelEnd(level) && _clusters[i]._first < c._end; ++i )
+        output.push_back( i );
+}
+
+unsigned long long
+KMLClusterIndex::getCell( unsigned int index ) const
+{
+    const Cluster& c = _clusters[index];
+    return _points[c._first]._code >> ( 2 * (MAX_LEVEL - c._level) );
+}
+
+unsigned int
+KMLClusterIndex::getLevelForCount( unsigned int maxClusters ) const
+{
+    unsigned int level = 0;
+    while( level + 1 < getNumLevels() && getLevelEnd(level + 1) - getLevelBegin(level + 1) <= maxClusters )
+        ++level;
+    return level;
+}
+
+Placemark*
+KMLClusterIndex::createPlacemark( unsigned int index ) const
+{
+    const Cluster& c = _clusters[index];
+
+    std::stringstream count;
+    count << c.getCount();
+
+    Placemark* p = new Placemark( toUID(index) );
+    p->setName( count.str() + " placemarks" );
+
+    PointSet* point = new PointSet();
+    point->push_back( osg::Vec3d(c._center.x(), c._center.y(), 0.0) );
+    p->setGeometry( point );
+
+    // markers grow slowly with the number of points under them:
+    KMLIconSymbol* icon = new KMLIconSymbol();
+    icon->url() = KMLIconService::DEFAULT_ICON;
+    float scale = 1.0f + 0.5f * (float)::log10( (double)c.getCount() );
+    icon->scale() = osg::Vec3f( scale, scale, scale );
+
+    KMLLabelSymbol* label = new KMLLabelSymbol();
+    label->content() = count.str();
+
+    Style style;
+    style.addSymbol( icon );
+    style.addSymbol( label );
+    p->style() = style;
+
+    // far enough back to take in the whole cell:
+    double width  = ( c._bounds.xMax() - c._bounds.xMin() ) * ::cos( osg::DegreesToRadians(c._center.y()) );
+    double height = c._bounds.yMax() - c._bounds.yMin();
+    double range  = std::max( 1250.0, 1.5 * std::max(width, height) * METERS_PER_DEGREE );
+    p->lookAt() = Viewpoint( osg::Vec3d(c._center.x(), c._center.y(), 0.0), 0.0, -90.0, range );
+
+    return p;
+}
@@ -0,0 +1,301 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLCoordinates>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GODZI_KML_SSE2 1
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
+using namespace Godzi::KML;
+
+namespace
+{
+    /** Powers of ten that are exactly representable as doubles. */
+    const double s_pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    /** Longest token handed to strtod; nothing legitimate comes close. */
+    const int MAX_FALLBACK_TOKEN = 64;
+
+    inline bool
+    s_isSpace( char c )
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+#ifdef GODZI_KML_SSE2
+    /** Index of the lowest set bit of a non-zero mask. */
+    inline int
+    s_lowestBit( unsigned int mask )
+    {
+#  ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward( &index, mask );
+        return (int)index;
+#  else
+        return __builtin_ctz( mask );
+#  endif
+    }
+
+    /** One bit per byte of a 16-byte block: set where the byte is whitespace. */
+    inline unsigned int
+    s_spaceMask( const char* p )
+    {
+        __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) );
+        __m128i ws = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),  _mm_cmpeq_epi8(block, _mm_set1_epi8('\n')) ),
+            _mm_or_si128( _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')) ) );
+        return (unsigned int)_mm_movemask_epi8( ws );
+    }
+#endif
+
+    /** Returns the first non-whitespace character at or after p. */
+    inline const char*
+    s_skipSpace( const char* p, const char* end )
+    {
+#ifdef GODZI_KML_SSE2
+        // indentation between tuples is often long runs of blanks:
+        while( end - p >= 16 )
+        {
+            unsigned int mask = ~s_spaceMask( p ) & 0xFFFF;
+            if ( mask )
+                return p + s_lowestBit( mask );
+            p += 16;
+        }
+#endif
+        while( p < end && s_isSpace(*p) )
+            ++p;
+        return p;
+    }
+
+    /** Returns the first whitespace character at or after p. */
+    inline const char*
+    s_skipToSpace( const char* p, const char* end )
+    {
+#ifdef GODZI_KML_SSE2
+        while( end - p >= 16 )
+        {
+            unsigned int mask = s_spaceMask( p );
+            if ( mask )
+                return p + s_lowestBit( mask );
+            p += 16;
+        }
+#endif
+        while( p < end && !s_isSpace(*p) )
+            ++p;
+        return p;
+    }
+
+    /** Returns the last whitespace character before end, or 0L. */
+    inline const char*
+    s_lastSpace( const char* begin, const char* end )
+    {
+        while( end > begin )
+        {
+            if ( s_isSpace(*--end) )
+                return end;
+        }
+        return 0L;
+    }
+
+    /**
+     * Returns the last whitespace before end that separates two tuples, or
+     * 0L. A run of blanks right after a ',' is still inside a "lon, lat"
+     * tuple, so cutting there would drop the vertex.
+     */
+    inline const char*
+    s_lastBreak( const char* begin, const char* end )
+    {
+        for( const char* space = s_lastSpace(begin, end); space; )
+        {
+            const char* p = space;
+            while( p > begin && s_isSpace(p[-1]) )
+                --p;
+            if ( p == begin || p[-1] != ',' )
+                return space;
+            space = s_lastSpace( begin, p - 1 );
+        }
+        return 0L;
+    }
+
+    /**
+     * Converts a plain decimal ([+-]digits[.digits][e[+-]digits]). When the
+     * significant digits fit in 53 bits and the power of ten is exact, one
+     * multiply or divide is correctly rounded (Clinger's fast path), so the
+     * result matches strtod bit for bit. Returns 0L for anything else.
+     */
+    inline const char*
+    s_parseDecimal( const char* p, const char* end, double& out )
+    {
+        bool negative = false;
+        if ( p < end && (*p == '-' || *p == '+') )
+        {
+            negative = *p == '-';
+            ++p;
+        }
+
+        unsigned long long mantissa = 0;
+        int  significant = 0;
+        int  exponent    = 0;
+        bool anyDigits   = false;
+
+        for( ; p < end && (unsigned)(*p - '0') < 10u; ++p )
+        {
+            anyDigits = true;
+            if ( mantissa || *p != '0' )
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                ++significant;
+            }
+        }
+
+        if ( p < end && *p == '.' )
+        {
+            for( ++p; p < end && (unsigned)(*p - '0') < 10u; ++p )
+            {
+                anyDigits = true;
+                if ( mantissa || *p != '0' )
+                {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    ++significant;
+                }
+                --exponent;
+            }
+        }
+
+        if ( !anyDigits || significant > 19 )
+            return 0L;
+
+        if ( p < end && (*p == 'e' || *p == 'E') )
+        {
+            ++p;
+            bool negExp = false;
+            if ( p < end && (*p == '-' || *p == '+') )
+            {
+                negExp = *p == '-';
+                ++p;
+            }
+            if ( p >= end || (unsigned)(*p - '0') >= 10u )
+                return 0L;
+
+            int e = 0;
+            for( ; p < end && (unsigned)(*p - '0') < 10u; ++p )
+            {
+                if ( e < 10000 )
+                    e = e * 10 + (*p - '0');
+            }
+            exponent += negExp ? -e : e;
+        }
+
+        if ( mantissa > (1ULL << 53) || exponent < -22 || exponent > 22 )
+            return 0L;
+
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / s_pow10[-exponent] : value * s_pow10[exponent];
+        out = negative ? -value : value;
+        return p;
+    }
+
+    /** Converts one number, using strtod when the fast path declines. */
+    inline const char*
+    s_parseNumber( const char* p, const char* end, double& out )
+    {
+        const char* next = s_parseDecimal( p, end, out );
+        if ( next )
+            return next;
+
+        // strtod needs a terminated string and must not run past our range:
+        char token[MAX_FALLBACK_TOKEN+1];
+        int len = 0;
+        while( p + len < end && len < MAX_FALLBACK_TOKEN && p[len] != ',' && !s_isSpace(p[len]) )
+        {
+            token[len] = p[len];
+            ++len;
+        }
+        token[len] = 0;
+
+        char* tokenEnd;
+        out = ::strtod( token, &tokenEnd );
+        return tokenEnd == token ? 0L : p + (tokenEnd - token);
+    }
+}
+
+//------------------------------------------------------------------------
+
+std::size_t
+KMLCoordinates::parse( const char* text, std::size_t length, bool final, Vec3dVector& output )
+{
+    const char* p   = text;
+    const char* end = text + length;
+
+    if ( !final )
+    {
+        // only whole tuples; the rest waits for more text.
+        end = s_lastBreak( text, end );
+        if ( !end )
+            return 0;
+    }
+
+    for( p = s_skipSpace(p, end); p < end; p = s_skipSpace(p, end) )
+    {
+        double v[3] = { 0.0, 0.0, 0.0 };
+        int n = 0;
+        while( n < 3 )
+        {
+            const char* next = s_parseNumber( p, end, v[n] );
+            if ( !next )
+                break;
+            ++n;
+            p = next;
+
+            if ( n == 3 || p >= end || *p != ',' )
+                break;
+
+            // tolerate "lon, lat" the way strtod always has:
+            for( ++p; p < end && (*p == ' ' || *p == '\t'); ++p );
+        }
+
+        if ( n >= 2 )
+            output.push_back( osg::Vec3d(v[0], v[1], v[2]) );
+
+        // the rest of a malformed (or over-long) tuple is ignored:
+        p = s_skipToSpace( p, end );
+    }
+
+    return end - text;
+}
+
+bool
+KMLCoordinates::isVectorized()
+{
+#ifdef GODZI_KML_SSE2
+    return true;
+#else
+    return false;
+#endif
+}
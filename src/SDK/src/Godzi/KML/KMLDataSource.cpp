@@ -20,17 +20,374 @@
  */
 #include <Godzi/KML/KMLDataSource>
 #include <Godzi/KML/KMLFeatureSource>
+#include <Godzi/KML/KMLFeatureTable>
 #include <Godzi/KML/KMLActions>
+#include <Godzi/KML/KMLClusterIndex>
+#include <Godzi/KML/KMLGroundOverlayOptions>
+#include <Godzi/KML/KMLLiveLink>
+#include <Godzi/KML/KMLProgress>
+#include <Godzi/KML/KMLSymbolOptions>
+#include <Godzi/KML/KMLSymbolSource>
+#include <Godzi/Tasks>
 #include <osgEarthDrivers/model_feature_geom/FeatureGeomModelOptions>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <osg/Timer>
+#include <sstream>
 
 using namespace Godzi;
 using namespace Godzi::KML;
 
+// the object list shows at most this many clusters of a clustered source:
+#define MAX_LISTED_CLUSTERS 200
+
 namespace
 {
     const std::string EMPTY_STRING ="";
+
+    /** Background threads shared by all KML sources. */
+    Godzi::TaskPool*
+    s_getLoaderPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( 2 );
+        return s_pool.get();
+    }
+
+    /** Forwards read progress to the UI, a few times a second at most. */
+    class LoadProgress : public KMLProgressCallback
+    {
+    public:
+        LoadProgress( const std::string& location ) : _location( location ), _lastReport( 0 ) { }
+
+    protected:
+        void onProgress()
+        {
+            osg::Timer_t now = osg::Timer::instance()->tick();
+            if ( osg::Timer::instance()->delta_s( _lastReport, now ) >= 0.25 )
+            {
+                _lastReport = now;
+                DataSourceLoadNotifier::instance()->notifyProgress( _location, getBytesRead(), getFeaturesRead() );
+            }
+        }
+
+        std::string  _location;
+        osg::Timer_t _lastReport;
+    };
 }
 
+//------------------------------------------------------------------------
+
+/**
+ * Reads a source's features on a loader thread. A source and all its clones
+ * share one Loader, so the document is only read once. Afterwards it keeps
+ * the features of refreshing NetworkLinks up to date. A canceled read keeps
+ * nothing, and the next request for the features starts a new one.
+ */
+class KMLDataSource::Loader : public osg::Referenced, public KMLLiveLink::Listener
+{
+public:
+    Loader( const KMLFeatureSourceOptions& opt ) :
+    _opt( opt ),
+    _nextClusterUID( -1 ),
+    _started( false ),
+    _loaded( false ),
+    _hasGroundOverlays( false )
+    {
+        //nop
+    }
+
+    /** Queues a read, unless one is under way or done. */
+    void start()
+    {
+        osg::ref_ptr<Load> load;
+        {
+            ScopedLock lock( _stateMutex );
+            if ( _started )
+                return;
+            _started = true;
+            _progress = new LoadProgress( _opt.url().value() );
+            load = new Load( this, _progress.get() );
+        }
+        s_getLoaderPool()->add( load.get() );
+    }
+
+    /** Stops the read under way at its next progress report. */
+    void cancelLoad()
+    {
+        ScopedLock lock( _stateMutex );
+        if ( _progress.valid() )
+            _progress->cancel();
+    }
+
+    bool isStarted() const
+    {
+        ScopedLock lock( _stateMutex );
+        return _started;
+    }
+
+    bool isLoaded() const
+    {
+        ScopedLock lock( _stateMutex );
+        return _loaded;
+    }
+
+    /** Whether the source, once loaded, has any GroundOverlays. */
+    bool hasGroundOverlays() const
+    {
+        ScopedLock lock( _stateMutex );
+        return _hasGroundOverlays;
+    }
+
+    /**
+     * Only valid once isLoaded(). A clustered source lists its other
+     * features, then its points as clusters at the finest level that keeps
+     * the list short; locating a cluster zooms in to where it splits up,
+     * and expanding it lists what's in it. A spec's text is its feature's
+     * name, which the spec holds on to rather than copying.
+     */
+    void getDataObjectSpecs( DataObjectSpecVector& out_list ) const
+    {
+        ScopedLock lock( _stateMutex );
+        for( KMLFeatureTable::const_iterator i = _features.begin(); i != _features.end(); ++i )
+        {
+            if ( !_clusters.valid() || !KMLSymbolSource::isSymbol(i->get()) )
+                out_list.push_back( DataObjectSpec( (*i)->getFID(), i->get() ) );
+        }
+
+        if ( _clusters.valid() )
+        {
+            unsigned int level = _clusters->getLevelForCount( MAX_LISTED_CLUSTERS );
+            for( unsigned int i = _clusters->getLevelBegin(level); i < _clusters->getLevelEnd(level); ++i )
+                out_list.push_back( getClusterSpec(i) );
+        }
+    }
+
+    /**
+     * A listed cluster's sub-clusters, while it holds more points than a
+     * list should; its points once it doesn't (or it's at the last level).
+     */
+    bool getChildSpecs( int objectUID, DataObjectSpecVector& out_list ) const
+    {
+        ScopedLock lock( _stateMutex );
+        ClusterIndices::const_iterator c = _clusterIndices.find( objectUID );
+        if ( !_clusters.valid() || c == _clusterIndices.end() )
+            return false;
+
+        std::vector<unsigned int> children;
+        if ( _clusters->getCluster(c->second).getCount() > MAX_LISTED_CLUSTERS )
+            _clusters->getChildren( c->second, children );
+
+        if ( children.size() > 1 )
+        {
+            for( std::vector<unsigned int>::const_iterator i = children.begin(); i != children.end(); ++i )
+                out_list.push_back( getClusterSpec(*i) );
+        }
+        else
+        {
+            FeatureList members;
+            _clusters->getMembers( c->second, members );
+            for( FeatureList::const_iterator i = members.begin(); i != members.end(); ++i )
+                out_list.push_back( DataObjectSpec( (*i)->getFID(), i->get() ) );
+        }
+        return true;
+    }
+
+    Feature* getFeature( int objectUID ) const
+    {
+        ScopedLock lock( _stateMutex );
+        if ( KMLClusterIndex::isClusterUID(objectUID) )
+        {
+            ClusterIndices::const_iterator c = _clusterIndices.find( objectUID );
+            if ( !_clusters.valid() || c == _clusterIndices.end() )
+                return 0L;
+
+            // stand-ins are made on demand, and kept so the pointer stays good:
+            osg::ref_ptr<Feature>& placemark = _clusterPlacemarks[objectUID];
+            if ( !placemark.valid() )
+            {
+                Placemark* p = _clusters->createPlacemark( c->second );
+                p->setFID( objectUID );
+                placemark = p;
+            }
+            return placemark.get();
+        }
+
+        return _features.get( objectUID );
+    }
+
+    /** Patches in what a live link's refresh changed; on the refresh thread. */
+    void onLinkChanged( KMLLiveLink* link, const KMLLiveLink::Changes& changes )
+    {
+        {
+            ScopedLock lock( _stateMutex );
+
+            _features.remove( changes._removed );
+            for( FeatureList::const_iterator i = changes._added.begin(); i != changes._added.end(); ++i )
+                _features.add( i->get() );
+
+            _clusters = KMLClusterIndex::create( _features.getFeatures(), _opt );
+            remapClusters();
+        }
+
+        DataSourceLoadNotifier::instance()->notifyObjectsChanged( _opt.url().value() );
+    }
+
+    /** One read, on the loader pool. */
+    void load( KMLProgressCallback* progress )
+    {
+        osg::ref_ptr<KMLFeatureSource> fs = new KMLFeatureSource( _opt );
+        fs->setProgressCallback( progress );
+        fs->initialize();
+
+        bool canceled = false;
+        {
+            ScopedLock lock( _stateMutex );
+
+            // canceled, nothing is published or followed, and the next
+            // request starts over:
+            if ( progress->isCanceled() )
+            {
+                _started = false;
+                _progress = 0L;
+                canceled = true;
+            }
+        }
+
+        if ( canceled )
+        {
+            DataSourceLoadNotifier::instance()->notifyFinished( _opt.url().value(), true );
+            return;
+        }
+
+        {
+            ScopedLock lock( _stateMutex );
+
+            // the dataset's own features, compacted geometry and all: the tree
+            // only needs their attributes, and the model layer decodes what
+            // it draws.
+            const FeatureList& features = fs->getFeaturesList();
+            for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+                _features.add( i->get() );
+
+            FeatureList live;
+            for( LiveLinks::const_iterator i = fs->getLiveLinks().begin(); i != fs->getLiveLinks().end(); ++i )
+                (*i)->getFeatures( live );
+            for( FeatureList::const_iterator i = live.begin(); i != live.end(); ++i )
+                _features.add( i->get() );
+
+            // built once the whole set is in:
+            _clusters = KMLClusterIndex::create( _features.getFeatures(), _opt );
+
+            // follow the refreshing links from here on:
+            _liveLinks = fs->getLiveLinks();
+            for( LiveLinks::iterator i = _liveLinks.begin(); i != _liveLinks.end(); ++i )
+                (*i)->addListener( this );
+
+            _hasGroundOverlays = fs->getDataset() && !fs->getDataset()->getGroundOverlays().empty();
+            _loaded = true;
+            _progress = 0L;
+        }
+
+        DataSourceLoadNotifier::instance()->notifyFinished( _opt.url().value(), false );
+    }
+
+protected:
+    virtual ~Loader()
+    {
+        for( LiveLinks::iterator i = _liveLinks.begin(); i != _liveLinks.end(); ++i )
+            (*i)->removeListener( this );
+    }
+
+private:
+    /**
+     * A cluster's spec: a single point as itself; otherwise its first
+     * point's name and how many more, with the rest under it.
+     */
+    DataObjectSpec getClusterSpec( unsigned int index ) const
+    {
+        Feature* first = _clusters->getFirstMember( index );
+        unsigned int count = _clusters->getCluster( index ).getCount();
+        if ( count == 1 )
+            return DataObjectSpec( first->getFID(), first );
+
+        std::stringstream text;
+        text << first->getName() << " and " << (count - 1) << " more";
+        DataObjectSpec spec( getClusterUID(index), text.str() );
+        spec.setHasChildren( true );
+        return spec;
+    }
+
+    /**
+     * A cluster's object UID. It's kept by level and grid cell rather than
+     * by position in the index, so a cluster keeps its UID (and its item in
+     * the tree) when live changes rebuild the index.
+     */
+    int getClusterUID( unsigned int index ) const
+    {
+        CellKey key( _clusters->getCluster(index)._level, _clusters->getCell(index) );
+        ClusterUIDs::const_iterator i = _clusterUIDs.find( key );
+        if ( i != _clusterUIDs.end() )
+            return i->second;
+
+        int uid = _nextClusterUID--;
+        _clusterUIDs[key] = uid;
+        _clusterIndices[uid] = index;
+        return uid;
+    }
+
+    /** Finds the clusters listed so far in a new index. */
+    void remapClusters()
+    {
+        _clusterIndices.clear();
+        _clusterPlacemarks.clear();
+        if ( !_clusters.valid() || _clusterUIDs.empty() )
+            return;
+
+        unsigned int end = _clusters->getLevelEnd( _clusters->getNumLevels() - 1 );
+        for( unsigned int i = 0; i < end; ++i )
+        {
+            ClusterUIDs::const_iterator u = _clusterUIDs.find( CellKey(_clusters->getCluster(i)._level, _clusters->getCell(i)) );
+            if ( u != _clusterUIDs.end() )
+                _clusterIndices[u->second] = i;
+        }
+    }
+
+    /** Runs one read of the Loader, which it holds until done. */
+    class Load : public Godzi::Task
+    {
+    public:
+        Load( Loader* loader, KMLProgressCallback* progress ) : _loader( loader ), _progress( progress ) { }
+        void run() { _loader->load( _progress.get() ); }
+
+    private:
+        osg::ref_ptr<Loader>              _loader;
+        osg::ref_ptr<KMLProgressCallback> _progress;
+    };
+
+    typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+    typedef std::vector< osg::ref_ptr<KMLLiveLink> > LiveLinks;
+    typedef std::map< int, osg::ref_ptr<Feature> > ClusterPlacemarks;
+    typedef std::pair< unsigned int, unsigned long long > CellKey;
+    typedef std::map< CellKey, int > ClusterUIDs;
+    typedef std::map< int, unsigned int > ClusterIndices;
+
+    KMLFeatureSourceOptions           _opt;
+    osg::ref_ptr<KMLProgressCallback> _progress;
+    KMLFeatureTable                   _features;
+    LiveLinks                         _liveLinks;
+    osg::ref_ptr<KMLClusterIndex>     _clusters;
+    mutable ClusterPlacemarks         _clusterPlacemarks;
+    mutable ClusterUIDs               _clusterUIDs;    // every cluster listed, ever
+    mutable ClusterIndices            _clusterIndices; // where those are in _clusters
+    mutable int                       _nextClusterUID;
+    mutable OpenThreads::Mutex        _stateMutex;
+    bool                              _started;
+    bool                              _loaded;
+    bool                              _hasGroundOverlays;
+};
+
+//------------------------------------------------------------------------
+
 const std::string KMLDataSource::TYPE_KML = "KML"; // static initializer
 
 
@@ -39,11 +396,13 @@ KMLDataSource::KMLDataSource(const KMLFeatureSourceOptions& opt, bool visible)
 {
 	osgEarth::Config config = opt.toConfig();
 	_opt = KMLFeatureSourceOptions(osgEarth::ConfigOptions(config));
+	_loader = new Loader(_opt);
 }
 
 KMLDataSource::KMLDataSource(const KMLFeatureSourceOptions& opt, bool visible, KMLFeatureSource* source)
 : DataSource(visible), _fs(source)
 {
+	// clone() hands over the Loader, so the features aren't read again
 	osgEarth::Config config = opt.toConfig();
 	_opt = KMLFeatureSourceOptions(osgEarth::ConfigOptions(config));
 }
@@ -52,6 +411,12 @@ KMLDataSource::KMLDataSource(const Godzi::Config& conf)
 : DataSource(conf)
 {
 	_opt = KMLFeatureSourceOptions(osgEarth::ConfigOptions(conf.child("options")));
+	_loader = new Loader(_opt);
+}
+
+KMLDataSource::~KMLDataSource()
+{
+	//nop
 }
 
 Godzi::Config
@@ -70,39 +435,26 @@ KMLDataSource::getLocation() const
 	return _opt.url().isSet() && _opt.url()->size() > 0 ? _opt.url().get() : EMPTY_STRING;
 }
 
-void
-KMLDataSource::populate()
+bool
+KMLDataSource::getDataObjectSpecs( DataObjectSpecVector& out_results ) const
 {
-    if ( _features.empty() )
-    {
-        osg::ref_ptr<KMLFeatureSource> fs = new KMLFeatureSource( _opt );
-        fs->initialize();
+    out_results.clear();
 
-        osg::ref_ptr<FeatureCursor> cursor = fs->createFeatureCursor();
-        while( cursor->hasMore() )
-        {
-            Feature* f = cursor->nextFeature();
-            if ( f )
-            {
-                _features.push_back( f );
-                _featureMap[ f->getFID() ] = f;
-            }
-        }
+    if ( !_loader->isLoaded() )
+    {
+        _loader->start();
+        return false;
     }
+
+    _loader->getDataObjectSpecs( out_results );
+    return true;
 }
 
 bool
-KMLDataSource::getDataObjectSpecs( DataObjectSpecVector& out_results ) const
+KMLDataSource::getDataObjectChildSpecs( int objectUID, DataObjectSpecVector& out_results ) const
 {
-    const_cast<KMLDataSource*>(this)->populate();
-
     out_results.clear();
-    for( FeatureList::const_iterator i = _features.begin(); i != _features.end(); ++i )
-    {
-        Feature* f = i->get();
-        out_results.push_back( DataObjectSpec( f->getFID(), f->getName() ) );
-    }
-    return true;
+    return _loader->isLoaded() && _loader->getChildSpecs( objectUID, out_results );
 }
 
 bool
@@ -119,10 +471,25 @@ KMLDataSource::getDataObjectActionSpecs( DataObjectActionSpecVector& out_actionS
 Feature*
 KMLDataSource::getFeature( int objectUID ) const
 {
-    const_cast<KMLDataSource*>(this)->populate();
+    if ( !_loader->isLoaded() )
+    {
+        _loader->start();
+        return 0L;
+    }
 
-    FeaturesById::const_iterator i = _featureMap.find( objectUID );
-    return i != _featureMap.end() ? i->second : 0L;
+    return _loader->getFeature( objectUID );
+}
+
+bool
+KMLDataSource::isLoading() const
+{
+    return _loader->isStarted() && !_loader->isLoaded();
+}
+
+void
+KMLDataSource::cancelLoading() const
+{
+    _loader->cancelLoad();
 }
 
 osgEarth::ModelLayer*
@@ -130,8 +497,14 @@ KMLDataSource::createModelLayer() const
 {
     std::string name = _name.isSet() ? _name.get() : "KML Source";
 
+    // the symbol layer draws the points, and the live layer the feeds:
+    KMLFeatureSourceOptions featureOpt = _opt;
+    featureOpt.points() = false;
+    featureOpt.live() = false;
+    osgEarth::Config config = featureOpt.toConfig();
+
     osgEarth::Drivers::FeatureGeomModelOptions options;
-    options.featureOptions() = _opt;
+    options.featureOptions() = KMLFeatureSourceOptions(osgEarth::ConfigOptions(config));
 
     osgEarth::ModelLayerOptions layerOptions( name, options );
     layerOptions.overlay() = true;
@@ -140,22 +513,68 @@ KMLDataSource::createModelLayer() const
     return new osgEarth::ModelLayer( layerOptions );
 }
 
+osgEarth::ModelLayer*
+KMLDataSource::createSymbolLayer() const
+{
+    std::string name = _name.isSet() ? _name.get() : "KML Source";
+
+    KMLFeatureSourceOptions featureOpt = _opt;
+    featureOpt.live() = false;
+    osgEarth::Config config = featureOpt.toConfig();
+    KMLSymbolOptions options = KMLSymbolOptions(osgEarth::ConfigOptions(config));
+
+    return new osgEarth::ModelLayer( osgEarth::ModelLayerOptions(name, options) );
+}
+
+osgEarth::ModelLayer*
+KMLDataSource::createLiveLayer() const
+{
+    // the refreshing NetworkLinks' placemarks, points and all; small, so
+    // it's rebuilt whole when they change.
+    std::string name = _name.isSet() ? _name.get() : "KML Source";
+
+    KMLFeatureSourceOptions featureOpt = _opt;
+    featureOpt.live() = true;
+    osgEarth::Config config = featureOpt.toConfig();
+
+    osgEarth::Drivers::FeatureGeomModelOptions options;
+    options.featureOptions() = KMLFeatureSourceOptions(osgEarth::ConfigOptions(config));
+
+    osgEarth::ModelLayerOptions layerOptions( name + " (live)", options );
+    layerOptions.overlay() = true;
+
+    return new osgEarth::ModelLayer( layerOptions );
+}
+
 osgEarth::ImageLayer*
 KMLDataSource::createImageLayer() const
 {
-    return 0L;
+    // GroundOverlays aren't known until the source is read; the project asks
+    // again once it has loaded.
+    if ( !_loader->hasGroundOverlays() )
+        return 0L;
+
+    std::string name = _name.isSet() ? _name.get() : "KML Source";
+
+    // all of the source's options, so the overlays share its read:
+    osgEarth::Config config = _opt.toConfig();
+    KMLGroundOverlayOptions options = KMLGroundOverlayOptions(osgEarth::ConfigOptions(config));
+
+    return new osgEarth::ImageLayer( name, KMLGroundOverlayOptions(osgEarth::ConfigOptions(options.toConfig())) );
 }
 
 DataSource*
 KMLDataSource::clone() const
 {
 	// [jas] Following shouldn't be necessary, but the TMSOptions copy
-	// constructor does not appear to be working correctly.
-	KMLFeatureSourceOptions cOpt;
-	if (_opt.url().isSet())
-		cOpt.url() = _opt.url().get();
-
-	KMLDataSource* c = new KMLDataSource(cOpt, true, _fs);
+	// constructor does not appear to be working correctly. Going through
+	// the config copies every option, including ones added later.
+	KMLFeatureSourceOptions cOpt = KMLFeatureSourceOptions(osgEarth::ConfigOptions(_opt.toConfig()));
+
+	// the clone shares the Loader, and with it the features, specs and
+	// clusters; only the settings are copied.
+	KMLDataSource* c = new KMLDataSource(cOpt, _visible, _fs.get());
+	c->_loader = _loader;
 	if (_name.isSet())
 		c->name() = _name;
 
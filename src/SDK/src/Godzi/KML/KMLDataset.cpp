@@ -0,0 +1,384 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLDataset>
+#include <Godzi/Placemark>
+#include <Godzi/KML/KMLFeatureCache>
+#include <Godzi/KML/KMLStreamReader>
+#include <Godzi/Tasks>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLDataset] "
+
+// how often a caller waiting on the shared read checks whether it was canceled:
+#define READ_POLL_MS 100
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    typedef std::map< std::string, osg::ref_ptr<KMLDataset> > Datasets;
+
+    /** Every dataset, by URL and variant. */
+    struct Registry
+    {
+        OpenThreads::Mutex _mutex;
+        Datasets           _datasets;
+    };
+
+    Registry&
+    s_registry()
+    {
+        static Registry s_instance;
+        return s_instance;
+    }
+
+    /** Runs the shared reads. */
+    Godzi::TaskPool*
+    s_readPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( 2 );
+        return s_pool.get();
+    }
+
+    /** Vertex count above which the geometry is compacted; 0 (the default) for never. */
+    unsigned int
+    s_getCompactVertices( const KMLFeatureSourceOptions& options )
+    {
+        return options.compactVertices().isSet() ? *options.compactVertices() : 0u;
+    }
+}
+
+//------------------------------------------------------------------------
+
+/** The shared read's progress, passed on to the callers waiting on it as it comes. */
+class KMLDataset::ReadProgress : public KMLProgressCallback
+{
+public:
+    ReadProgress( KMLDataset* dataset ) : _dataset( dataset ), _lastBytes( 0 ), _lastFeatures( 0 ) { }
+
+protected:
+    void onProgress()
+    {
+        unsigned long bytes = getBytesRead(), features = getFeaturesRead();
+        _dataset->reportProgress( bytes - _lastBytes, features - _lastFeatures );
+        _lastBytes = bytes;
+        _lastFeatures = features;
+    }
+
+    KMLDataset*   _dataset; // the read holds it
+    unsigned long _lastBytes;
+    unsigned long _lastFeatures;
+};
+
+/** The shared read, on the read pool. It holds the dataset until it's done. */
+class KMLDataset::Read : public Godzi::Task
+{
+public:
+    Read( KMLDataset* dataset ) : _dataset( dataset ), _progress( new ReadProgress(dataset) ) { }
+
+    void run() { _dataset->readAll( _progress.get() ); }
+
+    osg::ref_ptr<KMLDataset>   _dataset;
+    osg::ref_ptr<ReadProgress> _progress;
+};
+
+//------------------------------------------------------------------------
+
+KMLDataset*
+KMLDataset::get( const std::string& url, const KMLFeatureSourceOptions& options )
+{
+    Registry& registry = s_registry();
+    ScopedLock lock( registry._mutex );
+
+    // only the registry holds these; nobody uses them anymore.
+    for( Datasets::iterator i = registry._datasets.begin(); i != registry._datasets.end(); )
+    {
+        if ( i->second->referenceCount() == 1 )
+        {
+            OE_INFO << LC << "Releasing " << i->second->getURL() << std::endl;
+            registry._datasets.erase( i++ );
+        }
+        else
+            ++i;
+    }
+
+    // compacting changes how the features are kept, not what they are:
+    std::stringstream key;
+    key << getVariant( options ) << " " << s_getCompactVertices( options ) << " " << url;
+    Datasets::iterator i = registry._datasets.find( key.str() );
+    if ( i != registry._datasets.end() )
+        return i->second.get();
+
+    KMLDataset* result = new KMLDataset( url, options );
+    registry._datasets[key.str()] = result;
+    return result;
+}
+
+std::string
+KMLDataset::getVariant( const KMLFeatureSourceOptions& options )
+{
+    // the two readers (and the link depth) can yield different features:
+    std::stringstream buf;
+    buf << (options.streaming() == true ? "stream" : "dom") << " " << options.maxLinkDepth().value();
+    return buf.str();
+}
+
+KMLDataset::KMLDataset( const std::string& url, const KMLFeatureSourceOptions& options ) :
+_url( url ),
+_options( options ),
+_complete( false ),
+_numWaiting( 0 )
+{
+    //NOP
+}
+
+KMLDataset::~KMLDataset()
+{
+    //NOP
+}
+
+bool
+KMLDataset::isComplete() const
+{
+    ScopedLock lock( _mutex );
+    return _complete;
+}
+
+FeatureList
+KMLDataset::getFeatures() const
+{
+    ScopedLock lock( _mutex );
+    return _features;
+}
+
+std::vector< osg::ref_ptr<KMZArchive> >
+KMLDataset::getArchives() const
+{
+    ScopedLock lock( _mutex );
+    return _archives;
+}
+
+KMLParser::RegionLinkList
+KMLDataset::getRegionLinks() const
+{
+    ScopedLock lock( _mutex );
+    return _regionLinks;
+}
+
+KMLParser::RefreshLinkList
+KMLDataset::getRefreshLinks() const
+{
+    ScopedLock lock( _mutex );
+    return _refreshLinks;
+}
+
+KMLParser::GroundOverlayList
+KMLDataset::getGroundOverlays() const
+{
+    ScopedLock lock( _mutex );
+    return _groundOverlays;
+}
+
+bool
+KMLDataset::read( KMLProgressCallback* progress )
+{
+    ScopedLock lock( _mutex );
+    if ( _complete )
+        return true;
+
+    ++_numWaiting;
+    if ( progress )
+        _waiting.push_back( progress );
+
+    while( !_complete && !(progress && progress->isCanceled()) )
+    {
+        // a read nobody waits on anymore winds down before the next starts:
+        if ( !_read.valid() )
+        {
+            _read = new Read( this );
+            s_readPool()->add( _read.get() );
+        }
+
+        // the read signals when it's done; a cancel is noticed on the next poll.
+        _readDone.wait( &_mutex, READ_POLL_MS );
+    }
+
+    --_numWaiting;
+    if ( progress )
+        _waiting.erase( std::find(_waiting.begin(), _waiting.end(), progress) );
+
+    if ( !_complete && _numWaiting == 0 && _read.valid() )
+    {
+        OE_INFO << LC << "Canceled reading " << _url << std::endl;
+        _read->_progress->cancel();
+    }
+
+    return _complete;
+}
+
+void
+KMLDataset::reportProgress( unsigned int bytes, unsigned int features )
+{
+    std::vector< osg::ref_ptr<KMLProgressCallback> > waiting;
+    {
+        ScopedLock lock( _mutex );
+        waiting = _waiting;
+    }
+
+    for( std::vector< osg::ref_ptr<KMLProgressCallback> >::const_iterator i = waiting.begin(); i != waiting.end(); ++i )
+    {
+        if ( bytes > 0 )
+            (*i)->addBytesRead( bytes );
+        if ( features > 0 )
+            (*i)->addFeaturesRead( features );
+    }
+}
+
+void
+KMLDataset::readAll( KMLProgressCallback* progress )
+{
+    FeatureList                             features;
+    std::vector< osg::ref_ptr<KMZArchive> > kmzs;
+    KMLParser::RegionLinkList               regionLinks;
+    KMLParser::RefreshLinkList              refreshLinks;
+    KMLParser::GroundOverlayList            groundOverlays;
+
+    std::string variant = getVariant( _options );
+    bool useCache = _options.cache() != false;
+
+    std::vector<std::string> archives;
+    if ( useCache && KMLFeatureCache::read( _url, variant, features, archives ) )
+    {
+        for( std::vector<std::string>::const_iterator i = archives.begin(); i != archives.end(); ++i )
+        {
+            osg::ref_ptr<KMZArchive> archive = KMZArchive::open( *i );
+            if ( archive.valid() )
+                kmzs.push_back( archive.get() );
+        }
+    }
+    else
+    {
+        std::set<std::string> documents;
+        if ( _options.streaming() == true )
+        {
+            KMLStreamReader reader;
+            reader.setProgressCallback( progress );
+            reader.read( _url, features );
+            kmzs = reader.getArchives();
+            documents = reader.getDocuments();
+            groundOverlays = reader.getGroundOverlays();
+        }
+        else
+        {
+            KMLParser parser;
+            if ( _options.maxLinkDepth().isSet() )
+                parser.setMaxLinkDepth( *_options.maxLinkDepth() );
+            if ( _options.linkFetchThreads().isSet() )
+                parser.setNumFetchThreads( *_options.linkFetchThreads() );
+            parser.setProgressCallback( progress );
+            if ( !parser.parse( _url, features ) )
+                OE_WARN << LC << "Failed to read " << _url << std::endl;
+            kmzs = parser.getArchives();
+            documents = parser.getDocuments();
+            regionLinks = parser.getRegionLinks();
+            refreshLinks = parser.getRefreshLinks();
+            groundOverlays = parser.getGroundOverlays();
+        }
+
+        // the cache only holds features read up front: not links left for
+        // paging or refreshing, nor GroundOverlays. Never a partial read.
+        if ( !progress->isCanceled() && useCache && !features.empty() &&
+             regionLinks.empty() && refreshLinks.empty() && groundOverlays.empty() )
+        {
+            // documents inside a KMZ are covered by the archive file itself:
+            std::vector<std::string> sources;
+            std::string entry;
+            for( std::set<std::string>::const_iterator i = documents.begin(); i != documents.end(); ++i )
+            {
+                if ( !KMZArchive::find( *i, entry ).valid() )
+                    sources.push_back( *i );
+            }
+            for( std::vector< osg::ref_ptr<KMZArchive> >::const_iterator i = kmzs.begin(); i != kmzs.end(); ++i )
+            {
+                sources.push_back( (*i)->getLocation() );
+                archives.push_back( (*i)->getLocation() );
+            }
+
+            KMLFeatureCache::write( _url, variant, sources, archives, features );
+        }
+    }
+
+    if ( !progress->isCanceled() )
+        compact( features );
+
+    ScopedLock lock( _mutex );
+
+    // a canceled read leaves nothing behind, and the next read() starts over:
+    if ( !progress->isCanceled() )
+    {
+        _features.swap( features );
+        _archives.swap( kmzs );
+        _regionLinks.swap( regionLinks );
+        _refreshLinks.swap( refreshLinks );
+        _groundOverlays.swap( groundOverlays );
+        _complete = true;
+        OE_INFO << LC << "Read " << _url << ": " << _features.size() << " features" << std::endl;
+    }
+
+    _read = 0L;
+    _readDone.broadcast();
+}
+
+void
+KMLDataset::compact( FeatureList& features ) const
+{
+    unsigned int threshold = s_getCompactVertices( _options );
+    if ( threshold == 0 )
+        return;
+
+    unsigned int total = 0;
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        const Geometry* geom = (*i)->getGeometry();
+        if ( geom )
+            total += CompactGeometry::countVertices( geom );
+    }
+
+    if ( total <= threshold )
+        return;
+
+    unsigned int count = 0;
+    for( FeatureList::iterator i = features.begin(); i != features.end(); ++i )
+    {
+        Placemark* p = dynamic_cast<Placemark*>( i->get() );
+        if ( p && p->compactGeometry() )
+            ++count;
+    }
+
+    OE_INFO << LC << _url << ": compacted the geometry of " << count << " features (" << total << " vertices)" << std::endl;
+}
@@ -0,0 +1,860 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLFeatureCache>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/MappedFile>
+#include <Godzi/Placemark>
+#include <Godzi/Tasks>
+#include <osgEarthSymbology/Geometry>
+#include <osgEarthSymbology/Style>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <curl/curl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth::Symbology;
+
+#define LC "[Godzi.KMLFeatureCache] "
+
+// bump whenever the layout below changes:
+#define CACHE_MAGIC   0x434B4447u  // "GDKC"
+#define CACHE_VERSION 5u
+
+#define NO_STYLE 0xFFFFFFFFu
+
+// seconds a HEAD may take when an entry is written, and when it's checked on reopen:
+#define WRITE_HEAD_TIMEOUT 20L
+#define CHECK_HEAD_TIMEOUT 4L
+
+// remote sources of an entry checked at once:
+#define CHECK_THREADS 4
+
+namespace
+{
+    std::string s_directory;
+
+    enum GeometryCode { GEOM_NONE, GEOM_POINTSET, GEOM_LINESTRING, GEOM_RING, GEOM_POLYGON, GEOM_MULTI };
+
+    enum SymbolFlags
+    {
+        HAS_LINE    = 1 << 0,
+        HAS_POLYGON = 1 << 1,
+        HAS_ICON    = 1 << 2,
+        HAS_LABEL   = 1 << 3,
+        HAS_MODEL   = 1 << 4
+    };
+
+    /** Appends native-endian binary values to a buffer. */
+    struct Writer
+    {
+        std::string _buf;
+
+        template<typename T> void pod( const T& v ) { _buf.append( reinterpret_cast<const char*>(&v), sizeof(T) ); }
+        void u8( unsigned char v ) { pod(v); }
+        void u32( unsigned int v ) { pod(v); }
+        void str( const std::string& s ) { u32( s.size() ); _buf.append( s ); }
+        void raw( const void* data, std::size_t size ) { _buf.append( static_cast<const char*>(data), size ); }
+    };
+
+    /** Reads values back out of a mapped cache file; any overrun marks the read failed. */
+    struct Reader
+    {
+        Reader( const char* data, std::size_t size ) : _p(data), _end(data + size), _ok(true) { }
+
+        const char* _p;
+        const char* _end;
+        bool        _ok;
+
+        bool have( std::size_t size ) { _ok = _ok && (std::size_t)(_end - _p) >= size; return _ok; }
+
+        template<typename T> T pod() {
+            T v = T();
+            if ( have(sizeof(T)) ) { ::memcpy( &v, _p, sizeof(T) ); _p += sizeof(T); }
+            return v; }
+        /** An element count, rejected if that many elements can't possibly follow. */
+        unsigned int count( std::size_t minElementSize ) {
+            unsigned int n = pod<unsigned int>();
+            if ( _ok && n > (std::size_t)(_end - _p) / minElementSize ) { _ok = false; n = 0; }
+            return n; }
+        unsigned char u8() { return pod<unsigned char>(); }
+        unsigned int u32() { return pod<unsigned int>(); }
+        std::string str() {
+            unsigned int size = u32();
+            if ( !have(size) ) return std::string();
+            std::string s( _p, size ); _p += size; return s; }
+        void raw( void* out, std::size_t size ) {
+            if ( have(size) ) { ::memcpy( out, _p, size ); _p += size; } }
+    };
+
+    /** FNV-1a; names the cache file for a location. */
+    std::string
+    s_hashName( const std::string& text )
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        for( std::string::const_iterator i = text.begin(); i != text.end(); ++i )
+        {
+            h ^= (unsigned char)*i;
+            h *= 1099511628211ULL;
+        }
+        char buf[32];
+        ::sprintf( buf, "%016llx", h );
+        return buf;
+    }
+
+    /** Size and modification time of a local file; false if it can't be read. */
+    bool
+    s_fileStamp( const std::string& path, long long& out_size, long long& out_mtime )
+    {
+        struct stat info;
+        if ( ::stat( path.c_str(), &info ) != 0 )
+            return false;
+        out_size  = (long long)info.st_size;
+        out_mtime = (long long)info.st_mtime;
+        return true;
+    }
+
+    /** The validators in the last response of a (possibly redirected) HEAD. */
+    struct Validators
+    {
+        std::string _etag;
+        std::string _lastModified;
+    };
+
+    std::string
+    s_trim( const std::string& text )
+    {
+        std::string::size_type first = text.find_first_not_of( " \t\r\n" );
+        if ( first == std::string::npos )
+            return std::string();
+        return text.substr( first, text.find_last_not_of( " \t\r\n" ) - first + 1 );
+    }
+
+    size_t
+    s_headerLine( char* data, size_t size, size_t count, void* user )
+    {
+        Validators* v = static_cast<Validators*>( user );
+        std::string line( data, size * count );
+
+        // a new status line starts the headers of the next hop:
+        if ( line.compare( 0, 5, "HTTP/" ) == 0 )
+        {
+            *v = Validators();
+        }
+        else
+        {
+            std::string::size_type colon = line.find( ':' );
+            if ( colon != std::string::npos )
+            {
+                std::string name = osgDB::convertToLowerCase( line.substr( 0, colon ) );
+                if ( name == "etag" )
+                    v->_etag = s_trim( line.substr( colon + 1 ) );
+                else if ( name == "last-modified" )
+                    v->_lastModified = s_trim( line.substr( colon + 1 ) );
+            }
+        }
+        return size * count;
+    }
+
+    enum StampResult { STAMP_OK, STAMP_NONE, STAMP_UNREACHABLE };
+
+    /**
+     * Asks a server, with a HEAD request, for what identifies the current
+     * version of a remote document: its ETag, or failing that its
+     * Last-Modified date. STAMP_NONE if the server answers with neither,
+     * STAMP_UNREACHABLE if it doesn't answer within the timeout (seconds).
+     */
+    StampResult
+    s_remoteStamp( const std::string& url, long timeout, std::string& out_stamp )
+    {
+        CURL* curl = curl_easy_init();
+        if ( !curl )
+            return STAMP_UNREACHABLE;
+
+        Validators v;
+        curl_easy_setopt( curl, CURLOPT_URL, url.c_str() );
+        curl_easy_setopt( curl, CURLOPT_NOBODY, 1L );
+        curl_easy_setopt( curl, CURLOPT_FOLLOWLOCATION, 1L );
+        curl_easy_setopt( curl, CURLOPT_NOSIGNAL, 1L );
+        curl_easy_setopt( curl, CURLOPT_CONNECTTIMEOUT, std::max(timeout / 2, 1L) );
+        curl_easy_setopt( curl, CURLOPT_TIMEOUT, timeout );
+        curl_easy_setopt( curl, CURLOPT_HEADERFUNCTION, s_headerLine );
+        curl_easy_setopt( curl, CURLOPT_WRITEHEADER, &v );
+
+        CURLcode result = curl_easy_perform( curl );
+        long code = 0;
+        curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &code );
+        curl_easy_cleanup( curl );
+
+        if ( result != CURLE_OK )
+            return STAMP_UNREACHABLE;
+        if ( code != 200 )
+            return STAMP_NONE;
+
+        if ( !v._etag.empty() )
+            out_stamp = "ETag " + v._etag;
+        else if ( !v._lastModified.empty() )
+            out_stamp = "Last-Modified " + v._lastModified;
+        else
+            return STAMP_NONE;
+        return STAMP_OK;
+    }
+
+    /** Runs the checks of remote sources, so an entry's are made at once. */
+    Godzi::TaskPool*
+    s_checkPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( CHECK_THREADS );
+        return s_pool.get();
+    }
+
+    /** Asks for the current stamp of one remote source of an entry. */
+    class RemoteCheck : public Godzi::Task
+    {
+    public:
+        RemoteCheck( const std::string& url, const std::string& stamp ) :
+        _url( url ),
+        _stamp( stamp ),
+        _result( STAMP_UNREACHABLE )
+        {
+            //nop
+        }
+
+        void run()
+        {
+            _result = s_remoteStamp( _url, CHECK_HEAD_TIMEOUT, _current );
+        }
+
+        /** Whether the source has changed since the entry was written; an unreachable one hasn't, as far as we know. */
+        bool hasChanged() const
+        {
+            return _result == STAMP_NONE || ( _result == STAMP_OK && _current != _stamp );
+        }
+
+        std::string _url;
+        std::string _stamp;    // as written
+        std::string _current;
+        StampResult _result;
+    };
+
+    std::string
+    s_cachePath( const std::string& location, const std::string& variant )
+    {
+        return osgDB::concatPaths( s_directory, s_hashName( location + '\n' + variant ) + ".gkc" );
+    }
+
+    //--------------------------------------------------------------------
+
+    template<typename T>
+    void
+    s_writePlacement( Writer& w, const T* s )
+    {
+        w.u8( s->altitude().isSet() );
+        w.pod<int>( s->altitude().isSet() ? (int)s->altitude()->getAltitudeMode() : 0 );
+        w.u8( s->extrude().isSet() );
+        w.u8( s->extrude().isSet() && s->extrude()->getExtrude() );
+    }
+
+    template<typename T>
+    void
+    s_readPlacement( Reader& r, T* s )
+    {
+        bool hasAltitude = r.u8() != 0;
+        int  mode        = r.pod<int>();
+        bool hasExtrude  = r.u8() != 0;
+        bool extrude     = r.u8() != 0;
+        if ( hasAltitude )
+            s->altitude()->setAltitudeMode( (KMLAltitude::AltitudeMode)mode );
+        if ( hasExtrude )
+            s->extrude()->setExtrude( extrude );
+    }
+
+    /**
+     * Serializes everything in a style except the label text, which is
+     * always the placemark's name.
+     */
+    void
+    s_writeStyle( Writer& w, const Style& style )
+    {
+        const KMLLineSymbol*    line  = style.get<KMLLineSymbol>();
+        const KMLPolygonSymbol* poly  = style.get<KMLPolygonSymbol>();
+        const KMLIconSymbol*    icon  = style.get<KMLIconSymbol>();
+        const KMLLabelSymbol*   label = style.get<KMLLabelSymbol>();
+        const KMLModelSymbol*   model = style.get<KMLModelSymbol>();
+
+        w.u8( (line ? HAS_LINE : 0) | (poly ? HAS_POLYGON : 0) | (icon ? HAS_ICON : 0) |
+              (label ? HAS_LABEL : 0) | (model ? HAS_MODEL : 0) );
+
+        if ( line )
+        {
+            s_writePlacement( w, line );
+            w.u8( line->stroke().isSet() );
+            w.pod( line->stroke()->color() );
+            w.u8( line->stroke()->width().isSet() );
+            w.pod( line->stroke()->width().value() );
+        }
+
+        if ( poly )
+        {
+            s_writePlacement( w, poly );
+            w.u8( poly->fill().isSet() );
+            w.pod( poly->fill()->color() );
+        }
+
+        if ( icon )
+        {
+            s_writePlacement( w, icon );
+            w.str( icon->url().isSet() ? icon->url()->expr() : std::string() );
+            w.u8( icon->scale().isSet() );
+            w.pod( icon->scale().value() );
+            w.u8( icon->color().isSet() );
+            w.pod( icon->color().value() );
+        }
+
+        if ( label )
+        {
+            w.u8( label->fill().isSet() );
+            w.pod( label->fill()->color() );
+            w.u8( label->size().isSet() );
+            w.pod( label->size().value() );
+        }
+
+        if ( model )
+        {
+            w.str( model->url().isSet() ? model->url()->expr() : std::string() );
+            w.pod( model->getLocation() );
+            w.pod( model->getScale() );
+            w.pod( model->getHeading() );
+            w.pod( model->getTilt() );
+            w.pod( model->getRoll() );
+        }
+    }
+
+    /** A style read back from the cache, with its label kept apart. */
+    struct CachedStyle
+    {
+        Style                        _style;
+        osg::ref_ptr<KMLLabelSymbol> _label;
+    };
+
+    void
+    s_readStyle( Reader& r, CachedStyle& out )
+    {
+        unsigned int flags = r.u8();
+
+        if ( flags & HAS_LINE )
+        {
+            KMLLineSymbol* s = new KMLLineSymbol;
+            s_readPlacement( r, s );
+            bool hasStroke = r.u8() != 0;
+            osg::Vec4f color = r.pod<osg::Vec4f>();
+            bool hasWidth = r.u8() != 0;
+            float width = r.pod<float>();
+            if ( hasStroke )
+                s->stroke()->color() = color;
+            if ( hasWidth )
+                s->stroke()->width() = width;
+            out._style.addSymbol( s );
+        }
+
+        if ( flags & HAS_POLYGON )
+        {
+            KMLPolygonSymbol* s = new KMLPolygonSymbol;
+            s_readPlacement( r, s );
+            bool hasFill = r.u8() != 0;
+            osg::Vec4f color = r.pod<osg::Vec4f>();
+            if ( hasFill )
+                s->fill()->color() = color;
+            out._style.addSymbol( s );
+        }
+
+        if ( flags & HAS_ICON )
+        {
+            KMLIconSymbol* s = new KMLIconSymbol;
+            s_readPlacement( r, s );
+            std::string url = r.str();
+            bool hasScale = r.u8() != 0;
+            osg::Vec3f scale = r.pod<osg::Vec3f>();
+            bool hasColor = r.u8() != 0;
+            osg::Vec4f color = r.pod<osg::Vec4f>();
+            if ( !url.empty() )
+                s->url() = url;
+            if ( hasScale )
+                s->scale() = scale;
+            if ( hasColor )
+                s->color() = color;
+            out._style.addSymbol( s );
+        }
+
+        if ( flags & HAS_LABEL )
+        {
+            KMLLabelSymbol* s = new KMLLabelSymbol;
+            bool hasFill = r.u8() != 0;
+            osg::Vec4f color = r.pod<osg::Vec4f>();
+            bool hasSize = r.u8() != 0;
+            float size = r.pod<float>();
+            if ( hasFill )
+                s->fill()->color() = color;
+            if ( hasSize )
+                s->size() = size;
+            out._label = s;
+        }
+
+        if ( flags & HAS_MODEL )
+        {
+            KMLModelSymbol* s = new KMLModelSymbol;
+            std::string url = r.str();
+            if ( !url.empty() )
+                s->url() = url;
+            s->setLocation( r.pod<osg::Vec3d>() );
+            s->setScale( r.pod<osg::Vec3d>() );
+            s->setHeading( r.pod<double>() );
+            s->setTilt( r.pod<double>() );
+            s->setRoll( r.pod<double>() );
+            out._style.addSymbol( s );
+        }
+    }
+
+    //--------------------------------------------------------------------
+
+    void
+    s_writePoints( Writer& w, const Geometry* geom )
+    {
+        w.u32( geom->size() );
+        if ( geom->size() > 0 )
+            w.raw( &(*geom)[0], geom->size() * sizeof(osg::Vec3d) );
+    }
+
+    /** Fills a new geometry with one block copy out of the mapping. */
+    template<typename T>
+    T*
+    s_readPoints( Reader& r )
+    {
+        unsigned int size = r.u32();
+        if ( !r.have( size * sizeof(osg::Vec3d) ) )
+            return 0L;
+
+        T* geom = new T();
+        geom->asVector().resize( size );
+        if ( size > 0 )
+            r.raw( &geom->asVector()[0], size * sizeof(osg::Vec3d) );
+        return geom;
+    }
+
+    void
+    s_writeGeometry( Writer& w, const Geometry* geom )
+    {
+        if ( !geom )
+        {
+            w.u8( GEOM_NONE );
+            return;
+        }
+
+        switch( geom->getType() )
+        {
+        case Geometry::TYPE_POINTSET:
+            w.u8( GEOM_POINTSET );
+            s_writePoints( w, geom );
+            break;
+
+        case Geometry::TYPE_LINESTRING:
+            w.u8( GEOM_LINESTRING );
+            s_writePoints( w, geom );
+            break;
+
+        case Geometry::TYPE_RING:
+            w.u8( GEOM_RING );
+            s_writePoints( w, geom );
+            break;
+
+        case Geometry::TYPE_POLYGON:
+            {
+                // rings were already rewound when parsed, so store them as-is.
+                const Polygon* poly = static_cast<const Polygon*>( geom );
+                w.u8( GEOM_POLYGON );
+                s_writePoints( w, poly );
+                w.u32( poly->getHoles().size() );
+                for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+                    s_writePoints( w, i->get() );
+            }
+            break;
+
+        case Geometry::TYPE_MULTI:
+            {
+                const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+                w.u8( GEOM_MULTI );
+                w.u32( multi->getComponents().size() );
+                for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+                    s_writeGeometry( w, i->get() );
+            }
+            break;
+
+        default:
+            w.u8( GEOM_NONE );
+            break;
+        }
+    }
+
+    Geometry*
+    s_readGeometry( Reader& r )
+    {
+        switch( r.u8() )
+        {
+        case GEOM_POINTSET:   return s_readPoints<PointSet>( r );
+        case GEOM_LINESTRING: return s_readPoints<LineString>( r );
+        case GEOM_RING:       return s_readPoints<Ring>( r );
+
+        case GEOM_POLYGON:
+            {
+                osg::ref_ptr<Polygon> poly = s_readPoints<Polygon>( r );
+                unsigned int numHoles = r.u32();
+                for( unsigned int i = 0; i < numHoles && r._ok; ++i )
+                {
+                    Ring* hole = s_readPoints<Ring>( r );
+                    if ( hole )
+                        poly->getHoles().push_back( hole );
+                }
+                return r._ok ? poly.release() : 0L;
+            }
+
+        case GEOM_MULTI:
+            {
+                osg::ref_ptr<MultiGeometry> multi = new MultiGeometry;
+                unsigned int size = r.u32();
+                for( unsigned int i = 0; i < size && r._ok; ++i )
+                {
+                    Geometry* part = s_readGeometry( r );
+                    if ( part )
+                        multi->getComponents().push_back( part );
+                }
+                return r._ok ? multi.release() : 0L;
+            }
+        }
+        return 0L;
+    }
+}
+
+//------------------------------------------------------------------------
+
+void
+KMLFeatureCache::setDirectory( const std::string& path )
+{
+    s_directory = path;
+}
+
+const std::string&
+KMLFeatureCache::getDirectory()
+{
+    return s_directory;
+}
+
+bool
+KMLFeatureCache::read(const std::string&        location,
+                      const std::string&        variant,
+                      FeatureList&              out_features,
+                      std::vector<std::string>& out_archives )
+{
+    if ( s_directory.empty() )
+        return false;
+
+    osg::ref_ptr<MappedFile> file = new MappedFile();
+    if ( !file->open( s_cachePath(location, variant) ) )
+        return false;
+
+    Reader r( file->data(), file->size() );
+
+    if ( r.u32() != CACHE_MAGIC || r.u32() != CACHE_VERSION || r.str() != location || r.str() != variant )
+        return false;
+
+    // stale if anything it was built from has changed. Remote sources are
+    // all asked at once, while the local ones are checked here; a server
+    // that can't be reached in time leaves the cached copy in use.
+    std::vector< osg::ref_ptr<RemoteCheck> > checks;
+    unsigned int numSources = r.u32();
+    for( unsigned int i = 0; i < numSources && r._ok; ++i )
+    {
+        std::string path = r.str();
+        if ( r.u8() )
+        {
+            std::string stamp = r.str();
+            if ( r._ok )
+            {
+                checks.push_back( new RemoteCheck(path, stamp) );
+                s_checkPool()->add( checks.back().get() );
+            }
+            continue;
+        }
+
+        long long size  = r.pod<long long>();
+        long long mtime = r.pod<long long>();
+        long long curSize, curTime;
+        bool same = s_fileStamp( path, curSize, curTime ) && curSize == size && curTime == mtime;
+        if ( !same && r._ok )
+        {
+            OE_INFO << LC << location << ": " << path << " has changed, cache entry is stale" << std::endl;
+            for( std::vector< osg::ref_ptr<RemoteCheck> >::iterator c = checks.begin(); c != checks.end(); ++c )
+                (*c)->cancel();
+            return false;
+        }
+    }
+
+    bool stale = false;
+    for( std::vector< osg::ref_ptr<RemoteCheck> >::iterator c = checks.begin(); c != checks.end(); ++c )
+    {
+        RemoteCheck* check = c->get();
+        if ( stale )
+        {
+            check->cancel();
+            continue;
+        }
+
+        check->wait();
+        if ( check->hasChanged() )
+        {
+            OE_INFO << LC << location << ": " << check->_url << " has changed, cache entry is stale" << std::endl;
+            stale = true;
+        }
+        else if ( check->_result == STAMP_UNREACHABLE )
+        {
+            OE_INFO << LC << location << ": can't reach " << check->_url << ", using the cached copy" << std::endl;
+        }
+    }
+    if ( stale )
+        return false;
+
+    std::vector<std::string> archives( r.count(sizeof(unsigned int)) );
+    for( unsigned int i = 0; i < archives.size() && r._ok; ++i )
+        archives[i] = r.str();
+
+    std::vector<CachedStyle> styles( r.count(1) );
+    for( unsigned int i = 0; i < styles.size() && r._ok; ++i )
+        s_readStyle( r, styles[i] );
+
+    FeatureList features;
+    unsigned int numFeatures = r.u32();
+    for( unsigned int i = 0; i < numFeatures && r._ok; ++i )
+    {
+        Placemark* p = new Placemark( r.pod<long long>() );
+        features.push_back( p );
+
+        p->setName( r.str() );
+
+        if ( r.u8() )
+        {
+            osg::Vec3d focal = r.pod<osg::Vec3d>();
+            double heading = r.pod<double>();
+            double pitch   = r.pod<double>();
+            double range   = r.pod<double>();
+            p->lookAt() = Viewpoint( focal, heading, pitch, range );
+        }
+
+        if ( r.u8() )
+        {
+            double xMin = r.pod<double>(), yMin = r.pod<double>();
+            double xMax = r.pod<double>(), yMax = r.pod<double>();
+            double minLodPixels = r.pod<double>();
+            double maxLodPixels = r.pod<double>();
+            p->region() = Region( Bounds( xMin, yMin, xMax, yMax ), minLodPixels, maxLodPixels );
+        }
+
+        Geometry* geom = s_readGeometry( r );
+        if ( geom )
+            p->setGeometry( geom );
+
+        // shared symbols, label included; same as the parser.
+        unsigned int styleIndex = r.u32();
+        if ( styleIndex != NO_STYLE && styleIndex < styles.size() )
+        {
+            const CachedStyle& style = styles[styleIndex];
+            p->style() = style._style;
+            if ( style._label.valid() )
+                p->style()->addSymbol( style._label.get() );
+        }
+    }
+
+    if ( !r._ok )
+    {
+        OE_WARN << LC << location << ": cache entry is corrupt, ignoring it" << std::endl;
+        return false;
+    }
+
+    out_features.swap( features );
+    out_archives.swap( archives );
+    OE_INFO << LC << location << ": read " << out_features.size() << " features from cache" << std::endl;
+    return true;
+}
+
+bool
+KMLFeatureCache::write(const std::string&              location,
+                       const std::string&              variant,
+                       const std::vector<std::string>& sources,
+                       const std::vector<std::string>& archives,
+                       const FeatureList&              features )
+{
+    if ( s_directory.empty() )
+        return false;
+
+    Writer w;
+    w.u32( CACHE_MAGIC );
+    w.u32( CACHE_VERSION );
+    w.str( location );
+    w.str( variant );
+
+    w.u32( sources.size() );
+    for( std::vector<std::string>::const_iterator i = sources.begin(); i != sources.end(); ++i )
+    {
+        // a server's copy is asked for after the read, so a change in between
+        // goes unnoticed until the document changes again.
+        bool remote = osgDB::containsServerAddress( *i );
+        long long size, mtime;
+        std::string stamp;
+        if ( remote ? s_remoteStamp( *i, WRITE_HEAD_TIMEOUT, stamp ) != STAMP_OK : !s_fileStamp( *i, size, mtime ) )
+        {
+            OE_INFO << LC << location << ": not cacheable (can't tell when " << *i << " changes)" << std::endl;
+            return false;
+        }
+        w.str( *i );
+        w.u8( remote );
+        if ( remote )
+        {
+            w.str( stamp );
+        }
+        else
+        {
+            w.pod( size );
+            w.pod( mtime );
+        }
+    }
+
+    w.u32( archives.size() );
+    for( std::vector<std::string>::const_iterator i = archives.begin(); i != archives.end(); ++i )
+        w.str( *i );
+
+    // Each distinct style is stored once; placemarks refer to it by index.
+    Writer styleTable;
+    std::map<std::string, unsigned int> styleIndex;
+    std::vector<unsigned int> featureStyles;
+    featureStyles.reserve( features.size() );
+
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        const Feature* f = i->get();
+        if ( !f->style().isSet() )
+        {
+            featureStyles.push_back( NO_STYLE );
+            continue;
+        }
+
+        Writer style;
+        s_writeStyle( style, *f->style() );
+
+        std::map<std::string, unsigned int>::iterator s = styleIndex.find( style._buf );
+        if ( s == styleIndex.end() )
+        {
+            s = styleIndex.insert( std::make_pair(style._buf, (unsigned int)styleIndex.size()) ).first;
+            styleTable.raw( style._buf.data(), style._buf.size() );
+        }
+        featureStyles.push_back( s->second );
+    }
+
+    w.u32( styleIndex.size() );
+    w.raw( styleTable._buf.data(), styleTable._buf.size() );
+
+    w.u32( features.size() );
+    unsigned int n = 0;
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i, ++n )
+    {
+        const Feature* f = i->get();
+        w.pod<long long>( f->getFID() );
+        w.str( f->getName() );
+
+        const Placemark* p = dynamic_cast<const Placemark*>( f );
+        if ( p && p->lookAt().isSet() )
+        {
+            const Viewpoint& vp = p->lookAt().get();
+            w.u8( 1 );
+            w.pod( vp.getFocalPoint() );
+            w.pod( vp.getHeading() );
+            w.pod( vp.getPitch() );
+            w.pod( vp.getRange() );
+        }
+        else
+        {
+            w.u8( 0 );
+        }
+
+        if ( p && p->region().isSet() )
+        {
+            const Region& region = p->region().get();
+            w.u8( 1 );
+            w.pod( region.getBounds().xMin() );
+            w.pod( region.getBounds().yMin() );
+            w.pod( region.getBounds().xMax() );
+            w.pod( region.getBounds().yMax() );
+            w.pod( region.getMinLodPixels() );
+            w.pod( region.getMaxLodPixels() );
+        }
+        else
+        {
+            w.u8( 0 );
+        }
+
+        s_writeGeometry( w, f->getGeometry() );
+        w.u32( featureStyles[n] );
+    }
+
+    // write aside and rename, so a reader never sees a partial file:
+    std::string path = s_cachePath( location, variant );
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out( temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+        if ( !out.is_open() )
+        {
+            OE_WARN << LC << "Failed to write " << temp << std::endl;
+            return false;
+        }
+        out.write( w._buf.data(), w._buf.size() );
+        if ( !out.good() )
+        {
+            out.close();
+            ::remove( temp.c_str() );
+            return false;
+        }
+    }
+
+    ::remove( path.c_str() );
+    if ( ::rename( temp.c_str(), path.c_str() ) != 0 )
+    {
+        ::remove( temp.c_str() );
+        return false;
+    }
+
+    OE_INFO << LC << location << ": cached " << features.size() << " features" << std::endl;
+    return true;
+}
@@ -19,18 +19,42 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include <Godzi/KML/KMLFeatureSource>
-#include <Godzi/KML/KMLParser>
+#include <Godzi/KML/KMLSpatialIndex>
+#include <Godzi/KML/KMLSymbolSource>
 
 #include <osgEarth/Registry>
 #include <osgEarth/FileUtils>
 
 #include <osgDB/FileNameUtils>
 
+#include <algorithm>
+
 using namespace Godzi::KML;
 
+#define LC "[Godzi.KMLFeatureSource] "
+
+#define DEFAULT_FIRST_LEVEL 4
+#define DEFAULT_MAX_LEVEL   8
+
+namespace
+{
+    /**
+     * Cursor over the features, with any compacted geometry decoded into
+     * copies, since the model driver only knows getGeometry(). The copies
+     * are the caller's to drop; a reader that doesn't draw should use
+     * getFeaturesList() rather than keep them.
+     */
+    FeatureCursor*
+    s_createCursor( FeatureList& features )
+    {
+        for( FeatureList::iterator i = features.begin(); i != features.end(); ++i )
+            *i = Placemark::expand( i->get() );
+        return new FeatureListCursor( features );
+    }
+}
 
 KMLFeatureSource::KMLFeatureSource(const KMLFeatureSourceOptions& options) :
-FeatureSource(options), _options(options)
+FeatureSource(options), _options(options), _hasRegions(false)
 {
 	//nop
 }
@@ -38,8 +62,23 @@ FeatureSource(options), _options(options)
 FeatureProfile*
 KMLFeatureSource::createFeatureProfile()
 {
-  return new FeatureProfile(
-      osgEarth::Registry::instance()->getGlobalGeodeticProfile()->getExtent() );
+    const osgEarth::Profile* geodetic = osgEarth::Registry::instance()->getGlobalGeodeticProfile();
+    FeatureProfile* profile = new FeatureProfile( geodetic->getExtent() );
+
+    // Tiled, the model driver asks for one tile's worth of features at a
+    // time (answered by the spatial index) and pages tiles by range.
+    if ( isTiled() )
+    {
+        unsigned int firstLevel, maxLevel;
+        getLevels( firstLevel, maxLevel );
+
+        profile->setProfile( geodetic );
+        profile->setTiled( true );
+        profile->setFirstLevel( firstLevel );
+        profile->setMaxLevel( maxLevel );
+    }
+
+    return profile;
 }
 
 void
@@ -51,16 +90,186 @@ KMLFeatureSource::initialize( const std::string& referenceURI )
     if ( _options.url().isSet() )
     {
         _url = osgEarth::getFullPath( referenceURI, _options.url().value() );
+        readFeatures();
+
+        // only the refreshing links' placemarks, which aren't indexed:
+        if ( _options.live() == true )
+            _features.clear();
+
+        // points left to the symbol layer:
+        if ( _options.points().isSet() && !*_options.points() )
+        {
+            FeatureList features;
+            features.reserve( _features.size() );
+            for( FeatureList::const_iterator i = _features.begin(); i != _features.end(); ++i )
+            {
+                if ( !KMLSymbolSource::isSymbol(i->get()) )
+                    features.push_back( i->get() );
+            }
+            _features.swap( features );
+        }
+
+        _index = new KMLSpatialIndex( _features );
+        OE_INFO << LC << _url << ": indexed " << _index->getNumIndexed() << " of " << _features.size() << " features" << std::endl;
+
+        initTiling();
+
+        // the first fetch of each refreshing link is part of the load (of
+        // the layers that serve them):
+        for( KMLParser::RefreshLinkList::const_iterator i = _refreshLinks.begin(); i != _refreshLinks.end() && _options.live() != false; ++i )
+        {
+            osg::ref_ptr<KMLLiveLink> live = KMLLiveLink::get( *i, _options );
+            live->ensureLoaded();
+            _liveLinks.push_back( live.get() );
+        }
+    }
+}
+
+bool
+KMLFeatureSource::isTiled() const
+{
+    if ( _options.live() == true )
+        return false;
+
+    if ( _options.tiled().isSet() )
+        return *_options.tiled();
+
+    return _hasRegions || !_regionLinks.empty();
+}
+
+void
+KMLFeatureSource::getLevels( unsigned int& out_firstLevel, unsigned int& out_maxLevel ) const
+{
+    out_firstLevel = _options.firstLevel().isSet() ? *_options.firstLevel() : DEFAULT_FIRST_LEVEL;
+    out_maxLevel   = std::max( out_firstLevel, _options.maxLevel().isSet() ? *_options.maxLevel() : DEFAULT_MAX_LEVEL );
+}
+
+void
+KMLFeatureSource::initTiling()
+{
+    _hasRegions = false;
+    long nextUID = 0;
+    for( FeatureList::const_iterator i = _features.begin(); i != _features.end(); ++i )
+    {
+        const Placemark* p = dynamic_cast<const Placemark*>( i->get() );
+        if ( p && p->region().isSet() )
+            _hasRegions = true;
+        nextUID = std::max( nextUID, (*i)->getFID() + 1 );
+    }
 
-        KMLParser parser;
-        parser.parse( _url, _features );
+    _levelIndex = 0L;
+    _pager = 0L;
+    if ( !isTiled() )
+        return;
+
+    unsigned int firstLevel, maxLevel;
+    getLevels( firstLevel, maxLevel );
+
+    // each tile draws its features with the detail its level can show:
+    _levelIndex = new KMLLevelIndex( _features, firstLevel, maxLevel );
+
+    if ( !_regionLinks.empty() )
+    {
+        // the pager's features are numbered after ours:
+        _pager = new KMLRegionPager( _options, firstLevel, maxLevel, nextUID );
+        _pager->addLinks( _regionLinks );
+        OE_INFO << LC << _url << ": paging " << _regionLinks.size() << " region links" << std::endl;
     }
 }
 
+void
+KMLFeatureSource::readFeatures()
+{
+    // whoever else reads this document with the same options shares the
+    // read; canceled, this source is left empty while the others carry on.
+    _dataset = KMLDataset::get( _url, _options );
+    if ( !_dataset->read(_progress.get()) )
+        return;
+
+    _features     = _dataset->getFeatures();
+    _archives     = _dataset->getArchives();
+    _regionLinks  = _dataset->getRegionLinks();
+    _refreshLinks = _dataset->getRefreshLinks();
+}
+
+void
+KMLFeatureSource::setFeaturesList( const FeatureList& list )
+{
+    _features = list;
+    _index = new KMLSpatialIndex( _features );
+    initTiling();
+}
+
 FeatureCursor*
 KMLFeatureSource::createFeatureCursor( const Query& query )
 {
-    return new FeatureListCursor( this->_features );
+    // only what's in the query extent, straight from the index:
+    if ( query.bounds().isSet() && _levelIndex.valid() )
+    {
+        // a tile owns the features of its level centered in it, so none is
+        // drawn twice at a level; paged links come into view on the way.
+        unsigned int level = KMLRegionPager::getTileLevel( *query.bounds() );
+        FeatureList hits;
+        _levelIndex->query( *query.bounds(), level, hits );
+        if ( _pager.valid() )
+            _pager->query( *query.bounds(), level, hits );
+        addLiveFeatures( query, hits );
+        return s_createCursor( hits );
+    }
+
+    if ( query.bounds().isSet() && _index.valid() )
+    {
+        FeatureList hits;
+        _index->query( *query.bounds(), hits );
+        addLiveFeatures( query, hits );
+        return s_createCursor( hits );
+    }
+
+    FeatureList all = _features;
+    addLiveFeatures( query, all );
+    return s_createCursor( all );
+}
+
+void
+KMLFeatureSource::addLiveFeatures( const Query& query, FeatureList& output ) const
+{
+    if ( _options.live() == false )
+        return;
+
+    // feeds are small and change under us, so they're filtered as we go
+    // rather than indexed.
+    for( std::vector< osg::ref_ptr<KMLLiveLink> >::const_iterator i = _liveLinks.begin(); i != _liveLinks.end(); ++i )
+    {
+        FeatureList live;
+        (*i)->getFeatures( live );
+
+        if ( !query.bounds().isSet() )
+        {
+            output.insert( output.end(), live.begin(), live.end() );
+            continue;
+        }
+
+        // tiled, they're drawn at each level by the tile holding their center:
+        const Bounds& extent = *query.bounds();
+        bool tiled = _levelIndex.valid();
+
+        for( FeatureList::const_iterator f = live.begin(); f != live.end(); ++f )
+        {
+            const Geometry* geom = (*f)->getGeometry();
+            if ( !geom )
+                continue;
+
+            // half-open like the tiles, so no center lands in two of them:
+            Bounds b = geom->getBounds();
+            double cx = 0.5 * (b.xMin() + b.xMax()), cy = 0.5 * (b.yMin() + b.yMax());
+            bool match = tiled ?
+                cx >= extent.xMin() && cy >= extent.yMin() &&
+                (cx < extent.xMax() || extent.xMax() >= 180.0) && (cy < extent.yMax() || extent.yMax() >= 90.0) :
+                b.xMin() <= extent.xMax() && extent.xMin() <= b.xMax() && b.yMin() <= extent.yMax() && extent.yMin() <= b.yMax();
+            if ( match )
+                output.push_back( f->get() );
+        }
+    }
 }
 
 //------------------------------------------------------------------------
@@ -0,0 +1,169 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLFeatureTable>
+#include <algorithm>
+
+using namespace Godzi::KML;
+
+namespace
+{
+    /**
+     * Empty slots a run grows by to take a FID past its end, rather than
+     * starting a new run. Keeps a run together across a few lost FIDs.
+     */
+    const long MAX_GAP = 64;
+
+    /** Sort predicate for finding the run a FID falls in. */
+    template<typename RUN>
+    bool
+    s_startsAfter( long fid, const RUN& run )
+    {
+        return fid < run._first;
+    }
+}
+
+//------------------------------------------------------------------------
+
+int
+KMLFeatureTable::findRun( long fid ) const
+{
+    // last run starting at or before the FID:
+    std::vector<Run>::const_iterator i = std::upper_bound( _runs.begin(), _runs.end(), fid, s_startsAfter<Run> );
+    return (int)(i - _runs.begin()) - 1;
+}
+
+void
+KMLFeatureTable::add( Feature* feature )
+{
+    if ( !feature )
+        return;
+
+    long fid = feature->getFID();
+
+    // a run takes a FID at or a little past its end (a FID before the next
+    // run's start, since findRun picked this one):
+    int r = findRun( fid );
+    if ( r < 0 || fid - _runs[r]._first >= (long)_runs[r]._slots.size() + MAX_GAP )
+    {
+        Run run;
+        run._first = fid;
+        run._used = 0;
+        _runs.insert( _runs.begin() + (r + 1), run );
+        ++r;
+    }
+
+    Run& run = _runs[r];
+    unsigned int index = (unsigned int)(fid - run._first);
+    if ( index >= run._slots.size() )
+        run._slots.resize( index + 1, 0L );
+
+    Feature*& slot = run._slots[index];
+    if ( slot )
+    {
+        // same FID again; the new feature takes the old one's place
+        FeatureList::iterator i = std::find( _features.begin(), _features.end(), slot );
+        if ( i != _features.end() )
+            *i = feature;
+    }
+    else
+    {
+        _features.push_back( feature );
+        ++run._used;
+    }
+    slot = feature;
+}
+
+void
+KMLFeatureTable::remove( const std::vector<long>& fids )
+{
+    unsigned int numRemoved = 0;
+    for( std::vector<long>::const_iterator i = fids.begin(); i != fids.end(); ++i )
+    {
+        int r = findRun( *i );
+        if ( r >= 0 && *i - _runs[r]._first < (long)_runs[r]._slots.size() )
+        {
+            Feature*& slot = _runs[r]._slots[ *i - _runs[r]._first ];
+            if ( slot )
+            {
+                slot = 0L;
+                --_runs[r]._used;
+                ++numRemoved;
+            }
+        }
+    }
+
+    if ( numRemoved == 0 )
+        return;
+
+    // what's still in a slot stays, in order:
+    FeatureList kept;
+    kept.reserve( _features.size() - numRemoved );
+    for( FeatureList::const_iterator i = _features.begin(); i != _features.end(); ++i )
+    {
+        if ( get( (*i)->getFID() ) == i->get() )
+            kept.push_back( i->get() );
+    }
+    _features.swap( kept );
+
+    // drop emptied runs, and trim the empty slots off the ends of the others
+    // (a live link's run slides forward as it renumbers each refresh):
+    for( std::vector<Run>::iterator r = _runs.begin(); r != _runs.end(); )
+    {
+        if ( r->_used == 0 )
+        {
+            r = _runs.erase( r );
+            continue;
+        }
+
+        unsigned int lead = 0;
+        while( !r->_slots[lead] )
+            ++lead;
+
+        if ( lead > 0 )
+        {
+            r->_slots.erase( r->_slots.begin(), r->_slots.begin() + lead );
+            r->_first += lead;
+        }
+
+        while( !r->_slots.back() )
+            r->_slots.pop_back();
+
+        ++r;
+    }
+}
+
+void
+KMLFeatureTable::clear()
+{
+    _features.clear();
+    _runs.clear();
+}
+
+Feature*
+KMLFeatureTable::get( long fid ) const
+{
+    int r = findRun( fid );
+    if ( r < 0 )
+        return 0L;
+
+    const Run& run = _runs[r];
+    return fid - run._first < (long)run._slots.size() ? run._slots[ fid - run._first ] : 0L;
+}
@@ -0,0 +1,424 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLGeometryPyramid>
+#include <Godzi/KML/KMLRegionPager>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace Godzi::KML;
+
+// geometry with fewer vertices than this is drawn as is:
+#define MIN_PYRAMID_VERTICES 256
+
+// times a level whose rings cross is built again at half the tolerance:
+#define MAX_TOPOLOGY_RETRIES 4
+
+namespace
+{
+    /** Span of a line still to be split; "anchor" forces the split vertex to stay. */
+    struct Span {
+        unsigned int a, b;
+        float parent;
+        bool anchor;
+    };
+
+    /** Distance from p to the segment ab, in the xy plane. */
+    double
+    s_distance( const osg::Vec3d& p, const osg::Vec3d& a, const osg::Vec3d& b )
+    {
+        double dx = b.x() - a.x(), dy = b.y() - a.y();
+        double len2 = dx*dx + dy*dy;
+        double t = len2 > 0.0 ? ((p.x() - a.x())*dx + (p.y() - a.y())*dy) / len2 : 0.0;
+        t = osg::clampBetween( t, 0.0, 1.0 );
+        double ex = a.x() + t*dx - p.x(), ey = a.y() + t*dy - p.y();
+        return ::sqrt( ex*ex + ey*ey );
+    }
+
+    /**
+     * Ranks the vertices of a line or ring with Douglas-Peucker. A vertex
+     * is kept at tolerance t if its rank is above t.
+     */
+    void
+    s_rank( const Geometry* part, bool closed, std::vector<float>& ranks )
+    {
+        unsigned int n = part->size();
+        ranks.assign( n, FLT_MAX );
+        if ( n < (closed ? 5u : 3u) )
+            return;
+
+        const Geometry& pts = *part;
+        std::vector<Span> stack;
+
+        if ( closed )
+        {
+            // split the ring at the vertex farthest from the first, and keep
+            // the first split of each half, so at least four vertices stay.
+            unsigned int far = 1;
+            double farDist = 0.0;
+            for( unsigned int i = 1; i < n; ++i )
+            {
+                double d = (pts[i] - pts[0]).length2();
+                if ( d > farDist )
+                    farDist = d, far = i;
+            }
+            Span first = { 0, far, FLT_MAX, true };
+            Span second = { far, n, FLT_MAX, true }; // n wraps around to 0
+            stack.push_back( first );
+            stack.push_back( second );
+        }
+        else
+        {
+            Span all = { 0, n - 1, FLT_MAX, false };
+            stack.push_back( all );
+        }
+
+        while( !stack.empty() )
+        {
+            Span span = stack.back();
+            stack.pop_back();
+            if ( span.b - span.a < 2 )
+                continue;
+
+            const osg::Vec3d& a = pts[span.a];
+            const osg::Vec3d& b = pts[span.b % n];
+
+            unsigned int split = span.a + 1;
+            double maxDist = -1.0;
+            for( unsigned int i = span.a + 1; i < span.b; ++i )
+            {
+                double d = s_distance( pts[i], a, b );
+                if ( d > maxDist )
+                    maxDist = d, split = i;
+            }
+
+            // never above the vertex this span hangs off, so levels nest:
+            float rank = span.anchor ? FLT_MAX : std::min( (float)maxDist, span.parent );
+            ranks[split] = rank;
+
+            Span left = { span.a, split, rank, false };
+            Span right = { split, span.b, rank, false };
+            stack.push_back( left );
+            stack.push_back( right );
+        }
+    }
+
+    /** Vertices of part ranked above the tolerance. */
+    void
+    s_filter( const Geometry* part, const std::vector<float>& ranks, double tolerance, Vec3dVector& output )
+    {
+        output.reserve( part->size() );
+        for( unsigned int i = 0; i < part->size(); ++i )
+        {
+            if ( ranks[i] > tolerance )
+                output.push_back( (*part)[i] );
+        }
+    }
+
+    /** One edge of a ring, for the crossing test. */
+    struct Edge {
+        osg::Vec3d a, b;
+        double xMin, xMax;
+        bool operator < ( const Edge& rhs ) const { return xMin < rhs.xMin; }
+    };
+
+    /** Which side of ab the point c is on (in the xy plane): <0, 0 or >0. */
+    double
+    s_side( const osg::Vec3d& a, const osg::Vec3d& b, const osg::Vec3d& c )
+    {
+        return (b.x() - a.x())*(c.y() - a.y()) - (b.y() - a.y())*(c.x() - a.x());
+    }
+
+    /** Appends the edges of a ring, closing it. */
+    void
+    s_addEdges( const Geometry* ring, std::vector<Edge>& edges )
+    {
+        unsigned int n = ring->size();
+        for( unsigned int i = 0; i < n && n > 2; ++i )
+        {
+            Edge e;
+            e.a = (*ring)[i];
+            e.b = (*ring)[(i + 1) % n];
+            e.xMin = std::min( e.a.x(), e.b.x() );
+            e.xMax = std::max( e.a.x(), e.b.x() );
+            edges.push_back( e );
+        }
+    }
+
+    /**
+     * Whether any two edges properly cross, each with its ends on both sides
+     * of the other. Edges that only touch (as neighbours in a ring do) don't
+     * count. Sweeps the edges in order of x, so only those that overlap in
+     * x are compared.
+     */
+    bool
+    s_crosses( std::vector<Edge>& edges )
+    {
+        std::sort( edges.begin(), edges.end() );
+        for( unsigned int i = 0; i < edges.size(); ++i )
+        {
+            const Edge& e = edges[i];
+            for( unsigned int j = i + 1; j < edges.size() && edges[j].xMin <= e.xMax; ++j )
+            {
+                const Edge& f = edges[j];
+                if ( s_side(e.a, e.b, f.a) * s_side(e.a, e.b, f.b) < 0.0 &&
+                     s_side(f.a, f.b, e.a) * s_side(f.a, f.b, e.b) < 0.0 )
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Whether simplifying made a ring cross itself, or a polygon's outer
+     * ring and holes cross each other. Lines may cross themselves anyway.
+     */
+    bool
+    s_hasCrossingRings( const Geometry* geom )
+    {
+        std::vector<Edge> edges;
+        switch( geom->getType() )
+        {
+        case Geometry::TYPE_RING:
+            s_addEdges( geom, edges );
+            return s_crosses( edges );
+
+        case Geometry::TYPE_POLYGON:
+            {
+                const Polygon* poly = static_cast<const Polygon*>( geom );
+                s_addEdges( poly, edges );
+                for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+                    s_addEdges( i->get(), edges );
+                return s_crosses( edges );
+            }
+
+        case Geometry::TYPE_MULTI:
+            {
+                const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+                for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+                    if ( s_hasCrossingRings(i->get()) )
+                        return true;
+                return false;
+            }
+
+        default:
+            return false;
+        }
+    }
+
+    /** Total vertex count, holes and components included. */
+    unsigned int
+    s_countVertices( const Geometry* geom )
+    {
+        if ( geom->getType() == Geometry::TYPE_MULTI )
+        {
+            unsigned int count = 0;
+            const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+            for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+                count += s_countVertices( i->get() );
+            return count;
+        }
+
+        unsigned int count = geom->size();
+        if ( geom->getType() == Geometry::TYPE_POLYGON )
+        {
+            const Polygon* poly = static_cast<const Polygon*>( geom );
+            for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+                count += (*i)->size();
+        }
+        return count;
+    }
+}
+
+//------------------------------------------------------------------------
+
+KMLGeometryPyramid*
+KMLGeometryPyramid::create( const Geometry* geom )
+{
+    if ( !geom || geom->getType() == Geometry::TYPE_POINTSET || s_countVertices( geom ) < MIN_PYRAMID_VERTICES )
+        return 0L;
+
+    return new KMLGeometryPyramid( geom );
+}
+
+KMLGeometryPyramid*
+KMLGeometryPyramid::create( const CompactGeometry* compact )
+{
+    if ( !compact || compact->getNumVertices() < MIN_PYRAMID_VERTICES )
+        return 0L;
+
+    osg::ref_ptr<Geometry> geom = compact->decode();
+    if ( !geom.valid() )
+        return 0L;
+
+    KMLGeometryPyramid* result = new KMLGeometryPyramid( geom.get() );
+    result->_geom = 0L;
+    result->_compact = compact;
+    return result;
+}
+
+KMLGeometryPyramid::KMLGeometryPyramid( const Geometry* geom ) :
+_geom( geom )
+{
+    rank( geom );
+
+    // rings that already cross are drawn simplified all the same:
+    _checkCrossings = !s_hasCrossingRings( geom );
+}
+
+void
+KMLGeometryPyramid::rank( const Geometry* geom )
+{
+    switch( geom->getType() )
+    {
+    case Geometry::TYPE_LINESTRING:
+        _ranks.push_back( std::vector<float>() );
+        s_rank( geom, false, _ranks.back() );
+        break;
+
+    case Geometry::TYPE_RING:
+        _ranks.push_back( std::vector<float>() );
+        s_rank( geom, true, _ranks.back() );
+        break;
+
+    case Geometry::TYPE_POLYGON:
+        {
+            const Polygon* poly = static_cast<const Polygon*>( geom );
+            _ranks.push_back( std::vector<float>() );
+            s_rank( poly, true, _ranks.back() );
+            for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i )
+            {
+                _ranks.push_back( std::vector<float>() );
+                s_rank( i->get(), true, _ranks.back() );
+            }
+        }
+        break;
+
+    case Geometry::TYPE_MULTI:
+        {
+            const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+            for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+                rank( i->get() );
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+const Geometry*
+KMLGeometryPyramid::get( unsigned int level ) const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _levelsMutex );
+
+    std::map< unsigned int, osg::ref_ptr<const Geometry> >::const_iterator i = _levels.find( level );
+    if ( i != _levels.end() )
+        return i->second.get();
+
+    double tolerance = KMLRegionPager::getPixelSize( level );
+
+    // past the finest detail there's nothing to take out:
+    unsigned int total = 0, kept = 0;
+    for( std::vector< std::vector<float> >::const_iterator r = _ranks.begin(); r != _ranks.end(); ++r )
+    {
+        total += r->size();
+        for( std::vector<float>::const_iterator v = r->begin(); v != r->end(); ++v )
+            if ( *v > tolerance ) ++kept;
+    }
+
+    osg::ref_ptr<const Geometry> result = _geom.get();
+    if ( kept < total )
+    {
+        // rings that cross would fill wrong; such a level backs off toward
+        // full detail, and is left at it if they still cross.
+        osg::ref_ptr<const Geometry> full = _compact.valid() ? _compact->decode() : _geom.get();
+        for( unsigned int retry = 0; retry <= MAX_TOPOLOGY_RETRIES; ++retry, tolerance *= 0.5 )
+        {
+            unsigned int part = 0;
+            osg::ref_ptr<Geometry> simplified = build( full.get(), tolerance, part );
+            if ( simplified.valid() && !(_checkCrossings && s_hasCrossingRings(simplified.get())) )
+            {
+                result = simplified.get();
+                break;
+            }
+        }
+    }
+
+    _levels[level] = result.get();
+    return result.get();
+}
+
+Geometry*
+KMLGeometryPyramid::build( const Geometry* geom, double tolerance, unsigned int& part ) const
+{
+    Vec3dVector points;
+
+    switch( geom->getType() )
+    {
+    case Geometry::TYPE_LINESTRING:
+        s_filter( geom, _ranks[part++], tolerance, points );
+        return new LineString( &points );
+
+    case Geometry::TYPE_RING:
+        s_filter( geom, _ranks[part++], tolerance, points );
+        return new Ring( &points );
+
+    case Geometry::TYPE_POLYGON:
+        {
+            const Polygon* poly = static_cast<const Polygon*>( geom );
+            s_filter( poly, _ranks[part++], tolerance, points );
+            Polygon* result = new Polygon( &points );
+
+            for( RingCollection::const_iterator i = poly->getHoles().begin(); i != poly->getHoles().end(); ++i, ++part )
+            {
+                // a hole under a pixel across would only be noise:
+                osgEarth::Bounds b = (*i)->getBounds();
+                if ( b.xMax() - b.xMin() < tolerance && b.yMax() - b.yMin() < tolerance )
+                    continue;
+
+                Vec3dVector hole;
+                s_filter( i->get(), _ranks[part], tolerance, hole );
+                result->getHoles().push_back( new Ring( &hole ) );
+            }
+            return result;
+        }
+
+    case Geometry::TYPE_MULTI:
+        {
+            const MultiGeometry* multi = static_cast<const MultiGeometry*>( geom );
+            MultiGeometry* result = new MultiGeometry;
+            result->getComponents().reserve( multi->getComponents().size() );
+            for( GeometryCollection::const_iterator i = multi->getComponents().begin(); i != multi->getComponents().end(); ++i )
+            {
+                Geometry* component = build( i->get(), tolerance, part );
+                if ( component )
+                    result->getComponents().push_back( component );
+            }
+            return result;
+        }
+
+    default:
+        // points aren't simplified; share them.
+        return const_cast<Geometry*>( geom );
+    }
+}
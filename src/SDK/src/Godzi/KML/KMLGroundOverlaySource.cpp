@@ -0,0 +1,638 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLGroundOverlaySource>
+#include <Godzi/KML/KMLDataset>
+#include <osgEarth/Registry>
+#include <osgEarth/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osgDB/ReadFile>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLGroundOverlaySource] "
+
+#define DEFAULT_MAX_LOADED_IMAGES 4
+
+// reductions at least this much smaller than the full image stay loaded
+// (about 22 MB each, with their own reductions):
+#define MAX_RESIDENT_SIZE 2048
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    /** Orders overlays for drawing; equal drawOrders keep document order. */
+    bool
+    s_lessDrawOrder( const KMLParser::GroundOverlay& lhs, const KMLParser::GroundOverlay& rhs )
+    {
+        return lhs._drawOrder < rhs._drawOrder;
+    }
+
+    /** Copies an image into tightly packed RGBA bytes, which is all the resampler reads. */
+    osg::Image*
+    s_toRGBA( const osg::Image* in )
+    {
+        osg::Image* out = new osg::Image();
+        out->allocateImage( in->s(), in->t(), 1, GL_RGBA, GL_UNSIGNED_BYTE );
+
+        GLenum format = in->getPixelFormat();
+        bool direct = in->getDataType() == GL_UNSIGNED_BYTE && (
+            format == GL_RGBA || format == GL_RGB || format == GL_BGRA || format == GL_BGR ||
+            format == GL_LUMINANCE || format == GL_LUMINANCE_ALPHA );
+
+        for( int t = 0; t < in->t(); ++t )
+        {
+            unsigned char* dst = out->data( 0, t );
+
+            if ( !direct )
+            {
+                // anything unusual goes through osg's generic (slow) path:
+                for( int s = 0; s < in->s(); ++s, dst += 4 )
+                {
+                    osg::Vec4 c = in->getColor( s, t );
+                    for( int k = 0; k < 4; ++k )
+                        dst[k] = (unsigned char)osg::clampBetween( c[k] * 255.0f + 0.5f, 0.0f, 255.0f );
+                }
+                continue;
+            }
+
+            const unsigned char* src = in->data( 0, t );
+            for( int s = 0; s < in->s(); ++s, dst += 4 )
+            {
+                switch( format )
+                {
+                case GL_RGBA:
+                    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = src[3]; src += 4; break;
+                case GL_RGB:
+                    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = 255; src += 3; break;
+                case GL_BGRA:
+                    dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = src[3]; src += 4; break;
+                case GL_BGR:
+                    dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = 255; src += 3; break;
+                case GL_LUMINANCE:
+                    dst[0] = dst[1] = dst[2] = src[0]; dst[3] = 255; src += 1; break;
+                default: // GL_LUMINANCE_ALPHA
+                    dst[0] = dst[1] = dst[2] = src[0]; dst[3] = src[1]; src += 2; break;
+                }
+            }
+        }
+
+        return out;
+    }
+
+    /** Averages 2x2 blocks of an RGBA image into an image half its size. */
+    osg::Image*
+    s_halve( const osg::Image* in )
+    {
+        int w = std::max( in->s() / 2, 1 ), h = std::max( in->t() / 2, 1 );
+        osg::Image* out = new osg::Image();
+        out->allocateImage( w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+
+        for( int t = 0; t < h; ++t )
+        {
+            const unsigned char* row0 = in->data( 0, std::min( 2*t,   in->t()-1 ) );
+            const unsigned char* row1 = in->data( 0, std::min( 2*t+1, in->t()-1 ) );
+            unsigned char* dst = out->data( 0, t );
+
+            for( int s = 0; s < w; ++s, dst += 4 )
+            {
+                int s0 = 4 * std::min( 2*s,   in->s()-1 );
+                int s1 = 4 * std::min( 2*s+1, in->s()-1 );
+                for( int k = 0; k < 4; ++k )
+                    dst[k] = (unsigned char)( (row0[s0+k] + row0[s1+k] + row1[s0+k] + row1[s1+k] + 2) / 4 );
+            }
+        }
+
+        return out;
+    }
+
+    /**
+     * Averages 2^level x 2^level blocks of a full-size RGBA image, for the
+     * pixels [x0..x1) x [y0..y1) of the reduction at that level: the same
+     * pixels as halving the image level times, without the rest of them.
+     */
+    osg::Image*
+    s_reduceRegion( const osg::Image* in, unsigned int level, int x0, int y0, int x1, int y1 )
+    {
+        osg::Image* out = new osg::Image();
+        out->allocateImage( x1 - x0, y1 - y0, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+
+        int block = 1 << level;
+        for( int t = y0; t < y1; ++t )
+        {
+            unsigned char* dst = out->data( 0, t - y0 );
+            int inT0 = t * block, inT1 = std::min( inT0 + block, in->t() );
+
+            for( int s = x0; s < x1; ++s, dst += 4 )
+            {
+                int inS0 = s * block, inS1 = std::min( inS0 + block, in->s() );
+                unsigned int sum[4] = { 0, 0, 0, 0 };
+                for( int it = inT0; it < inT1; ++it )
+                {
+                    const unsigned char* src = in->data( inS0, it );
+                    for( int is = inS0; is < inS1; ++is, src += 4 )
+                        for( int k = 0; k < 4; ++k )
+                            sum[k] += src[k];
+                }
+
+                unsigned int n = std::max( (inS1 - inS0) * (inT1 - inT0), 1 );
+                for( int k = 0; k < 4; ++k )
+                    dst[k] = (unsigned char)( (sum[k] + n/2) / n );
+            }
+        }
+
+        return out;
+    }
+
+    /**
+     * Tightly packed RGBA rows: a whole reduction of an overlay image, or
+     * a region of one that starts at (_x,_y) of its (_levelS x _levelT).
+     */
+    struct Raster
+    {
+        int _s, _t;
+        const unsigned char* _data;
+        int _x, _y;
+        int _levelS, _levelT;
+
+        const unsigned char* row( int t ) const { return _data + 4 * (std::size_t)_s * t; }
+    };
+
+    /** A raster over the whole of an image. */
+    Raster
+    s_raster( const osg::Image* image )
+    {
+        Raster r = { image->s(), image->t(), image->data(), 0, 0, image->s(), image->t() };
+        return r;
+    }
+
+    /** Bilinear lookup in a raster, at (u,v) in [0..1] of its reduction. */
+    osg::Vec4f
+    s_sample( const Raster& image, double u, double v )
+    {
+        double x = osg::clampBetween( u * image._levelS - 0.5 - image._x, 0.0, (double)(image._s - 1) );
+        double y = osg::clampBetween( v * image._levelT - 0.5 - image._y, 0.0, (double)(image._t - 1) );
+        int x0 = (int)x, y0 = (int)y;
+        int x1 = std::min( x0 + 1, image._s - 1 ), y1 = std::min( y0 + 1, image._t - 1 );
+        float fx = (float)(x - x0), fy = (float)(y - y0);
+
+        const unsigned char* r0 = image.row( y0 );
+        const unsigned char* r1 = image.row( y1 );
+
+        osg::Vec4f result;
+        for( int k = 0; k < 4; ++k )
+        {
+            float bottom = r0[4*x0+k] * (1.0f - fx) + r0[4*x1+k] * fx;
+            float top    = r1[4*x0+k] * (1.0f - fx) + r1[4*x1+k] * fx;
+            result[k] = (bottom * (1.0f - fy) + top * fy) / 255.0f;
+        }
+        return result;
+    }
+}
+
+//------------------------------------------------------------------------
+
+/**
+ * The reductions of one overlay image that stay loaded: every halving from
+ * the first no bigger than MAX_RESIDENT_SIZE down to a pixel. Tiles finer
+ * than those are reduced from the full image, a region at a time. Once
+ * built it never changes, so tile threads read it without locking.
+ */
+class Godzi::KML::KMLOverlayImage : public osg::Referenced
+{
+public:
+    int _s, _t;                 // full size
+    unsigned int _firstLevel;   // halvings from the full image to _levels[0]
+    std::vector< osg::ref_ptr<osg::Image> > _levels;
+};
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** Decodes an overlay image as RGBA; NULL if it can't be read. */
+    osg::Image*
+    s_decode( const std::string& url )
+    {
+        osg::ref_ptr<osg::Image> decoded = osgDB::readImageFile( url );
+        if ( !decoded.valid() || decoded->s() < 1 || decoded->t() < 1 )
+            return 0L;
+        return s_toRGBA( decoded.get() );
+    }
+
+    /** Builds the reductions of a full image that stay loaded. */
+    KMLOverlayImage*
+    s_createLevels( osg::Image* full )
+    {
+        KMLOverlayImage* image = new KMLOverlayImage();
+        image->_s = full->s();
+        image->_t = full->t();
+        image->_firstLevel = 0;
+        while( (full->s() >> image->_firstLevel) > MAX_RESIDENT_SIZE || (full->t() >> image->_firstLevel) > MAX_RESIDENT_SIZE )
+            ++image->_firstLevel;
+
+        // in one pass, without the finer reductions (a small image is kept whole):
+        unsigned int first = image->_firstLevel;
+        image->_levels.push_back( first == 0 ? full :
+            s_reduceRegion( full, first, 0, 0, std::max(full->s() >> first, 1), std::max(full->t() >> first, 1) ) );
+        while( image->_levels.back()->s() > 1 || image->_levels.back()->t() > 1 )
+            image->_levels.push_back( s_halve(image->_levels.back().get()) );
+
+        return image;
+    }
+
+    /** Longitude difference wrapped into [-180..180]. */
+    double
+    s_deltaLon( double lon, double center )
+    {
+        double d = lon - center;
+        if ( d > 180.0 ) d -= 360.0;
+        else if ( d < -180.0 ) d += 360.0;
+        return d;
+    }
+}
+
+//------------------------------------------------------------------------
+
+/** One GroundOverlay, and whatever of its image is loaded. */
+class KMLGroundOverlaySource::Overlay : public osg::Referenced
+{
+public:
+    Overlay( const KMLParser::GroundOverlay& def ) :
+    _def( def ),
+    _loading( false ),
+    _failed( false ),
+    _lastUsed( 0 )
+    {
+        _cx = 0.5 * (def._west + def._east);
+        _cy = 0.5 * (def._south + def._north);
+        _halfWidth  = 0.5 * (def._east - def._west);
+        _halfHeight = 0.5 * (def._north - def._south);
+
+        double r = osg::DegreesToRadians( def._rotation );
+        _cos = ::cos( r );
+        _sin = ::sin( r );
+
+        // extent of the rotated box:
+        _radiusX = ::fabs( _halfWidth * _cos ) + ::fabs( _halfHeight * _sin );
+        _radiusY = ::fabs( _halfWidth * _sin ) + ::fabs( _halfHeight * _cos );
+    }
+
+    bool intersects( const GeoExtent& extent ) const
+    {
+        double tileCx = 0.5 * (extent.xMin() + extent.xMax());
+        double tileCy = 0.5 * (extent.yMin() + extent.yMax());
+        return
+            ::fabs( s_deltaLon(tileCx, _cx) ) <= _radiusX + 0.5 * extent.width() &&
+            ::fabs( tileCy - _cy ) <= _radiusY + 0.5 * extent.height();
+    }
+
+    /** Position within the unrotated box, in [0..1] when inside it. */
+    void toImage( double lon, double lat, double& out_u, double& out_v ) const
+    {
+        // rotate back by the box's rotation, about its center:
+        double dx = s_deltaLon( lon, _cx ), dy = lat - _cy;
+        double x =  dx * _cos + dy * _sin;
+        double y = -dx * _sin + dy * _cos;
+        out_u = 0.5 + 0.5 * x / _halfWidth;
+        out_v = 0.5 + 0.5 * y / _halfHeight;
+    }
+
+    KMLParser::GroundOverlay _def;
+    double _cx, _cy, _halfWidth, _halfHeight, _cos, _sin, _radiusX, _radiusY;
+
+    /** Bounds, in [0..1] of the unrotated box, of the part of it a tile covers. */
+    void toImage( const GeoExtent& extent, double& out_u0, double& out_v0, double& out_u1, double& out_v1 ) const
+    {
+        out_u0 = out_v0 = 1.0;
+        out_u1 = out_v1 = 0.0;
+        for( int corner = 0; corner < 4; ++corner )
+        {
+            double u, v;
+            toImage( corner & 1 ? extent.xMax() : extent.xMin(), corner & 2 ? extent.yMax() : extent.yMin(), u, v );
+            out_u0 = std::min( out_u0, u ); out_u1 = std::max( out_u1, u );
+            out_v0 = std::min( out_v0, v ); out_v1 = std::max( out_v1, v );
+        }
+        out_u0 = osg::clampBetween( out_u0, 0.0, 1.0 ); out_u1 = osg::clampBetween( out_u1, 0.0, 1.0 );
+        out_v0 = osg::clampBetween( out_v0, 0.0, 1.0 ); out_v1 = osg::clampBetween( out_v1, 0.0, 1.0 );
+    }
+
+    KMLParser::GroundOverlay _def;
+    double _cx, _cy, _halfWidth, _halfHeight, _cos, _sin, _radiusX, _radiusY;
+
+    // guarded by the source's _imageMutex:
+    osg::ref_ptr<KMLOverlayImage> _image;
+    osg::ref_ptr<osg::Image> _full;  // the decoded image, while tiles finer than _image need it
+    bool _loading;   // a tile thread is loading _image or _full
+    bool _failed;
+    unsigned int _lastUsed;
+};
+
+//------------------------------------------------------------------------
+
+KMLGroundOverlaySource::KMLGroundOverlaySource( const KMLGroundOverlayOptions& options ) :
+TileSource( options ),
+_options( options ),
+_read( false ),
+_clock( 0 )
+{
+    //NOP
+}
+
+void
+KMLGroundOverlaySource::initialize( const std::string& referenceURI, const Profile* overrideProfile )
+{
+    if ( _options.url().isSet() )
+        _url = osgEarth::getFullPath( referenceURI, _options.url().value() );
+    else
+        OE_WARN << LC << "No URL given" << std::endl;
+
+    setProfile( overrideProfile ? overrideProfile : osgEarth::Registry::instance()->getGlobalGeodeticProfile() );
+}
+
+void
+KMLGroundOverlaySource::readOverlays()
+{
+    ScopedLock lock( _readMutex );
+    if ( _read )
+        return;
+    _read = true;
+
+    if ( _url.empty() )
+        return;
+
+    // the same read as the source's other layers: the options carry the
+    // source's own (see KMLGroundOverlayOptions).
+    KMLFeatureSourceOptions readOptions( _options );
+    osg::ref_ptr<KMLDataset> dataset = KMLDataset::get( _url, readOptions );
+    dataset->read();
+
+    KMLParser::GroundOverlayList defs = dataset->getGroundOverlays();
+    std::stable_sort( defs.begin(), defs.end(), s_lessDrawOrder );
+
+    OverlayList overlays;
+    for( KMLParser::GroundOverlayList::const_iterator i = defs.begin(); i != defs.end(); ++i )
+        overlays.push_back( new Overlay( *i ) );
+
+    {
+        ScopedLock imageLock( _imageMutex );
+        _overlays.swap( overlays );
+        _archives = dataset->getArchives();
+    }
+
+    OE_INFO << LC << _url << ": " << defs.size() << " ground overlays" << std::endl;
+}
+
+osg::Image*
+KMLGroundOverlaySource::createImage( const TileKey* key, ProgressCallback* progress )
+{
+    readOverlays();
+
+    const GeoExtent& extent = key->getGeoExtent();
+    int size = getPixelsPerTile();
+    double pixelWidth  = extent.width() / size;
+    double pixelHeight = extent.height() / size;
+
+    OverlayList candidates;
+    unsigned int now;
+    {
+        ScopedLock lock( _imageMutex );
+        candidates = _overlays;
+        now = ++_clock;
+    }
+
+    // pick the overlays over this tile, and the reduction each is sampled from:
+    OverlayList overlays;
+    std::vector< osg::ref_ptr<osg::Referenced> > holders;
+    std::vector<Raster> images;
+    for( OverlayList::const_iterator i = candidates.begin(); i != candidates.end(); ++i )
+    {
+        Overlay* overlay = i->get();
+        if ( !overlay->intersects(extent) )
+            continue;
+
+        if ( progress && progress->isCanceled() )
+            return 0L;
+
+        osg::ref_ptr<KMLOverlayImage> image = getImage( overlay, now );
+        if ( !image.valid() )
+            continue;
+
+        // halved until an image pixel is about as big as a tile pixel:
+        double ratio = std::min(
+            pixelWidth  / (2.0 * overlay->_halfWidth / image->_s),
+            pixelHeight / (2.0 * overlay->_halfHeight / image->_t) );
+        unsigned int level = ratio >= 2.0 ? (unsigned int)::floor( ::log(ratio) / ::log(2.0) ) : 0;
+
+        if ( level >= image->_firstLevel )
+        {
+            unsigned int index = std::min( level - image->_firstLevel, (unsigned int)image->_levels.size()-1 );
+            images.push_back( s_raster(image->_levels[index].get()) );
+            holders.push_back( image.get() );
+        }
+        else
+        {
+            // finer than what stays loaded: reduce the part of the full
+            // image under the tile, with a pixel to spare for the filter.
+            osg::ref_ptr<osg::Image> full;
+            if ( !getImage( overlay, now, &full ).valid() || !full.valid() )
+                continue;
+
+            int levelS = std::max( image->_s >> level, 1 ), levelT = std::max( image->_t >> level, 1 );
+            double u0, v0, u1, v1;
+            overlay->toImage( extent, u0, v0, u1, v1 );
+            int x0 = std::max( (int)::floor(u0 * levelS) - 1, 0 ), x1 = std::min( (int)::ceil(u1 * levelS) + 1, levelS );
+            int y0 = std::max( (int)::floor(v0 * levelT) - 1, 0 ), y1 = std::min( (int)::ceil(v1 * levelT) + 1, levelT );
+            if ( x0 >= x1 || y0 >= y1 )
+                continue;
+
+            osg::ref_ptr<osg::Image> region = s_reduceRegion( full.get(), level, x0, y0, x1, y1 );
+            Raster raster = s_raster( region.get() );
+            raster._x = x0;
+            raster._y = y0;
+            raster._levelS = levelS;
+            raster._levelT = levelT;
+            images.push_back( raster );
+            holders.push_back( region.get() );
+        }
+
+        overlays.push_back( overlay );
+    }
+
+    if ( overlays.empty() )
+        return 0L;
+
+    osg::Image* result = new osg::Image();
+    result->allocateImage( size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+    ::memset( result->data(), 0, result->getTotalSizeInBytes() );
+
+    for( int t = 0; t < size; ++t )
+    {
+        double lat = extent.yMin() + (t + 0.5) * pixelHeight;
+        unsigned char* dst = result->data( 0, t );
+
+        for( int s = 0; s < size; ++s, dst += 4 )
+        {
+            double lon = extent.xMin() + (s + 0.5) * pixelWidth;
+
+            // later overlays draw over earlier ones:
+            osg::Vec4f color( 0, 0, 0, 0 );
+            for( unsigned int k = 0; k < overlays.size(); ++k )
+            {
+                double u, v;
+                overlays[k]->toImage( lon, lat, u, v );
+                if ( u < 0.0 || u >= 1.0 || v < 0.0 || v >= 1.0 )
+                    continue;
+
+                osg::Vec4f c = osg::componentMultiply( s_sample(images[k], u, v), overlays[k]->_def._color );
+                float a = c.a() + color.a() * (1.0f - c.a());
+                if ( a > 0.0f )
+                {
+                    for( int n = 0; n < 3; ++n )
+                        color[n] = (c[n] * c.a() + color[n] * color.a() * (1.0f - c.a())) / a;
+                }
+                color.a() = a;
+            }
+
+            for( int n = 0; n < 4; ++n )
+                dst[n] = (unsigned char)( osg::clampBetween(color[n], 0.0f, 1.0f) * 255.0f + 0.5f );
+        }
+    }
+
+    return result;
+}
+
+osg::ref_ptr<KMLOverlayImage>
+KMLGroundOverlaySource::getImage( Overlay* overlay, unsigned int now, osg::ref_ptr<osg::Image>* out_full )
+{
+    osg::ref_ptr<KMLOverlayImage> image;
+    {
+        ScopedLock lock( _imageMutex );
+
+        // another tile thread may be reading it; its result does for us too.
+        while( overlay->_loading )
+            _imageLoaded.wait( &_imageMutex );
+
+        if ( overlay->_failed )
+            return 0L;
+
+        overlay->_lastUsed = now;
+        image = overlay->_image.get();
+        if ( image.valid() && (!out_full || overlay->_full.valid()) )
+        {
+            if ( out_full )
+                *out_full = overlay->_full.get();
+            return image;
+        }
+
+        overlay->_loading = true;
+    }
+
+    // decoding and reducing hold up no other overlay or tile:
+    osg::ref_ptr<osg::Image> full = s_decode( overlay->_def._url );
+    if ( !full.valid() )
+        OE_WARN << LC << "Failed to read overlay image " << overlay->_def._url << std::endl;
+    else if ( !image.valid() )
+        image = s_createLevels( full.get() );
+
+    ScopedLock lock( _imageMutex );
+    overlay->_image   = image.get();
+    overlay->_failed  = !full.valid();
+    overlay->_loading = false;
+    if ( out_full && full.valid() )
+    {
+        overlay->_full = full.get();
+        *out_full = full.get();
+    }
+    if ( image.valid() )
+        evict( overlay );
+    _imageLoaded.broadcast();
+    return overlay->_failed ? 0L : image;
+}
+
+void
+KMLGroundOverlaySource::evict( Overlay* keep )
+{
+    unsigned int maxLoaded = _options.maxLoadedImages().isSet() ?
+        std::max( *_options.maxLoadedImages(), 1u ) : DEFAULT_MAX_LOADED_IMAGES;
+
+    // only one full image at a time, however many reductions:
+    if ( keep->_full.valid() )
+    {
+        for( OverlayList::const_iterator i = _overlays.begin(); i != _overlays.end(); ++i )
+        {
+            if ( i->get() != keep )
+                (*i)->_full = 0L;
+        }
+    }
+
+    for( ;; )
+    {
+        Overlay* oldest = 0L;
+        unsigned int numLoaded = 0;
+        for( OverlayList::const_iterator i = _overlays.begin(); i != _overlays.end(); ++i )
+        {
+            Overlay* overlay = i->get();
+            if ( !overlay->_image.valid() )
+                continue;
+            ++numLoaded;
+            if ( overlay != keep && (!oldest || overlay->_lastUsed < oldest->_lastUsed) )
+                oldest = overlay;
+        }
+
+        if ( numLoaded <= maxLoaded || !oldest )
+            break;
+
+        OE_INFO << LC << "Releasing overlay image " << oldest->_def._url << std::endl;
+        oldest->_image = 0L;
+        oldest->_full  = 0L;
+    }
+}
+
+//------------------------------------------------------------------------
+
+class KMLGroundOverlaySourceFactory : public TileSourceDriver
+{
+public:
+    KMLGroundOverlaySourceFactory()
+    {
+        supportsExtension( "osgearth_kml_overlay", "KML GroundOverlay driver for Godzi" );
+    }
+
+    virtual const char* className()
+    {
+        return "KML GroundOverlay Reader";
+    }
+
+    virtual ReadResult readObject(const std::string& file_name, const Options* options) const
+    {
+        if ( !acceptsExtension(osgDB::getLowerCaseFileExtension( file_name )))
+            return ReadResult::FILE_NOT_HANDLED;
+
+        return ReadResult( new KMLGroundOverlaySource( getTileSourceOptions(options) ) );
+    }
+};
+
+REGISTER_OSGPLUGIN(osgearth_kml_overlay, KMLGroundOverlaySourceFactory)
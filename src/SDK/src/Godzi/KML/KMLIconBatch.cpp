@@ -0,0 +1,533 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLIconBatch>
+#include <Godzi/KML/KMLIconService>
+#include <Godzi/KML/KMLScreenSpace>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/KML/KMLSymbolSource>
+#include <Godzi/Tasks>
+#include <osgUtil/CullVisitor>
+#include <osg/buffered_value>
+#include <osg/GL2Extensions>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/GLExtensions>
+#include <osg/Group>
+#include <osg/MatrixTransform>
+#include <osg/Texture2D>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cstring>
+#include <set>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMLIconBatch] "
+
+// on-screen size of an icon's long side at scale 1 (KML's default):
+#define ICON_PIXELS 32.0f
+
+// instances per row of the instance data texture, three texels each:
+#define INSTANCES_PER_ROW 1024
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    const char* s_fragmentShader =
+        "#version 110\n"
+        "uniform sampler2D godzi_icon_atlas;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 color = texture2D( godzi_icon_atlas, gl_TexCoord[0].xy ) * gl_Color;\n"
+        "    if ( color.a < 0.05 ) discard;\n"
+        "    gl_FragColor = color;\n"
+        "}\n";
+
+    // Draws one corner of a unit quad for each instance (INSTANCES_PER_ROW
+    // is written out as 1024 here). An instance is
+    // three texels of the instance texture: anchor (xyz) and half the long
+    // side in pixels (w), color, and the icon's atlas rectangle. The anchor
+    // gets the same pull toward the eye as in KMLScreenSpace's shader.
+    const char* s_instancedVertexShader =
+        "#version 110\n"
+        "#extension GL_EXT_gpu_shader4 : enable\n"
+        "#extension GL_EXT_draw_instanced : enable\n"
+        "uniform vec2 godzi_viewport;\n"
+        "uniform sampler2D godzi_instances;\n"
+        "void main()\n"
+        "{\n"
+        "    ivec2 at = ivec2( (gl_InstanceID % 1024) * 3, gl_InstanceID / 1024 );\n"
+        "    vec4 anchor = texelFetch2D( godzi_instances, at, 0 );\n"
+        "    vec4 color  = texelFetch2D( godzi_instances, at + ivec2(1, 0), 0 );\n"
+        "    vec4 rect   = texelFetch2D( godzi_instances, at + ivec2(2, 0), 0 );\n"
+        "    vec2 size = rect.zw - rect.xy;\n"
+        "    vec2 halfSize = anchor.w * size / max( size.x, size.y );\n"
+        "    vec4 view = gl_ModelViewMatrix * vec4( anchor.xyz, 1.0 );\n"
+        "    view.xyz *= 0.98;\n"
+        "    vec4 clip = gl_ProjectionMatrix * view;\n"
+        "    clip.xy += gl_Vertex.xy * halfSize * 2.0 / godzi_viewport * clip.w;\n"
+        "    gl_Position = clip;\n"
+        "    gl_TexCoord[0] = vec4( mix(rect.xy, rect.zw, gl_Vertex.xy * 0.5 + 0.5), 0.0, 1.0 );\n"
+        "    gl_FrontColor = color;\n"
+        "}\n";
+
+    struct Item {
+        osg::Vec3d  _world;
+        std::string _href;
+        osg::Vec4f  _color;
+        float       _scale;
+    };
+
+    /** One icon as drawn: where, how big, and which part of its atlas page. */
+    struct Instance {
+        osg::Vec3f _local;
+        float      _halfSize;
+        osg::Vec4f _color;
+        osg::Vec2f _texMin;
+        osg::Vec2f _texMax;
+    };
+
+    /** The icons on one atlas page. */
+    struct Page {
+        osg::ref_ptr<osg::Texture2D> _atlas;
+        std::vector<Instance>        _instances;
+    };
+
+    /** The icon a point placemark shows: its IconStyle's, or the default one. */
+    std::string
+    s_getHref( KMLIconSymbol* icon )
+    {
+        return icon && icon->url().isSet() && !icon->url()->expr().empty() ? icon->url()->expr() : KMLIconService::DEFAULT_ICON;
+    }
+
+    // Whether each graphics context can draw instanced icons: 0 if not
+    // known yet, 1 if not, 2 if it can. Only the draw thread knows.
+    OpenThreads::Mutex       s_instancingMutex;
+    osg::buffered_value<int> s_instancing;
+
+    int
+    s_getInstancing( unsigned int contextID )
+    {
+        ScopedLock lock( s_instancingMutex );
+        return s_instancing[contextID];
+    }
+
+    /**
+     * Draws an instanced page only where the context supports it: instanced
+     * draws, integer texel fetches and float textures in the vertex shader.
+     */
+    class InstancedDrawCallback : public osg::Drawable::DrawCallback
+    {
+    public:
+        void drawImplementation( osg::RenderInfo& renderInfo, const osg::Drawable* drawable ) const
+        {
+            unsigned int id = renderInfo.getContextID();
+            int instancing;
+            {
+                ScopedLock lock( s_instancingMutex );
+                if ( s_instancing[id] == 0 )
+                {
+                    GLint vertexUnits = 0;
+                    glGetIntegerv( GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &vertexUnits );
+                    bool supported =
+                        osg::isGLExtensionSupported( id, "GL_EXT_draw_instanced" ) &&
+                        osg::isGLExtensionSupported( id, "GL_EXT_gpu_shader4" ) &&
+                        osg::isGLExtensionSupported( id, "GL_ARB_texture_float" ) &&
+                        vertexUnits > 0;
+                    s_instancing[id] = supported ? 2 : 1;
+                    OE_INFO << LC << "Instanced icons " << (supported ? "supported" : "not supported; using the fallback") << std::endl;
+                }
+                instancing = s_instancing[id];
+            }
+
+            if ( instancing == 2 )
+                drawable->drawImplementation( renderInfo );
+        }
+    };
+
+    /** One quad per icon, with its corners' offsets in texcoord 1 for the screen-space shader. */
+    osg::Node*
+    s_createFallback( const std::vector<Page>& pages )
+    {
+        osg::Geode* geode = new osg::Geode();
+        for( std::vector<Page>::const_iterator p = pages.begin(); p != pages.end(); ++p )
+        {
+            osg::Geometry* geom = new osg::Geometry();
+            geom->setUseVertexBufferObjects( true );
+            geom->setUseDisplayList( false );
+
+            osg::Vec3Array* verts   = new osg::Vec3Array();
+            osg::Vec2Array* tex     = new osg::Vec2Array();
+            osg::Vec2Array* offsets = new osg::Vec2Array();
+            osg::Vec4Array* colors  = new osg::Vec4Array();
+            verts->reserve( 4 * p->_instances.size() );
+            tex->reserve( 4 * p->_instances.size() );
+            offsets->reserve( 4 * p->_instances.size() );
+            colors->reserve( 4 * p->_instances.size() );
+
+            for( std::vector<Instance>::const_iterator i = p->_instances.begin(); i != p->_instances.end(); ++i )
+            {
+                osg::Vec2f size = i->_texMax - i->_texMin;
+                float longSide = std::max( size.x(), size.y() );
+                float hw = i->_halfSize * size.x() / longSide;
+                float hh = i->_halfSize * size.y() / longSide;
+
+                for( int k = 0; k < 4; ++k )
+                {
+                    verts->push_back( i->_local );
+                    colors->push_back( i->_color );
+                }
+                tex->push_back( osg::Vec2f(i->_texMin.x(), i->_texMin.y()) ); offsets->push_back( osg::Vec2f(-hw, -hh) );
+                tex->push_back( osg::Vec2f(i->_texMax.x(), i->_texMin.y()) ); offsets->push_back( osg::Vec2f( hw, -hh) );
+                tex->push_back( osg::Vec2f(i->_texMax.x(), i->_texMax.y()) ); offsets->push_back( osg::Vec2f( hw,  hh) );
+                tex->push_back( osg::Vec2f(i->_texMin.x(), i->_texMax.y()) ); offsets->push_back( osg::Vec2f(-hw,  hh) );
+            }
+
+            geom->setVertexArray( verts );
+            geom->setTexCoordArray( 0, tex );
+            geom->setTexCoordArray( 1, offsets );
+            geom->setColorArray( colors );
+            geom->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+            geom->addPrimitiveSet( new osg::DrawArrays(GL_QUADS, 0, verts->size()) );
+            geom->getOrCreateStateSet()->setTextureAttribute( 0, p->_atlas.get() );
+            geode->addDrawable( geom );
+        }
+
+        // the quads are grown in the shader, so the geometry's own bound is
+        // too small (zero, for a single icon) to cull by:
+        geode->setCullingActive( false );
+
+        KMLScreenSpace::install( geode, s_fragmentShader );
+        return geode;
+    }
+
+    /** Runs fallback builds, off the cull and draw threads. */
+    Godzi::TaskPool*
+    s_builderPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( 1 );
+        return s_pool.get();
+    }
+
+    /**
+     * A batch's pages, and the fallback drawing built from them once a
+     * context turns out to need it. Cull only reports what it found (under
+     * the mutex); the build runs as a task, and the update traversal adds
+     * the result to the graph and lets go of the pages.
+     */
+    class Fallback : public Godzi::Task
+    {
+    public:
+        Fallback( const std::vector<Page>& pages ) : _pages( pages ), _needed( false ), _instancingWorks( false ), _queued( false ) { }
+
+        /** From cull: a context can't draw instanced, so the fallback is needed. */
+        void request()
+        {
+            ScopedLock lock( _mutex );
+            _needed = true;
+        }
+
+        /** From cull: a context draws instanced. */
+        void instancingWorks()
+        {
+            ScopedLock lock( _mutex );
+            _instancingWorks = true;
+        }
+
+        /** From update: queues the build, and returns the built node once (NULL until then). */
+        osg::Node* update()
+        {
+            ScopedLock lock( _mutex );
+            if ( _needed && !_queued && !_pages.empty() )
+            {
+                _queued = true;
+                s_builderPool()->add( this );
+            }
+            else if ( !_needed && _instancingWorks )
+            {
+                // nothing left to build a fallback from, once instancing works:
+                _pages.clear();
+            }
+
+            osg::ref_ptr<osg::Node> result = _node.get();
+            _node = 0L;
+            return result.release();
+        }
+
+        void run()
+        {
+            std::vector<Page> pages;
+            {
+                ScopedLock lock( _mutex );
+                pages.swap( _pages );
+            }
+
+            osg::ref_ptr<osg::Node> node = s_createFallback( pages );
+
+            ScopedLock lock( _mutex );
+            _node = node.get();
+        }
+
+    private:
+        OpenThreads::Mutex      _mutex;
+        std::vector<Page>       _pages;
+        osg::ref_ptr<osg::Node> _node;    // built, not yet in the graph
+        bool                    _needed;
+        bool                    _instancingWorks;
+        bool                    _queued;
+    };
+
+    /**
+     * Picks the instanced or the fallback drawing of a batch, per context.
+     * Until the context has been probed, the instanced child is culled so
+     * that its draw callback can probe it. Cull never builds anything: it
+     * only picks among the children already there, and draws nothing for a
+     * context that needs the fallback until the update traversal has added
+     * it.
+     */
+    class PathCallback : public osg::NodeCallback
+    {
+    public:
+        PathCallback( Fallback* fallback ) : _fallback( fallback ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( nv );
+            osg::Group* group = static_cast<osg::Group*>( node );
+            if ( !cv || !cv->getState() )
+            {
+                traverse( node, nv );
+                return;
+            }
+
+            int instancing = s_getInstancing( cv->getState()->getContextID() );
+            if ( instancing == 1 )
+            {
+                if ( group->getNumChildren() > 1 )
+                    group->getChild( 1 )->accept( *nv );
+                else
+                    _fallback->request();
+            }
+            else
+            {
+                if ( instancing == 2 )
+                    _fallback->instancingWorks();
+                group->getChild( 0 )->accept( *nv );
+            }
+        }
+
+    protected:
+        osg::ref_ptr<Fallback> _fallback;
+    };
+
+    /** Adds the fallback drawing to the batch once it's built. */
+    class FallbackUpdateCallback : public osg::NodeCallback
+    {
+    public:
+        FallbackUpdateCallback( Fallback* fallback ) : _fallback( fallback ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            if ( _fallback.valid() )
+            {
+                osg::ref_ptr<osg::Node> built = _fallback->update();
+                if ( built.valid() )
+                {
+                    node->asGroup()->addChild( built.get() );
+                    _fallback = 0L;
+                }
+            }
+            traverse( node, nv );
+        }
+
+    protected:
+        osg::ref_ptr<Fallback> _fallback;
+    };
+
+    /** A page's instances as a float texture, in the layout s_instancedVertexShader reads. */
+    osg::Texture2D*
+    s_createInstanceTexture( const std::vector<Instance>& instances )
+    {
+        unsigned int rows = ( instances.size() + INSTANCES_PER_ROW - 1 ) / INSTANCES_PER_ROW;
+
+        osg::Image* image = new osg::Image();
+        image->allocateImage( 3 * INSTANCES_PER_ROW, rows, 1, GL_RGBA, GL_FLOAT );
+        image->setInternalTextureFormat( GL_RGBA32F_ARB );
+        ::memset( image->data(), 0, image->getTotalSizeInBytes() );
+
+        osg::Vec4f* texels = reinterpret_cast<osg::Vec4f*>( image->data() );
+        for( unsigned int i = 0; i < instances.size(); ++i )
+        {
+            const Instance& in = instances[i];
+            texels[3*i + 0] = osg::Vec4f( in._local, in._halfSize );
+            texels[3*i + 1] = in._color;
+            texels[3*i + 2] = osg::Vec4f( in._texMin.x(), in._texMin.y(), in._texMax.x(), in._texMax.y() );
+        }
+
+        osg::Texture2D* texture = new osg::Texture2D( image );
+        texture->setInternalFormat( GL_RGBA32F_ARB );
+        texture->setSourceFormat( GL_RGBA );
+        texture->setSourceType( GL_FLOAT );
+        texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
+        texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::NEAREST );
+        texture->setResizeNonPowerOfTwoHint( false );
+        texture->setUnRefImageDataAfterApply( true );
+        return texture;
+    }
+}
+
+//------------------------------------------------------------------------
+
+osg::Node*
+KMLIconBatch::create( const FeatureList& features, const osgEarth::Map* map )
+{
+    if ( !map )
+        return 0L;
+
+    std::vector<Item> items;
+    std::vector<std::string> hrefs;
+    std::set<std::string> seen;
+
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        Feature* feature = i->get();
+        if ( !KMLSymbolSource::isSymbol(feature) )
+            continue;
+
+        KMLIconSymbol* icon = feature->style()->get<KMLIconSymbol>();
+        bool clamp = !icon || !icon->altitude().isSet() || icon->altitude()->getAltitudeMode() == KMLAltitude::ClampToGround;
+        std::string href = s_getHref( icon );
+
+        Item item;
+        item._href  = href;
+        item._color = icon && icon->color().isSet() ? *icon->color() : osg::Vec4f(1,1,1,1);
+        item._scale = icon && icon->scale().isSet() ? icon->scale()->x() : 1.0f;
+
+        const Geometry* geom = feature->getGeometry();
+        for( Geometry::const_iterator p = geom->begin(); p != geom->end(); ++p )
+        {
+            if ( KMLScreenSpace::toWorld(map, osg::Vec3d(p->x(), p->y(), clamp ? 0.0 : p->z()), item._world) )
+                items.push_back( item );
+        }
+
+        if ( seen.insert(href).second )
+            hrefs.push_back( href );
+    }
+
+    if ( items.empty() )
+        return 0L;
+
+    // every distinct icon is fetched at once, before we wait on any:
+    KMLIconService* service = KMLIconService::instance();
+    service->prefetch( hrefs );
+
+    std::map<std::string, KMLIconService::Icon> icons;
+    for( std::vector<std::string>::const_iterator i = hrefs.begin(); i != hrefs.end(); ++i )
+    {
+        KMLIconService::Icon icon;
+        if ( service->getIcon(*i, icon) )
+            icons[*i] = icon;
+    }
+
+    // instances grouped by atlas page, relative to a local origin:
+    osg::Vec3d origin = items.front()._world;
+    std::vector<Page> pages;
+    osg::BoundingBox bound;
+
+    for( std::vector<Item>::const_iterator i = items.begin(); i != items.end(); ++i )
+    {
+        std::map<std::string, KMLIconService::Icon>::const_iterator j = icons.find( i->_href );
+        if ( j == icons.end() )
+            continue;
+        const KMLIconService::Icon& icon = j->second;
+
+        std::vector<Page>::iterator page = pages.begin();
+        while( page != pages.end() && page->_atlas.get() != icon._atlas.get() )
+            ++page;
+        if ( page == pages.end() )
+        {
+            pages.push_back( Page() );
+            page = pages.end() - 1;
+            page->_atlas = icon._atlas.get();
+        }
+
+        Instance in;
+        in._local    = i->_world - origin;
+        in._halfSize = 0.5f * ICON_PIXELS * i->_scale;
+        in._color    = i->_color;
+        in._texMin   = icon._texMin;
+        in._texMax   = icon._texMax;
+        page->_instances.push_back( in );
+        bound.expandBy( in._local );
+    }
+
+    if ( pages.empty() )
+        return 0L;
+
+    // The instanced drawing: a unit quad per page, drawn once per icon.
+    osg::Geode* instanced = new osg::Geode();
+    unsigned int numDrawn = 0;
+    for( std::vector<Page>::const_iterator p = pages.begin(); p != pages.end(); ++p )
+    {
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects( true );
+        geom->setUseDisplayList( false );
+
+        osg::Vec3Array* corners = new osg::Vec3Array();
+        corners->push_back( osg::Vec3f(-1, -1, 0) );
+        corners->push_back( osg::Vec3f( 1, -1, 0) );
+        corners->push_back( osg::Vec3f( 1,  1, 0) );
+        corners->push_back( osg::Vec3f(-1,  1, 0) );
+        geom->setVertexArray( corners );
+        geom->addPrimitiveSet( new osg::DrawArrays(GL_QUADS, 0, 4, p->_instances.size()) );
+
+        // the vertices say nothing about where the icons are:
+        geom->setInitialBound( bound );
+        geom->setDrawCallback( new InstancedDrawCallback() );
+
+        osg::StateSet* ss = geom->getOrCreateStateSet();
+        ss->setTextureAttribute( 0, p->_atlas.get() );
+        ss->setTextureAttribute( 1, s_createInstanceTexture(p->_instances) );
+        instanced->addDrawable( geom );
+        numDrawn += p->_instances.size();
+    }
+    instanced->setCullingActive( false );
+
+    KMLScreenSpace::install( instanced, s_fragmentShader, s_instancedVertexShader );
+    instanced->getOrCreateStateSet()->addUniform( new osg::Uniform("godzi_instances", 1) );
+
+    osg::Group* paths = new osg::Group();
+    paths->addChild( instanced );
+    osg::ref_ptr<Fallback> fallback = new Fallback( pages );
+    paths->setCullCallback( new PathCallback(fallback.get()) );
+    paths->setUpdateCallback( new FallbackUpdateCallback(fallback.get()) );
+
+    osg::MatrixTransform* xform = new osg::MatrixTransform( osg::Matrix::translate(origin) );
+    xform->addChild( paths );
+    xform->getOrCreateStateSet()->addUniform( new osg::Uniform("godzi_icon_atlas", 0) );
+
+    OE_INFO << LC << numDrawn << " icons in " << pages.size() << " batches" << std::endl;
+    return xform;
+}
@@ -0,0 +1,373 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLIconService>
+#include <osgEarth/HTTPClient>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osgDB/ReadFile>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMLIconService] "
+
+#define DEFAULT_FETCH_THREADS 4
+
+// atlas pages are this many pixels square:
+#define ATLAS_SIZE 1024
+
+// icons are reduced to fit this many pixels before they're packed:
+#define MAX_ICON_PIXELS 64
+
+// transparent border kept around each icon, so filtering doesn't bleed:
+#define ICON_PADDING 1
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    std::string s_directory;
+
+    /** 64-bit FNV-1a of an href, in hex, for a cache file name. */
+    std::string
+    s_hashName( const std::string& text )
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        for( std::string::const_iterator i = text.begin(); i != text.end(); ++i )
+        {
+            h ^= (unsigned char)*i;
+            h *= 1099511628211ULL;
+        }
+        char buf[32];
+        ::sprintf( buf, "%016llx", h );
+        return buf;
+    }
+
+    /** Reads an image, through the disk cache if it's remote and caching is on. */
+    osg::Image*
+    s_readIcon( const std::string& href )
+    {
+        if ( !osgDB::containsServerAddress(href) || s_directory.empty() )
+            return osgDB::readImageFile( href );
+
+        // the cached copy is named for the href, and keeps its extension so
+        // osgDB knows how to decode it:
+        std::string ext = osgDB::getLowerCaseFileExtension( href.substr(0, href.find('?')) );
+        std::string path = osgDB::concatPaths( s_directory, s_hashName(href) + "." + (ext.empty() ? "png" : ext) );
+
+        if ( !osgDB::fileExists(path) )
+        {
+            std::string bytes;
+            if ( HTTPClient::readString( href, bytes ) != HTTPClient::RESULT_OK )
+                return 0L;
+
+            // aside and renamed, so a failed write never leaves a partial icon:
+            std::string temp = path + ".tmp";
+            bool written;
+            {
+                std::ofstream out( temp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+                out.write( bytes.data(), bytes.size() );
+                out.close();
+                written = !out.fail();
+            }
+
+            if ( !written || ::rename( temp.c_str(), path.c_str() ) != 0 )
+            {
+                OE_WARN << LC << "Can't cache " << href << " in " << s_directory << std::endl;
+                ::remove( temp.c_str() );
+                return osgDB::readImageFile( href );
+            }
+        }
+
+        osg::Image* image = osgDB::readImageFile( path );
+        if ( !image )
+        {
+            // don't keep something we can't decode (an error page, say):
+            OE_WARN << LC << "Can't decode " << href << std::endl;
+            ::remove( path.c_str() );
+        }
+        return image;
+    }
+}
+
+//------------------------------------------------------------------------
+
+/** Reads one href, on a service thread. */
+class KMLIconService::FetchTask : public Godzi::Task
+{
+public:
+    FetchTask( const std::string& href ) : _href( href ) { }
+
+    void run()
+    {
+        _image = s_readIcon( _href );
+        if ( !_image.valid() )
+            OE_WARN << LC << "Failed to read icon " << _href << std::endl;
+    }
+
+    std::string _href;
+    osg::ref_ptr<osg::Image> _image; // released once the icon is placed
+};
+
+//------------------------------------------------------------------------
+
+/**
+ * One atlas page, filled a shelf (row of icons) at a time. Its texture may
+ * be drawing while icons are placed, so place() only queues the icon's
+ * pixels; they're copied into the page on the update traversal, when no
+ * draw reads it (the texture is DYNAMIC), and before the first frame that
+ * draws the icon.
+ */
+class KMLIconService::Atlas : public osg::Referenced
+{
+public:
+    /** Copies the queued icons into the page. */
+    class Flush : public osg::StateAttribute::Callback
+    {
+    public:
+        Flush( Atlas* atlas ) : _atlas( atlas ) { }
+        void operator()( osg::StateAttribute* attr, osg::NodeVisitor* nv ) { _atlas->flush(); }
+        Atlas* _atlas; // owns us, through its texture
+    };
+
+    Atlas() : _shelfY( 0 ), _shelfHeight( 0 ), _cursorX( 0 )
+    {
+        _image = new osg::Image();
+        _image->allocateImage( ATLAS_SIZE, ATLAS_SIZE, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+        ::memset( _image->data(), 0, _image->getTotalSizeInBytes() );
+
+        // mipmaps would blend neighboring icons, so filter linearly only:
+        _texture = new osg::Texture2D( _image.get() );
+        _texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR );
+        _texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+        _texture->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+        _texture->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+        _texture->setResizeNonPowerOfTwoHint( false );
+        _texture->setUnRefImageDataAfterApply( false ); // more icons may come
+        _texture->setDataVariance( osg::Object::DYNAMIC );
+        _texture->setUpdateCallback( new Flush(this) );
+    }
+
+    /** Queues an icon's pixels for the cell at (x,y). Any thread. */
+    void add( int x, int y, osg::Image* cell )
+    {
+        ScopedLock lock( _pendingMutex );
+        Pending p = { x, y, cell };
+        _pending.push_back( p );
+    }
+
+    /** Copies the queued icons into the page. Update traversal only. */
+    void flush()
+    {
+        std::vector<Pending> pending;
+        {
+            ScopedLock lock( _pendingMutex );
+            if ( _pending.empty() )
+                return;
+            pending.swap( _pending );
+        }
+
+        for( std::vector<Pending>::const_iterator i = pending.begin(); i != pending.end(); ++i )
+        {
+            const osg::Image* cell = i->_cell.get();
+            for( int t = 0; t < cell->t(); ++t )
+                ::memcpy( _image->data(i->_x, i->_y + t), cell->data(0, t), 4 * cell->s() );
+        }
+        _image->dirty();
+    }
+
+    /** Reserves a width x height cell; false if the page is full. */
+    bool allocate( int width, int height, int& out_x, int& out_y )
+    {
+        int w = width + 2*ICON_PADDING, h = height + 2*ICON_PADDING;
+
+        if ( _cursorX + w > ATLAS_SIZE )
+        {
+            _shelfY += _shelfHeight;
+            _shelfHeight = 0;
+            _cursorX = 0;
+        }
+
+        if ( w > ATLAS_SIZE || _shelfY + h > ATLAS_SIZE )
+            return false;
+
+        out_x = _cursorX + ICON_PADDING;
+        out_y = _shelfY + ICON_PADDING;
+        _cursorX += w;
+        _shelfHeight = std::max( _shelfHeight, h );
+        return true;
+    }
+
+    struct Pending {
+        int _x, _y;
+        osg::ref_ptr<osg::Image> _cell;
+    };
+
+    osg::ref_ptr<osg::Image>     _image;   // written by flush() only
+    osg::ref_ptr<osg::Texture2D> _texture;
+    int _shelfY, _shelfHeight, _cursorX;   // guarded by the service's _mutex
+    std::vector<Pending>         _pending;
+    OpenThreads::Mutex           _pendingMutex;
+};
+
+//------------------------------------------------------------------------
+
+const std::string KMLIconService::DEFAULT_ICON = "http://demo.pelicanmapping.com/rmweb/godzi_marker.png"; // static initializer
+
+KMLIconService*
+KMLIconService::instance()
+{
+    static osg::ref_ptr<KMLIconService> s_instance = new KMLIconService();
+    return s_instance.get();
+}
+
+void
+KMLIconService::setDirectory( const std::string& path )
+{
+    s_directory = path;
+}
+
+const std::string&
+KMLIconService::getDirectory()
+{
+    return s_directory;
+}
+
+KMLIconService::KMLIconService()
+{
+    _pool = new Godzi::TaskPool( DEFAULT_FETCH_THREADS );
+}
+
+KMLIconService::FetchTask*
+KMLIconService::fetch( const std::string& href )
+{
+    Fetches::iterator i = _fetches.find( href );
+    if ( i != _fetches.end() )
+        return i->second.get();
+
+    FetchTask* task = new FetchTask( href );
+    _fetches[href] = task;
+    _pool->add( task );
+    return task;
+}
+
+void
+KMLIconService::prefetch( const std::vector<std::string>& hrefs )
+{
+    ScopedLock lock( _mutex );
+    for( std::vector<std::string>::const_iterator i = hrefs.begin(); i != hrefs.end(); ++i )
+        fetch( *i );
+}
+
+bool
+KMLIconService::getIcon( const std::string& href, Icon& out_icon )
+{
+    osg::ref_ptr<FetchTask> task;
+    {
+        ScopedLock lock( _mutex );
+        std::map<std::string, Icon>::const_iterator i = _icons.find( href );
+        if ( i != _icons.end() )
+        {
+            out_icon = i->second;
+            return true;
+        }
+        task = fetch( href );
+    }
+
+    task->wait();
+
+    ScopedLock lock( _mutex );
+
+    // someone else may have placed it meanwhile:
+    std::map<std::string, Icon>::const_iterator i = _icons.find( href );
+    if ( i != _icons.end() )
+    {
+        out_icon = i->second;
+        return true;
+    }
+
+    if ( !task->_image.valid() || !place(task->_image.get(), out_icon) )
+        return false;
+
+    _icons[href] = out_icon;
+    task->_image = 0L;
+    return true;
+}
+
+bool
+KMLIconService::place( const osg::Image* image, Icon& out_icon )
+{
+    int w = image->s(), h = image->t();
+    if ( w < 1 || h < 1 )
+        return false;
+
+    double scale = std::min( 1.0, (double)MAX_ICON_PIXELS / std::max(w, h) );
+    int width  = std::max( (int)(w * scale + 0.5), 1 );
+    int height = std::max( (int)(h * scale + 0.5), 1 );
+
+    int x, y;
+    if ( _atlases.empty() || !_atlases.back()->allocate(width, height, x, y) )
+    {
+        _atlases.push_back( new Atlas() );
+        if ( !_atlases.back()->allocate(width, height, x, y) )
+            return false;
+    }
+    Atlas* atlas = _atlases.back().get();
+
+    // box-filter the icon down into a cell of its own, which the atlas
+    // copies in on the next update; icons are small, so osg's generic
+    // pixel reads are quick enough for any format:
+    osg::ref_ptr<osg::Image> cell = new osg::Image();
+    cell->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+    for( int t = 0; t < height; ++t )
+    {
+        int t0 = (int)(t / scale), t1 = std::max( std::min((int)((t+1) / scale), h), t0+1 );
+        unsigned char* dst = cell->data( 0, t );
+
+        for( int s = 0; s < width; ++s, dst += 4 )
+        {
+            int s0 = (int)(s / scale), s1 = std::max( std::min((int)((s+1) / scale), w), s0+1 );
+
+            osg::Vec4 sum;
+            for( int tt = t0; tt < t1; ++tt )
+                for( int ss = s0; ss < s1; ++ss )
+                    sum += image->getColor( ss, tt );
+            sum /= (float)((t1 - t0) * (s1 - s0));
+
+            for( int k = 0; k < 4; ++k )
+                dst[k] = (unsigned char)( osg::clampBetween(sum[k], 0.0f, 1.0f) * 255.0f + 0.5f );
+        }
+    }
+    atlas->add( x, y, cell.get() );
+
+    out_icon._atlas  = atlas->_texture.get();
+    out_icon._texMin.set( (float)x / ATLAS_SIZE, (float)y / ATLAS_SIZE );
+    out_icon._texMax.set( (float)(x + width) / ATLAS_SIZE, (float)(y + height) / ATLAS_SIZE );
+    out_icon._width  = (float)width;
+    out_icon._height = (float)height;
+    return true;
+}
@@ -0,0 +1,573 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLLabelBatch>
+#include <Godzi/KML/KMLScreenSpace>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/KML/KMLSymbolSource>
+#include <Godzi/Tasks>
+#include <osgText/Font>
+#include <osgText/String>
+#include <osgUtil/CullVisitor>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/MatrixTransform>
+#include <osg/Polytope>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cmath>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMLLabelBatch] "
+
+// size, in pixels, glyphs are rendered at in the glyph textures:
+#define FONT_RESOLUTION 32
+
+// labels start this far right of their anchor, clear of the icon:
+#define LABEL_OFFSET 18.0f
+
+// size of a declutter grid cell, in pixels:
+#define GRID_CELL 64.0f
+
+// labels in each chunk a declutter tests against the frustum as one:
+#define CHUNK_SIZE 64
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    // The glyph's alpha, over a dark halo made from the neighbouring texels
+    // so that labels read over bright imagery.
+    const char* s_fragmentShader =
+        "#version 110\n"
+        "uniform sampler2D godzi_glyphs;\n"
+        "uniform float godzi_glyph_texel;\n"
+        "void main()\n"
+        "{\n"
+        "    vec2 uv = gl_TexCoord[0].xy;\n"
+        "    float t = godzi_glyph_texel;\n"
+        "    float a = texture2D( godzi_glyphs, uv ).a;\n"
+        "    float halo = max(\n"
+        "        max( texture2D(godzi_glyphs, uv + vec2(t, 0.0)).a, texture2D(godzi_glyphs, uv - vec2(t, 0.0)).a ),\n"
+        "        max( texture2D(godzi_glyphs, uv + vec2(0.0, t)).a, texture2D(godzi_glyphs, uv - vec2(0.0, t)).a ) );\n"
+        "    vec4 color = mix( vec4(0.0, 0.0, 0.0, halo), vec4(gl_Color.rgb, 1.0), a );\n"
+        "    color.a *= gl_Color.a;\n"
+        "    if ( color.a < 0.05 ) discard;\n"
+        "    gl_FragColor = color;\n"
+        "}\n";
+
+    /** The font every label batch shares, so glyphs are rendered once for all of them. */
+    osgText::Font*
+    s_getFont()
+    {
+        static OpenThreads::Mutex s_mutex;
+        static osg::ref_ptr<osgText::Font> s_font;
+
+        ScopedLock lock( s_mutex );
+        if ( !s_font.valid() )
+        {
+            s_font = osgText::readFontFile( "fonts/arial.ttf" );
+            if ( !s_font.valid() )
+                s_font = osgText::Font::getDefaultFont();
+        }
+        return s_font.get();
+    }
+
+    /** Where a label's quads are in a page's vertex array. */
+    struct Run {
+        unsigned int _page;
+        unsigned int _first;
+        unsigned int _count;
+    };
+
+    struct Label {
+        osg::Vec3f       _local;  // anchor, relative to the batch origin
+        osg::Vec3f       _up;     // surface normal at the anchor
+        float            _width;  // extent on screen, in pixels
+        float            _height;
+        float            _size;
+        unsigned int     _order;  // in the document
+        std::vector<Run> _runs;
+    };
+
+    /** Bigger text first, then document order. */
+    bool
+    s_byPriority( const Label& lhs, const Label& rhs )
+    {
+        return lhs._size != rhs._size ? lhs._size > rhs._size : lhs._order < rhs._order;
+    }
+
+    struct Box {
+        float _xMin, _yMin, _xMax, _yMax;
+        bool overlaps( const Box& rhs ) const {
+            return _xMin < rhs._xMax && rhs._xMin < _xMax && _yMin < rhs._yMax && rhs._yMin < _yMax;
+        }
+    };
+
+    /** A view to declutter for. */
+    struct View {
+        osg::Matrixd _modelView;
+        osg::Matrixd _projection;
+        osg::Vec4d   _viewport;
+        bool operator == ( const View& rhs ) const {
+            return _modelView == rhs._modelView && _projection == rhs._projection && _viewport == rhs._viewport;
+        }
+        bool operator != ( const View& rhs ) const { return !( *this == rhs ); }
+    };
+
+    /** A run of labels near each other, by index in priority order. */
+    struct Chunk {
+        osg::BoundingBox          _bounds;
+        std::vector<unsigned int> _labels;
+    };
+
+    /** Spreads the low 10 bits of v over every third bit of the result. */
+    unsigned int
+    s_spread3( unsigned int v )
+    {
+        unsigned int out = 0;
+        for( int bit = 0; bit < 10; ++bit )
+            out |= ( (v >> bit) & 1u ) << (3 * bit);
+        return out;
+    }
+
+    /** Runs declutters, off the cull and draw threads. */
+    Godzi::TaskPool*
+    s_declutterPool()
+    {
+        static osg::ref_ptr<Godzi::TaskPool> s_pool = new Godzi::TaskPool( 1 );
+        return s_pool.get();
+    }
+
+    /**
+     * Decides which labels are shown. Cull asks for a declutter when the
+     * view changes; it runs as a task, and the update traversal rebuilds
+     * the index lists of the pages from its result. Only one runs at a
+     * time, and a view asked for meanwhile is placed when it finishes.
+     *
+     * The labels are grouped into chunks of neighbours along a Z-order
+     * curve, so a declutter only places the labels of the chunks in the
+     * view frustum rather than every label in the batch.
+     */
+    class Declutter : public osg::Referenced
+    {
+    public:
+        /** Places the labels for one view. */
+        class Place : public Godzi::Task
+        {
+        public:
+            Place( Declutter* declutter, const View& view ) : _declutter( declutter ), _view( view ) { }
+
+            void run()
+            {
+                _declutter->place( _view, _elements );
+                _declutter = 0L;
+            }
+
+            osg::ref_ptr<Declutter>                 _declutter;  // until run
+            View                                    _view;
+            std::vector< std::vector<unsigned int> > _elements;  // for each page
+        };
+
+        Declutter( const std::vector<Label>& labels, const std::vector<osg::DrawElementsUInt*>& pages, bool geocentric ) :
+        _labels( labels ),
+        _geocentric( geocentric ),
+        _requested( false )
+        {
+            std::stable_sort( _labels.begin(), _labels.end(), s_byPriority );
+            _pages.assign( pages.begin(), pages.end() );
+
+            // chunks are runs of CHUNK_SIZE labels along the curve through
+            // the batch's bounds:
+            osg::BoundingBox bounds;
+            for( std::vector<Label>::const_iterator i = _labels.begin(); i != _labels.end(); ++i )
+                bounds.expandBy( i->_local );
+
+            osg::Vec3f size = bounds._max - bounds._min;
+            std::vector< std::pair<unsigned int, unsigned int> > codes( _labels.size() );
+            for( unsigned int i = 0; i < _labels.size(); ++i )
+            {
+                osg::Vec3f p = _labels[i]._local - bounds._min;
+                unsigned int x = size.x() > 0.0f ? (unsigned int)( 1023.0f * p.x() / size.x() ) : 0;
+                unsigned int y = size.y() > 0.0f ? (unsigned int)( 1023.0f * p.y() / size.y() ) : 0;
+                unsigned int z = size.z() > 0.0f ? (unsigned int)( 1023.0f * p.z() / size.z() ) : 0;
+                codes[i] = std::make_pair( (s_spread3(x) << 2) | (s_spread3(y) << 1) | s_spread3(z), i );
+            }
+            std::sort( codes.begin(), codes.end() );
+
+            for( unsigned int i = 0; i < codes.size(); ++i )
+            {
+                if ( i % CHUNK_SIZE == 0 )
+                    _chunks.push_back( Chunk() );
+                _chunks.back()._labels.push_back( codes[i].second );
+                _chunks.back()._bounds.expandBy( _labels[codes[i].second]._local );
+            }
+        }
+
+        /** From cull: asks for the labels to be placed for a view, if they aren't already. */
+        void request( const View& view )
+        {
+            ScopedLock lock( _mutex );
+            if ( _requested && view == _view )
+                return;
+
+            _view = view;
+            _requested = true;
+            if ( !_placing.valid() )
+                start();
+        }
+
+        /** From update: sets the pages to draw the labels of the last declutter done. */
+        void update()
+        {
+            ScopedLock lock( _mutex );
+            if ( !_placing.valid() || !_placing->isDone() )
+                return;
+
+            if ( !_placing->isCanceled() )
+            {
+                for( unsigned int p = 0; p < _pages.size(); ++p )
+                {
+                    const std::vector<unsigned int>& elements = _placing->_elements[p];
+                    _pages[p]->clear();
+                    _pages[p]->insert( _pages[p]->end(), elements.begin(), elements.end() );
+                    _pages[p]->dirty();
+                }
+            }
+
+            bool stale = _placing->_view != _view;
+            _placing = 0L;
+            if ( stale )
+                start();
+        }
+
+        /** Places the labels in and around a view, from the worker. */
+        void place( const View& view, std::vector< std::vector<unsigned int> >& out_elements ) const
+        {
+            out_elements.resize( _pages.size() );
+
+            osg::Matrixd mvp = view._modelView * view._projection;
+            osg::Vec3d eye = osg::Vec3d(0,0,0) * osg::Matrixd::inverse( view._modelView );
+            float width = view._viewport.z(), height = view._viewport.w();
+
+            // the labels of the chunks in the frustum, back in priority order:
+            osg::Polytope frustum;
+            frustum.setToUnitFrustum( false, false );
+            frustum.transformProvidingInverse( mvp );
+
+            std::vector<unsigned int> visible;
+            for( std::vector<Chunk>::const_iterator c = _chunks.begin(); c != _chunks.end(); ++c )
+            {
+                if ( frustum.contains(c->_bounds) )
+                    visible.insert( visible.end(), c->_labels.begin(), c->_labels.end() );
+            }
+            std::sort( visible.begin(), visible.end() );
+
+            int columns = (int)::ceil( width / GRID_CELL ) + 1;
+            int rows    = (int)::ceil( height / GRID_CELL ) + 1;
+            std::vector< std::vector<Box> > grid( columns * rows );
+
+            for( std::vector<unsigned int>::const_iterator v = visible.begin(); v != visible.end(); ++v )
+            {
+                const Label& label = _labels[*v];
+
+                // over the horizon:
+                if ( _geocentric && osg::Vec3d(label._up) * (eye - osg::Vec3d(label._local)) < 0.0 )
+                    continue;
+
+                osg::Vec4d clip = osg::Vec4d( osg::Vec3d(label._local), 1.0 ) * mvp;
+                if ( clip.w() <= 0.0 )
+                    continue;
+
+                float x = 0.5f * ( clip.x() / clip.w() + 1.0f ) * width;
+                float y = 0.5f * ( clip.y() / clip.w() + 1.0f ) * height;
+                if ( x < 0.0f || x > width || y < 0.0f || y > height )
+                    continue;
+
+                Box box;
+                box._xMin = x + LABEL_OFFSET;
+                box._xMax = box._xMin + label._width;
+                box._yMin = y - 0.5f * label._height;
+                box._yMax = y + 0.5f * label._height;
+
+                int c0 = osg::clampBetween( (int)(box._xMin / GRID_CELL), 0, columns - 1 );
+                int c1 = osg::clampBetween( (int)(box._xMax / GRID_CELL), 0, columns - 1 );
+                int r0 = osg::clampBetween( (int)(box._yMin / GRID_CELL), 0, rows - 1 );
+                int r1 = osg::clampBetween( (int)(box._yMax / GRID_CELL), 0, rows - 1 );
+
+                bool blocked = false;
+                for( int r = r0; r <= r1 && !blocked; ++r )
+                {
+                    for( int c = c0; c <= c1 && !blocked; ++c )
+                    {
+                        const std::vector<Box>& cell = grid[r * columns + c];
+                        for( std::vector<Box>::const_iterator b = cell.begin(); b != cell.end() && !blocked; ++b )
+                            blocked = box.overlaps( *b );
+                    }
+                }
+                if ( blocked )
+                    continue;
+
+                for( int r = r0; r <= r1; ++r )
+                    for( int c = c0; c <= c1; ++c )
+                        grid[r * columns + c].push_back( box );
+
+                for( std::vector<Run>::const_iterator run = label._runs.begin(); run != label._runs.end(); ++run )
+                {
+                    std::vector<unsigned int>& elements = out_elements[run->_page];
+                    for( unsigned int i = run->_first; i < run->_first + run->_count; ++i )
+                        elements.push_back( i );
+                }
+            }
+        }
+
+    protected:
+        /** Queues a declutter of the view last asked for; with the mutex held. */
+        void start()
+        {
+            _placing = new Place( this, _view );
+            s_declutterPool()->add( _placing.get() );
+        }
+
+        std::vector<Label>                                  _labels;  // in priority order
+        std::vector<Chunk>                                  _chunks;
+        std::vector< osg::ref_ptr<osg::DrawElementsUInt> > _pages;
+        bool                                                _geocentric;
+        OpenThreads::Mutex                                  _mutex;
+        View                                                _view;    // last asked for
+        bool                                                _requested;
+        osg::ref_ptr<Place>                                 _placing;
+    };
+
+    /** Asks for a declutter whenever the view changes. */
+    class DeclutterCallback : public osg::NodeCallback
+    {
+    public:
+        DeclutterCallback( Declutter* declutter ) : _declutter( declutter ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( nv );
+            if ( cv && cv->getViewport() && cv->getModelViewMatrix() && cv->getProjectionMatrix() )
+            {
+                const osg::Viewport* vp = cv->getViewport();
+                View view;
+                view._modelView  = *cv->getModelViewMatrix();
+                view._projection = *cv->getProjectionMatrix();
+                view._viewport   = osg::Vec4d( vp->x(), vp->y(), vp->width(), vp->height() );
+                _declutter->request( view );
+            }
+            traverse( node, nv );
+        }
+
+    protected:
+        osg::ref_ptr<Declutter> _declutter;
+    };
+
+    /** Shows the labels of each declutter as it finishes. */
+    class DeclutterUpdateCallback : public osg::NodeCallback
+    {
+    public:
+        DeclutterUpdateCallback( Declutter* declutter ) : _declutter( declutter ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            _declutter->update();
+            traverse( node, nv );
+        }
+
+    protected:
+        osg::ref_ptr<Declutter> _declutter;
+    };
+}
+
+//------------------------------------------------------------------------
+
+osg::Node*
+KMLLabelBatch::create( const FeatureList& features, const osgEarth::Map* map )
+{
+    if ( !map )
+        return 0L;
+
+    osgText::Font* font = s_getFont();
+    if ( !font )
+        return 0L;
+
+    osgText::FontResolution resolution( FONT_RESOLUTION, FONT_RESOLUTION );
+
+    std::vector<Label> labels;
+    std::vector<osg::Texture2D*> textures;
+    std::vector< osg::ref_ptr<osg::Geometry> > pages;
+    osg::Vec3d origin;
+    unsigned int order = 0;
+
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        Feature* feature = i->get();
+        if ( !KMLSymbolSource::isSymbol(feature) )
+            continue;
+
+        // a label without content of its own shows the placemark's name:
+        KMLLabelSymbol* label = feature->style()->get<KMLLabelSymbol>();
+        if ( !label )
+            continue;
+        const std::string& content = label->content().isSet() ? label->content()->expr() : feature->getName();
+        if ( content.empty() )
+            continue;
+
+        KMLIconSymbol* icon = feature->style()->get<KMLIconSymbol>();
+        bool clamp = !icon || !icon->altitude().isSet() || icon->altitude()->getAltitudeMode() == KMLAltitude::ClampToGround;
+
+        float size  = label->size().isSet() ? *label->size() : (float)FONT_RESOLUTION;
+        float scale = size / (float)FONT_RESOLUTION;
+        osg::Vec4f color = label->fill().isSet() ? label->fill()->color() : osg::Vec4f(1,1,1,1);
+
+        osgText::String text( content, osgText::String::ENCODING_UTF8 );
+
+        const Geometry* geom = feature->getGeometry();
+        for( Geometry::const_iterator p = geom->begin(); p != geom->end(); ++p )
+        {
+            osg::Vec3d world;
+            if ( !KMLScreenSpace::toWorld(map, osg::Vec3d(p->x(), p->y(), clamp ? 0.0 : p->z()), world) )
+                continue;
+
+            if ( labels.empty() )
+                origin = world;
+
+            Label l;
+            l._local  = world - origin;
+            l._up     = map->isGeocentric() ? osg::Vec3f(world) : osg::Vec3f(0,0,1);
+            l._up.normalize();
+            l._height = size;
+            l._size   = size;
+            l._order  = order++;
+
+            // glyph metrics are in pixels at the font resolution; the text
+            // sits on a baseline a little below the anchor so that it reads
+            // as vertically centered.
+            float penX = LABEL_OFFSET, baseline = -0.3f * size;
+            for( osgText::String::const_iterator c = text.begin(); c != text.end(); ++c )
+            {
+                osgText::Glyph* glyph = font->getGlyph( resolution, *c );
+                if ( !glyph )
+                    continue;
+
+                if ( glyph->s() > 0 && glyph->t() > 0 && glyph->getTexture() )
+                {
+                    osg::Texture2D* texture = glyph->getTexture();
+                    unsigned int page = std::find( textures.begin(), textures.end(), texture ) - textures.begin();
+                    if ( page == textures.size() )
+                    {
+                        textures.push_back( texture );
+
+                        osg::Geometry* g = new osg::Geometry();
+                        g->setUseVertexBufferObjects( true );
+                        g->setUseDisplayList( false );
+                        g->setDataVariance( osg::Object::DYNAMIC );
+                        g->setVertexArray( new osg::Vec3Array() );
+                        g->setTexCoordArray( 0, new osg::Vec2Array() );
+                        g->setTexCoordArray( 1, new osg::Vec2Array() );
+                        g->setColorArray( new osg::Vec4Array() );
+                        g->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+
+                        float texel = texture->getTextureWidth() > 0 ? 1.0f / (float)texture->getTextureWidth() : 1.0f / 1024.0f;
+                        osg::StateSet* ss = g->getOrCreateStateSet();
+                        ss->setTextureAttribute( 0, texture );
+                        ss->addUniform( new osg::Uniform("godzi_glyph_texel", texel) );
+                        pages.push_back( g );
+                    }
+
+                    osg::Geometry* g = pages[page].get();
+                    osg::Vec3Array* verts   = static_cast<osg::Vec3Array*>( g->getVertexArray() );
+                    osg::Vec2Array* tex     = static_cast<osg::Vec2Array*>( g->getTexCoordArray(0) );
+                    osg::Vec2Array* offsets = static_cast<osg::Vec2Array*>( g->getTexCoordArray(1) );
+                    osg::Vec4Array* colors  = static_cast<osg::Vec4Array*>( g->getColorArray() );
+
+                    // one texel of padding all round leaves room for the halo:
+                    osg::Vec2f texPad( 1.0f / (float)texture->getTextureWidth(), 1.0f / (float)texture->getTextureHeight() );
+                    osg::Vec2f tMin = glyph->getMinTexCoord() - texPad, tMax = glyph->getMaxTexCoord() + texPad;
+
+                    float x0 = penX + (glyph->getHorizontalBearing().x() - 1.0f) * scale;
+                    float y0 = baseline + (glyph->getHorizontalBearing().y() - 1.0f) * scale;
+                    float x1 = x0 + ((float)glyph->s() + 2.0f) * scale;
+                    float y1 = y0 + ((float)glyph->t() + 2.0f) * scale;
+
+                    Run run;
+                    run._page  = page;
+                    run._first = verts->size();
+                    run._count = 4;
+                    if ( !l._runs.empty() && l._runs.back()._page == page )
+                        l._runs.back()._count += 4;
+                    else
+                        l._runs.push_back( run );
+
+                    for( int k = 0; k < 4; ++k )
+                    {
+                        verts->push_back( l._local );
+                        colors->push_back( color );
+                    }
+                    tex->push_back( osg::Vec2f(tMin.x(), tMin.y()) ); offsets->push_back( osg::Vec2f(x0, y0) );
+                    tex->push_back( osg::Vec2f(tMax.x(), tMin.y()) ); offsets->push_back( osg::Vec2f(x1, y0) );
+                    tex->push_back( osg::Vec2f(tMax.x(), tMax.y()) ); offsets->push_back( osg::Vec2f(x1, y1) );
+                    tex->push_back( osg::Vec2f(tMin.x(), tMax.y()) ); offsets->push_back( osg::Vec2f(x0, y1) );
+                }
+
+                penX += glyph->getHorizontalAdvance() * scale;
+            }
+
+            l._width = penX - LABEL_OFFSET;
+            if ( !l._runs.empty() )
+                labels.push_back( l );
+        }
+    }
+
+    if ( labels.empty() )
+        return 0L;
+
+    osg::Geode* geode = new osg::Geode();
+    std::vector<osg::DrawElementsUInt*> elements;
+    for( std::vector< osg::ref_ptr<osg::Geometry> >::iterator i = pages.begin(); i != pages.end(); ++i )
+    {
+        osg::DrawElementsUInt* de = new osg::DrawElementsUInt( GL_QUADS );
+        (*i)->addPrimitiveSet( de );
+        elements.push_back( de );
+        geode->addDrawable( i->get() );
+    }
+
+    // as with icons, the quads are grown in the shader:
+    geode->setCullingActive( false );
+    // labels are placed on a worker, and shown on the update traversal:
+    osg::ref_ptr<Declutter> declutter = new Declutter( labels, elements, map->isGeocentric() );
+    geode->setCullCallback( new DeclutterCallback(declutter.get()) );
+    geode->setUpdateCallback( new DeclutterUpdateCallback(declutter.get()) );
+
+    osg::MatrixTransform* xform = new osg::MatrixTransform( osg::Matrix::translate(origin) );
+    xform->addChild( geode );
+
+    KMLScreenSpace::install( xform, s_fragmentShader );
+    xform->getOrCreateStateSet()->addUniform( new osg::Uniform("godzi_glyphs", 0) );
+
+    OE_INFO << LC << labels.size() << " labels in " << pages.size() << " batches" << std::endl;
+    return xform;
+}
@@ -0,0 +1,474 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLLiveLink>
+#include <Godzi/Placemark>
+#include <Godzi/Tasks>
+#include <osgEarthUtil/EarthManipulator>
+#include <osgDB/FileNameUtils>
+#include <osg/Timer>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLLiveLink] "
+
+// Live link features get object IDs in a band of their own, clear of the
+// source's own features and of anything a region pager loads.
+#define LIVE_UID_BASE  0x40000000L
+#define LIVE_UID_SPAN  0x00100000L
+#define LIVE_UID_BANDS 1024
+
+// how often the scheduler looks for links that are due:
+#define SCHEDULER_PERIOD_US 500000
+
+// KML's default viewFormat:
+#define DEFAULT_VIEW_FORMAT "BBOX=[bboxWest],[bboxSouth],[bboxEast],[bboxNorth]"
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    typedef std::map< std::string, osg::ref_ptr<KMLLiveLink> > LiveLinks;
+
+    /** Every live link, by URL, the view they refresh for, and the threads that refresh them. */
+    struct Registry
+    {
+        Registry() : _numCreated( 0 ), _viewRevision( 0 ), _viewTime( 0.0 ) { }
+
+        ~Registry()
+        {
+            // the scheduler runs until told to stop; then join it before
+            // the fetch threads it feeds go away.
+            if ( _scheduler.valid() )
+                _scheduler->cancel();
+            _schedulerPool = 0L;
+            _fetchPool = 0L;
+        }
+
+        OpenThreads::Mutex            _mutex;
+        LiveLinks                     _links;
+        unsigned int                  _numCreated;
+        osg::ref_ptr<Godzi::Task>     _scheduler;
+        osg::ref_ptr<Godzi::TaskPool> _schedulerPool;
+        osg::ref_ptr<Godzi::TaskPool> _fetchPool;
+        Bounds                        _view;
+        unsigned int                  _viewRevision;
+        double                        _viewTime;
+    };
+
+    Registry&
+    s_registry()
+    {
+        static Registry s_instance;
+        return s_instance;
+    }
+
+    double
+    s_now()
+    {
+        return osg::Timer::instance()->time_s();
+    }
+
+    /** Fetches one live link on a pool thread. */
+    class RefreshTask : public Godzi::Task
+    {
+    public:
+        RefreshTask( KMLLiveLink* link ) : _link( link ) { }
+        void run() { _link->refresh(); }
+    private:
+        osg::ref_ptr<KMLLiveLink> _link;
+    };
+
+    /** Replaces each "[name]" in text with its value. */
+    std::string
+    s_substitute( const std::string& text, const std::map<std::string, std::string>& values )
+    {
+        std::string result = text;
+        for( std::map<std::string, std::string>::const_iterator i = values.begin(); i != values.end(); ++i )
+        {
+            std::string key = "[" + i->first + "]";
+            for( std::string::size_type pos = result.find( key ); pos != std::string::npos; pos = result.find( key, pos + i->second.size() ) )
+                result.replace( pos, key.size(), i->second );
+        }
+        return result;
+    }
+
+    /** Same placemark under another object ID. */
+    Placemark*
+    s_renumber( const Feature* feature, long fid )
+    {
+        Placemark* p = new Placemark( fid );
+        p->setName( feature->getName() );
+        p->setGeometry( const_cast<Geometry*>( feature->getGeometry() ) );
+        p->style() = feature->style();
+
+        const Placemark* source = dynamic_cast<const Placemark*>( feature );
+        if ( source )
+        {
+            p->lookAt() = source->lookAt();
+            p->region() = source->region();
+        }
+        return p;
+    }
+
+    /** Matches a placemark across fetches: by id, or by content when it has none. */
+    std::string
+    s_matchKey( const KMLParser::FeatureKey& key )
+    {
+        if ( !key._id.empty() )
+            return key._id;
+
+        std::stringstream buf;
+        buf << "#" << key._hash;
+        return buf.str();
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace Godzi { namespace KML
+{
+    /** Wakes up now and then to queue the links that are due. */
+    class KMLLiveLinkScheduler : public Godzi::Task
+    {
+    public:
+        void run()
+        {
+            while( !isCanceled() )
+            {
+                OpenThreads::Thread::microSleep( SCHEDULER_PERIOD_US );
+                KMLLiveLink::scheduleRefreshes();
+            }
+        }
+    };
+} }
+
+//------------------------------------------------------------------------
+
+KMLLiveLink*
+KMLLiveLink::get( const KMLParser::RefreshLink& link, const KMLFeatureSourceOptions& options )
+{
+    Registry& registry = s_registry();
+    ScopedLock lock( registry._mutex );
+
+    LiveLinks::iterator i = registry._links.find( link._url );
+    if ( i != registry._links.end() )
+        return i->second.get();
+
+    long firstUID = LIVE_UID_BASE + (registry._numCreated++ % LIVE_UID_BANDS) * LIVE_UID_SPAN;
+    KMLLiveLink* result = new KMLLiveLink( link, options, firstUID );
+    registry._links[link._url] = result;
+
+    if ( !registry._scheduler.valid() )
+    {
+        registry._fetchPool = new Godzi::TaskPool( 2 );
+        registry._scheduler = new KMLLiveLinkScheduler();
+        registry._schedulerPool = new Godzi::TaskPool( 1 );
+        registry._schedulerPool->add( registry._scheduler.get() );
+    }
+
+    return result;
+}
+
+void
+KMLLiveLink::setView( const Bounds& extent )
+{
+    Registry& registry = s_registry();
+    ScopedLock lock( registry._mutex );
+    registry._view = extent;
+    registry._viewRevision++;
+    registry._viewTime = s_now();
+}
+
+void
+KMLLiveLink::scheduleRefreshes()
+{
+    Registry& registry = s_registry();
+    ScopedLock lock( registry._mutex );
+
+    double now = s_now();
+    for( LiveLinks::iterator i = registry._links.begin(); i != registry._links.end(); )
+    {
+        KMLLiveLink* link = i->second.get();
+
+        // only the registry holds it; no source uses it anymore.
+        if ( link->referenceCount() == 1 )
+        {
+            OE_INFO << LC << "No longer refreshing " << i->first << std::endl;
+            registry._links.erase( i++ );
+            continue;
+        }
+
+        if ( link->isDue( now, registry._viewRevision, registry._viewTime ) )
+            registry._fetchPool->add( new RefreshTask( link ) );
+
+        ++i;
+    }
+}
+
+KMLLiveLink::KMLLiveLink( const KMLParser::RefreshLink& link, const KMLFeatureSourceOptions& options, long firstUID ) :
+_link( link ),
+_options( options ),
+_firstUID( firstUID ),
+_nextUID( firstUID ),
+_loaded( false ),
+_queued( false ),
+_lastFetch( 0.0 ),
+_viewRevision( 0 )
+{
+    //NOP
+}
+
+bool
+KMLLiveLink::isDue( double now, unsigned int viewRevision, double viewTime )
+{
+    ScopedLock lock( _mutex );
+
+    if ( !_loaded || _queued )
+        return false;
+
+    bool due =
+        (_link._interval > 0.0 && now - _lastFetch >= _link._interval) ||
+        (_link._onStop && viewRevision != _viewRevision && now - viewTime >= _link._viewRefreshTime);
+
+    // queued until the fetch is done:
+    if ( due )
+        _queued = true;
+
+    return due;
+}
+
+void
+KMLLiveLink::addListener( Listener* listener )
+{
+    ScopedLock lock( _mutex );
+    _listeners.push_back( listener );
+}
+
+void
+KMLLiveLink::removeListener( Listener* listener )
+{
+    ScopedLock lock( _mutex );
+    std::vector<Listener*>::iterator i = std::find( _listeners.begin(), _listeners.end(), listener );
+    if ( i != _listeners.end() )
+        _listeners.erase( i );
+}
+
+void
+KMLLiveLink::getFeatures( FeatureList& output ) const
+{
+    ScopedLock lock( _mutex );
+    output.insert( output.end(), _features.begin(), _features.end() );
+}
+
+void
+KMLLiveLink::ensureLoaded()
+{
+    ScopedLock fetchLock( _fetchMutex );
+    {
+        ScopedLock lock( _mutex );
+        if ( _loaded )
+            return;
+    }
+    fetch();
+}
+
+bool
+KMLLiveLink::refresh()
+{
+    ScopedLock fetchLock( _fetchMutex );
+    return fetch();
+}
+
+std::string
+KMLLiveLink::getFetchURL( const Bounds* view ) const
+{
+    // query strings only mean something to a server:
+    if ( !osgDB::containsServerAddress( _link._url ) )
+        return _link._url;
+
+    std::map<std::string, std::string> values;
+    values["clientVersion"] = "1";
+    values["kmlVersion"]    = "2.2";
+    values["clientName"]    = "Godzi";
+    values["language"]      = "en";
+
+    std::string query = s_substitute( _link._httpQuery, values );
+
+    if ( _link._onStop && view )
+    {
+        std::stringstream buf;
+        buf.precision( 10 );
+        buf << view->xMin(); values["bboxWest"] = buf.str(); buf.str( "" );
+        buf << view->yMin(); values["bboxSouth"] = buf.str(); buf.str( "" );
+        buf << view->xMax(); values["bboxEast"] = buf.str(); buf.str( "" );
+        buf << view->yMax(); values["bboxNorth"] = buf.str(); buf.str( "" );
+        buf << 0.5 * (view->xMin() + view->xMax()); values["lookatLon"] = buf.str(); buf.str( "" );
+        buf << 0.5 * (view->yMin() + view->yMax()); values["lookatLat"] = buf.str(); buf.str( "" );
+
+        std::string format = _link._viewFormat.empty() ? DEFAULT_VIEW_FORMAT : _link._viewFormat;
+        std::string viewQuery = s_substitute( format, values );
+        query = query.empty() ? viewQuery : viewQuery + "&" + query;
+    }
+
+    if ( query.empty() )
+        return _link._url;
+
+    return _link._url + (_link._url.find( '?' ) == std::string::npos ? "?" : "&") + query;
+}
+
+bool
+KMLLiveLink::fetch()
+{
+    // the view to fetch for:
+    Bounds view;
+    unsigned int viewRevision;
+    {
+        Registry& registry = s_registry();
+        ScopedLock lock( registry._mutex );
+        view = registry._view;
+        viewRevision = registry._viewRevision;
+    }
+
+    std::string url = getFetchURL( viewRevision > 0 ? &view : 0L );
+
+    KMLParser parser;
+    parser.setRecordKeys( true );
+    if ( _options.maxLinkDepth().isSet() )
+        parser.setMaxLinkDepth( *_options.maxLinkDepth() );
+    if ( _options.linkFetchThreads().isSet() )
+        parser.setNumFetchThreads( *_options.linkFetchThreads() );
+
+    FeatureList fetched;
+    bool ok = parser.parse( url, fetched ) && parser.getKeys().size() == fetched.size();
+
+    ScopedLock lock( _mutex );
+    _queued = false;
+    _lastFetch = s_now();
+    _viewRevision = viewRevision;
+
+    // keep what we had; try again when next due.
+    if ( !ok )
+    {
+        OE_WARN << LC << "Failed to refresh " << url << std::endl;
+        _loaded = true;
+        return false;
+    }
+
+    // previous placemarks by match key, still unclaimed:
+    std::multimap<std::string, unsigned int> previous;
+    for( unsigned int i = 0; i < _keys.size(); ++i )
+        previous.insert( std::make_pair( s_matchKey( _keys[i] ), i ) );
+
+    Changes changes;
+    std::vector<bool> kept( _features.size(), false );
+    FeatureList features;
+    features.reserve( fetched.size() );
+    const KMLParser::FeatureKeyList& keys = parser.getKeys();
+
+    for( unsigned int i = 0; i < fetched.size(); ++i )
+    {
+        std::multimap<std::string, unsigned int>::iterator match = previous.find( s_matchKey( keys[i] ) );
+        if ( match != previous.end() && _keys[match->second]._hash == keys[i]._hash )
+        {
+            // unchanged; keep the feature (and ID) everyone already has.
+            kept[match->second] = true;
+            features.push_back( _features[match->second] );
+            previous.erase( match );
+            continue;
+        }
+
+        if ( match != previous.end() )
+            previous.erase( match ); // changed; the old one goes below
+
+        Placemark* p = s_renumber( fetched[i].get(), _nextUID );
+        _nextUID = _nextUID + 1 < _firstUID + LIVE_UID_SPAN ? _nextUID + 1 : _firstUID;
+        features.push_back( p );
+        changes._added.push_back( p );
+    }
+
+    for( unsigned int i = 0; i < _features.size(); ++i )
+    {
+        if ( !kept[i] )
+            changes._removed.push_back( _features[i]->getFID() );
+    }
+
+    _features.swap( features );
+    _keys = keys;
+    _archives = parser.getArchives();
+
+    if ( _loaded && !changes.empty() )
+    {
+        OE_INFO << LC << url << ": " << changes._added.size() << " new or changed, "
+            << changes._removed.size() << " removed" << std::endl;
+
+        for( std::vector<Listener*>::iterator i = _listeners.begin(); i != _listeners.end(); ++i )
+            (*i)->onLinkChanged( this, changes );
+    }
+
+    _loaded = true;
+    return true;
+}
+
+//------------------------------------------------------------------------
+
+bool
+KMLViewRefreshHandler::handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+{
+    if ( ea.getEventType() != osgGA::GUIEventAdapter::FRAME || !aa.asView() )
+        return false;
+
+    osgEarth::Util::EarthManipulator* manip =
+        dynamic_cast<osgEarth::Util::EarthManipulator*>( aa.asView()->getCameraManipulator() );
+    if ( !manip )
+        return false;
+
+    osgEarth::Util::Viewpoint vp = manip->getViewpoint();
+    if ( vp.getFocalPoint() != _focal || vp.getRange() != _range )
+    {
+        _focal = vp.getFocalPoint();
+        _range = vp.getRange();
+        _moving = true;
+        return false;
+    }
+
+    // came to rest this frame:
+    if ( _moving )
+    {
+        _moving = false;
+
+        // roughly what a 30 degree field of view shows from the viewpoint's range:
+        double halfHeight = osg::clampBetween( _range * ::tan( osg::DegreesToRadians( 15.0 ) ) / 111120.0, 0.0, 90.0 );
+        double halfWidth  = osg::clampBetween( halfHeight / std::max( ::cos( osg::DegreesToRadians( _focal.y() ) ), 0.01 ), 0.0, 180.0 );
+
+        KMLLiveLink::setView( Bounds(
+            std::max( _focal.x() - halfWidth, -180.0 ), std::max( _focal.y() - halfHeight, -90.0 ),
+            std::min( _focal.x() + halfWidth, 180.0 ),  std::min( _focal.y() + halfHeight, 90.0 ) ) );
+    }
+
+    return false;
+}
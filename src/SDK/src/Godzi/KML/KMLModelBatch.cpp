@@ -0,0 +1,161 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLModelBatch>
+#include <Godzi/KML/KMLModelCache>
+#include <Godzi/KML/KMLScreenSpace>
+#include <Godzi/KML/KMLSymbol>
+#include <osgEarth/SpatialReference>
+#include <osg/Group>
+#include <osg/MatrixTransform>
+#include <set>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMLModelBatch] "
+
+namespace
+{
+    /**
+     * Hangs a model under its slot once the cache has loaded it. The slot is
+     * shared by all the placemarks that show the model, so this attaches it
+     * to all of them at once, in the update traversal.
+     */
+    class AttachCallback : public osg::NodeCallback
+    {
+    public:
+        AttachCallback( const std::string& href ) : _href( href ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            bool done;
+            osg::ref_ptr<osg::Node> model = KMLModelCache::instance()->getModel( _href, done );
+            if ( !done )
+            {
+                traverse( node, nv );
+                return;
+            }
+
+            if ( model.valid() )
+                static_cast<osg::Group*>( node )->addChild( model.get() );
+
+            // deletes this callback, so it's the last thing we do:
+            node->setUpdateCallback( 0L );
+        }
+
+    protected:
+        std::string _href;
+    };
+
+    /**
+     * Model placement, per the KML Orientation and Scale elements: scaled,
+     * then rolled (about y), tilted (about x) and turned to its heading
+     * (about z, clockwise from north) in the east-north-up frame at its
+     * Location.
+     */
+    bool
+    s_getMatrix( const KMLModelSymbol* symbol, const osgEarth::Map* map, osg::Matrixd& out_matrix )
+    {
+        const osg::Vec3d& lla = symbol->getLocation();
+
+        osg::Matrixd frame;
+        if ( map->isGeocentric() )
+        {
+            map->getProfile()->getSRS()->getEllipsoid()->computeLocalToWorldTransformFromLatLongHeight(
+                osg::DegreesToRadians(lla.y()), osg::DegreesToRadians(lla.x()), lla.z(), frame );
+        }
+        else
+        {
+            osg::Vec3d world;
+            if ( !KMLScreenSpace::toWorld(map, lla, world) )
+                return false;
+            frame.makeTranslate( world );
+        }
+
+        out_matrix =
+            osg::Matrixd::scale( symbol->getScale() ) *
+            osg::Matrixd::rotate( osg::DegreesToRadians(-symbol->getRoll()),    osg::Vec3d(0,1,0) ) *
+            osg::Matrixd::rotate( osg::DegreesToRadians(-symbol->getTilt()),    osg::Vec3d(1,0,0) ) *
+            osg::Matrixd::rotate( osg::DegreesToRadians(-symbol->getHeading()), osg::Vec3d(0,0,1) ) *
+            frame;
+        return true;
+    }
+}
+
+//------------------------------------------------------------------------
+
+bool
+KMLModelBatch::isModel( Feature* feature )
+{
+    if ( !feature->style().isSet() )
+        return false;
+
+    KMLModelSymbol* model = feature->style()->get<KMLModelSymbol>();
+    return model && model->url().isSet() && !model->url()->expr().empty();
+}
+
+osg::Node*
+KMLModelBatch::create( const FeatureList& features, const osgEarth::Map* map )
+{
+    if ( !map )
+        return 0L;
+
+    std::map< std::string, osg::ref_ptr<osg::Group> > slots;
+    std::vector<std::string> hrefs;
+    osg::ref_ptr<osg::Group> group = new osg::Group();
+
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        Feature* feature = i->get();
+        if ( !isModel(feature) )
+            continue;
+
+        const KMLModelSymbol* symbol = feature->style()->get<KMLModelSymbol>();
+        osg::Matrixd matrix;
+        if ( !s_getMatrix(symbol, map, matrix) )
+            continue;
+
+        const std::string& href = symbol->url()->expr();
+        osg::ref_ptr<osg::Group>& slot = slots[href];
+        if ( !slot.valid() )
+        {
+            slot = new osg::Group();
+            slot->setUpdateCallback( new AttachCallback(href) );
+            hrefs.push_back( href );
+        }
+
+        osg::MatrixTransform* xform = new osg::MatrixTransform( matrix );
+        xform->addChild( slot.get() );
+        group->addChild( xform );
+    }
+
+    if ( group->getNumChildren() == 0 )
+        return 0L;
+
+    KMLModelCache::instance()->prefetch( hrefs );
+
+    // a KML Scale would stretch the normals along with the model:
+    group->getOrCreateStateSet()->setMode( GL_NORMALIZE, osg::StateAttribute::ON );
+
+    OE_INFO << LC << group->getNumChildren() << " models of " << slots.size() << " kinds" << std::endl;
+    return group.release();
+}
@@ -0,0 +1,108 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLModelCache>
+#include <osgDB/ReadFile>
+#include <osgUtil/Optimizer>
+#include <OpenThreads/ScopedLock>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLModelCache] "
+
+#define DEFAULT_LOAD_THREADS 2
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+//------------------------------------------------------------------------
+
+/** Loads and optimizes one model, on a cache thread. */
+class KMLModelCache::LoadTask : public Godzi::Task
+{
+public:
+    LoadTask( const std::string& href ) : _href( href ) { }
+
+    void run()
+    {
+        osg::ref_ptr<osg::Node> node = osgDB::readNodeFile( _href );
+        if ( !node.valid() )
+        {
+            OE_WARN << LC << "Failed to read model " << _href << std::endl;
+            return;
+        }
+
+        // Nothing else sees the model yet, so it can be flattened and merged
+        // here rather than on the viewer's threads. It never changes after.
+        osgUtil::Optimizer optimizer;
+        optimizer.optimize( node.get(), osgUtil::Optimizer::DEFAULT_OPTIMIZATIONS );
+        node->setDataVariance( osg::Object::STATIC );
+
+        _node = node.get();
+        OE_INFO << LC << "Loaded " << _href << std::endl;
+    }
+
+    std::string _href;
+    osg::ref_ptr<osg::Node> _node; // read once the task is done
+};
+
+//------------------------------------------------------------------------
+
+KMLModelCache*
+KMLModelCache::instance()
+{
+    static osg::ref_ptr<KMLModelCache> s_instance = new KMLModelCache();
+    return s_instance.get();
+}
+
+KMLModelCache::KMLModelCache()
+{
+    _pool = new Godzi::TaskPool( DEFAULT_LOAD_THREADS );
+}
+
+KMLModelCache::LoadTask*
+KMLModelCache::load( const std::string& href )
+{
+    Loads::iterator i = _loads.find( href );
+    if ( i != _loads.end() )
+        return i->second.get();
+
+    LoadTask* task = new LoadTask( href );
+    _loads[href] = task;
+    _pool->add( task );
+    return task;
+}
+
+void
+KMLModelCache::prefetch( const std::vector<std::string>& hrefs )
+{
+    ScopedLock lock( _mutex );
+    for( std::vector<std::string>::const_iterator i = hrefs.begin(); i != hrefs.end(); ++i )
+        load( *i );
+}
+
+osg::Node*
+KMLModelCache::getModel( const std::string& href, bool& out_done )
+{
+    ScopedLock lock( _mutex );
+    LoadTask* task = load( href );
+    out_done = task->isDone();
+    return out_done ? task->_node.get() : 0L;
+}
@@ -19,12 +19,19 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include <Godzi/KML/KMLParser>
+#include <Godzi/KML/KMLIconService>
 #include <Godzi/KML/KMLSymbol>
+#include <Godzi/KML/KMZArchive>
 #include <Godzi/Placemark>
 #include <osgEarth/HTTPClient>
+#include <osgEarth/FileUtils>
 #include <osgEarthSymbology/Geometry>
 #include <osgEarthSymbology/Style>
 #include <osgEarthUtil/Viewpoint>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <algorithm>
+#include <sstream>
 
 using namespace Godzi;
 using namespace Godzi::KML;
@@ -33,9 +40,48 @@ using namespace osgEarth::Symbology;
 
 #define LC "[Godzi.KMLParser] "
 #define DEFAULT_LABEL_SIZE 32
+#define DEFAULT_MAX_LINK_DEPTH 8
+#define DEFAULT_FETCH_THREADS 8
 
 namespace
 {
+    /** FNV-1a, for telling whether a placemark changed between fetches. */
+    unsigned int
+    s_hash( const std::string& text )
+    {
+        unsigned int h = 2166136261u;
+        for( std::string::const_iterator i = text.begin(); i != text.end(); ++i )
+        {
+            h ^= (unsigned char)*i;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    /** Reads a KML Region; false if it has no extent. */
+    bool
+    s_parseRegion( const kmldom::RegionPtr& kmlRegion, Region& out )
+    {
+        if ( !kmlRegion || !kmlRegion->has_latlonaltbox() )
+            return false;
+
+        const kmldom::LatLonAltBoxPtr box = kmlRegion->get_latlonaltbox();
+
+        // KML's defaults: visible at any size.
+        double minPixels = 0.0, maxPixels = -1.0;
+        if ( kmlRegion->has_lod() )
+        {
+            const kmldom::LodPtr lod = kmlRegion->get_lod();
+            minPixels = lod->get_minlodpixels();
+            maxPixels = lod->get_maxlodpixels();
+        }
+
+        out = Region(
+            osgEarth::Bounds( box->get_west(), box->get_south(), box->get_east(), box->get_north() ),
+            minPixels, maxPixels );
+        return true;
+    }
+
     /** Converts a KML "abstract view" into an osgEarth::Util::Viewpoint. */
     bool
     s_parseView( const kmldom::AbstractViewPtr& av, Viewpoint& out )
@@ -64,6 +110,31 @@ namespace
         return false;
     }
 
+    /**
+     * Reduces a location to a canonical form so that the same document
+     * reached through different spellings is only read once.
+     */
+    std::string
+    s_canonicalLocation( const std::string& location )
+    {
+        // fragments never change the document:
+        std::string result = location.substr( 0, location.find('#') );
+
+        if ( osgDB::containsServerAddress(result) )
+        {
+            // scheme and host are case-insensitive:
+            std::string::size_type hostEnd = result.find( '/', result.find("://") + 3 );
+            std::string::size_type n = hostEnd == std::string::npos ? result.size() : hostEnd;
+            for( std::string::size_type i = 0; i < n; ++i )
+                result[i] = ::tolower( result[i] );
+        }
+        else
+        {
+            result = osgDB::convertFileNameToUnixStyle( osgDB::getRealPath(result) );
+        }
+        return result;
+    }
+
     /** Finds the root feature in a KML document */
     const kmldom::FeaturePtr
     s_getRootFeature(const kmldom::ElementPtr& root) 
@@ -82,30 +153,45 @@ namespace
         if (!coords || !coords->get_coordinates_array_size())
             return;
 
-        //osg::Vec3dArray* array = new osg::Vec3dArray(coords->get_coordinates_array_size());
-        output.reserve( coords->get_coordinates_array_size() );
-        output.clear();
+        // libkml has already tokenized the text by now, so all that's left
+        // is one straight copy into storage sized up front.
+        size_t size = coords->get_coordinates_array_size();
+        output.resize( size );
 
-        for (size_t i = 0; i < coords->get_coordinates_array_size(); ++i)
+        for (size_t i = 0; i < size; ++i)
         {
-            kmlbase::Vec3 in = coords->get_coordinates_array_at(i);
-
-            output.push_back( osg::Vec3d(
+            const kmlbase::Vec3& in = coords->get_coordinates_array_at(i);
+            output[i].set(
                 in.get_longitude(),
                 in.get_latitude(),
-                in.has_altitude()? in.get_altitude() : 0) );
+                in.has_altitude()? in.get_altitude() : 0 );
         }
-        //return array;
     }
 
     /** Dumps indented text */
     void
-    s_printIndented(std::string item, int depth)
+    s_printIndented(const std::string& item, int depth)
     {
-        while (depth--) {
+        while (depth-- > 0) {
             std::cout << "  ";
         }
-        std::cout << item;
+        std::cout << item << std::endl;
+    }
+
+    /**
+     * Creates a geometry of type T holding a coordinate list. The vertices
+     * are written straight into the geometry's storage, sized once.
+     */
+    template <class T>
+    T*
+    s_createGeometry(const kmldom::CoordinatesPtr coord)
+    {
+        if (!coord || !coord->get_coordinates_array_size())
+            return 0L;
+
+        T* geom = new T();
+        s_kmlCoordinatesToVec3dVector(coord, geom->asVector());
+        return geom;
     }
 
     /** Creates osgEarth Geometry from KML geometry */
@@ -115,39 +201,16 @@ namespace
         switch (kmlGeom->Type()) 
         {
         case kmldom::Type_Point:
-            {
-                const kmldom::CoordinatesPtr coord = kmldom::AsPoint(kmlGeom)->get_coordinates();
-                Vec3dVector points;
-                s_kmlCoordinatesToVec3dVector(coord, points);
-                if (points.size() > 0)
-                {
-                    PointSet* geom = new PointSet(&points);
-                    return (geom);
-                }
-            }
-            break;
+            return s_createGeometry<PointSet>( kmldom::AsPoint(kmlGeom)->get_coordinates() );
 
         case kmldom::Type_LineString:
-            {
-                const kmldom::CoordinatesPtr coord = kmldom::AsLineString(kmlGeom)->get_coordinates();
-                Vec3dVector points;
-                s_kmlCoordinatesToVec3dVector(coord, points);
-                if (points.size() > 0)
-                {
-                    LineString* geom = new LineString(&points);
-                    return (geom);
-                }
-            }
-            break;
+            return s_createGeometry<LineString>( kmldom::AsLineString(kmlGeom)->get_coordinates() );
 
         case kmldom::Type_LinearRing:
             {
-                const kmldom::CoordinatesPtr coord = kmldom::AsLinearRing(kmlGeom)->get_coordinates();
-                Vec3dVector points;
-                s_kmlCoordinatesToVec3dVector(coord, points);
-                if (points.size() > 0)
+                Ring* geom = s_createGeometry<Ring>( kmldom::AsLinearRing(kmlGeom)->get_coordinates() );
+                if (geom)
                 {
-                    Ring* geom = new Ring(&points);
                     geom->rewind( Ring::ORIENTATION_CCW );
                     return (geom);
                 }
@@ -157,30 +220,27 @@ namespace
         case kmldom::Type_Polygon:
             {
                 const kmldom::PolygonPtr poly = kmldom::AsPolygon(kmlGeom);
-                if (poly->has_outerboundaryis())
+                if (poly->has_outerboundaryis() && poly->get_outerboundaryis()->has_linearring())
                 {
                     const kmldom::CoordinatesPtr coord = poly->get_outerboundaryis()->get_linearring()->get_coordinates();
 
-                    Vec3dVector points;
-                    s_kmlCoordinatesToVec3dVector(coord, points);
-                    if (points.size() > 0 )
+                    Polygon* geom = s_createGeometry<Polygon>(coord);
+                    if (geom)
                     {
-                        Polygon* geom = new Polygon(&points);
                         geom->rewind( Ring::ORIENTATION_CCW );
 
+                        geom->getHoles().reserve( poly->get_innerboundaryis_array_size() );
                         for (size_t i = 0; i < poly->get_innerboundaryis_array_size(); ++i)
                         {
-                            const kmldom::CoordinatesPtr inner = poly->get_innerboundaryis_array_at(i)->get_linearring()->get_coordinates();
-                            if (inner)
+                            const kmldom::InnerBoundaryIsPtr boundary = poly->get_innerboundaryis_array_at(i);
+                            if (!boundary->has_linearring())
+                                continue;
+
+                            Ring* hole = s_createGeometry<Ring>( boundary->get_linearring()->get_coordinates() );
+                            if (hole)
                             {
-                                Vec3dVector holePoints;
-                                s_kmlCoordinatesToVec3dVector(coord, holePoints);
-                                if ( holePoints.size() > 0 )
-                                {
-                                    Ring* hole = new Ring(&holePoints);
-                                    hole->rewind( Ring::ORIENTATION_CW );
-                                    geom->getHoles().push_back( hole );
-                                }
+                                hole->rewind( Ring::ORIENTATION_CW );
+                                geom->getHoles().push_back( hole );
                             }
                         }
 
@@ -196,6 +256,7 @@ namespace
                 if (mgeom && mgeom->get_geometry_array_size() > 0)
                 {
                     MultiGeometry* geom = new MultiGeometry;
+                    geom->getComponents().reserve( mgeom->get_geometry_array_size() );
 
                     for (size_t i = 0; i < mgeom->get_geometry_array_size(); ++i) {
                         const kmldom::GeometryPtr g = mgeom->get_geometry_array_at(i);
@@ -304,9 +365,46 @@ namespace
         return osg::Vec4(r,g,b,a);
     }
 
-    /** Creates an osgEarth Style from a KML style. */
+    /**
+     * The geometry properties that s_createSymbol copies into symbols,
+     * as a style cache key.
+     */
+    std::string
+    s_geometryStyleKey(const kmldom::GeometryPtr& kmlGeom)
+    {
+        int altitudeMode = -1;
+        int extrude = -1;
+
+        if (kmldom::PolygonPtr geom = kmldom::AsPolygon(kmlGeom)) {
+            altitudeMode = geom->get_altitudemode();
+            extrude = geom->get_extrude();
+        }
+        else if (kmldom::LineStringPtr geom = kmldom::AsLineString(kmlGeom)) {
+            altitudeMode = geom->get_altitudemode();
+            extrude = geom->get_extrude();
+        }
+        else if (kmldom::LinearRingPtr geom = kmldom::AsLinearRing(kmlGeom)) {
+            altitudeMode = geom->get_altitudemode();
+            extrude = geom->get_extrude();
+        }
+        else if (kmldom::PointPtr geom = kmldom::AsPoint(kmlGeom)) {
+            altitudeMode = geom->get_altitudemode();
+            extrude = geom->get_extrude();
+        }
+
+        std::stringstream buf;
+        buf << kmlGeom->Type() << ':' << altitudeMode << ':' << extrude;
+        return buf.str();
+    }
+
+    /**
+     * Creates an osgEarth Style from a KML style. The label symbol is
+     * returned separately, without content: a label shows its placemark's
+     * name, so one symbol serves every placemark with the style.
+     */
     Style
-    s_createStyle(kmldom::StylePtr kmlStyle, const kmldom::GeometryPtr kmlGeom)
+    s_createStyle(kmldom::StylePtr kmlStyle, const kmldom::GeometryPtr kmlGeom, const std::string& location,
+                  osg::ref_ptr<KMLLabelSymbol>& out_label)
     {
         Style earthStyle;
 
@@ -328,7 +426,7 @@ namespace
                 s->size() = s->size().value() * kmls->get_scale();
             }
 
-            earthStyle.addSymbol(s);
+            out_label = s;
         }
 
         // line style => LineSymbol
@@ -381,19 +479,19 @@ namespace
             kmldom::IconStylePtr kmls = kmlStyle->get_iconstyle();
             KMLIconSymbol* s = s_createSymbol<KMLIconSymbol>(kmlGeom);
 
-            //if (kmls->has_color()) {
-            //    s->fill()->color() = s_getColor(kmls->get_color());
-            //}
+            if (kmls->has_color()) {
+                s->color() = s_getColor(kmls->get_color());
+            }
 
             if (kmls->has_scale()) {
               s->scale() = osg::Vec3f(kmls->get_scale(),kmls->get_scale(),kmls->get_scale());
             }
 
             if (kmls->has_icon() && kmls->get_icon()->has_href()) {
-                s->url() = kmls->get_icon()->get_href();
+                s->url() = KMZArchive::resolveHref( location, kmls->get_icon()->get_href() );
             }
             else {
-                s->url() = "http://demo.pelicanmapping.com/rmweb/godzi_marker.png";
+                s->url() = KMLIconService::DEFAULT_ICON;
             }
 
             earthStyle.addSymbol(s);
@@ -404,75 +502,200 @@ namespace
 
 //------------------------------------------------------------------------
 
+/** Reads and parses one KML document; runs on a pool thread for NetworkLinks. */
+class KMLParser::FetchTask : public Godzi::Task
+{
+public:
+    FetchTask( const std::string& location ) : _location( location ), _size( 0 ) { }
+
+    void run()
+    {
+        std::string content;
+        std::string entry;
+
+        // a document packaged in an archive we already have open:
+        _archive = KMZArchive::find( _location, entry );
+        if ( _archive.valid() )
+        {
+            if ( !_archive->readEntry( entry, content ) )
+            {
+                _errors = _location + ": read failed";
+                return;
+            }
+        }
+
+        // a KMZ: map the package and inflate its root document. Relative
+        // hrefs then resolve to entries in the package.
+        else if ( KMZArchive::isArchive( _location ) )
+        {
+            _archive = KMZArchive::open( _location );
+            if ( !_archive.valid() || !_archive->readEntry( _archive->getDocumentName(), content ) )
+            {
+                _errors = _location + ": read failed";
+                return;
+            }
+            _location = _archive->getEntryPath( _archive->getDocumentName() );
+        }
+
+        else if ( HTTPClient::readString( _location, content ) != HTTPClient::RESULT_OK )
+        {
+            _errors = _location + ": read failed";
+            return;
+        }
+
+        _size = content.size();
+
+        // The KmlFile owns the DOM, so the same tree serves both style
+        // resolution (CreateResolvedStyle) and the feature walk.
+        _kmlFile = kmlengine::KmlFile::CreateFromParse( content, &_errors );
+    }
+
+    std::string              _location;
+    std::string              _errors;
+    std::string::size_type   _size;
+    kmlengine::KmlFilePtr    _kmlFile;
+    osg::ref_ptr<KMZArchive> _archive;
+};
+
+//------------------------------------------------------------------------
+
 KMLParser::KMLParser() :
 _depth( 0 ),
-_nextUID( 0L )
+_nextUID( 0L ),
+_verbose( false ),
+_maxLinkDepth( DEFAULT_MAX_LINK_DEPTH ),
+_numFetchThreads( DEFAULT_FETCH_THREADS ),
+_recordKeys( false )
 {
-    //NOP
+    _defaultLabel = new KMLLabelSymbol;
+    _defaultLabel->size() = DEFAULT_LABEL_SIZE;
 }
 
 bool
 KMLParser::parse( const std::string& location, FeatureList& out_results )
 {    
     _depth = -1;
+
+    // per-object diagnostics are expensive on large documents, so only emit
+    // them when the notify level asks for debug output.
+    _verbose = osg::isNotifyEnabled( osg::DEBUG_INFO );
+
+    _visited.clear();
+    _visited.insert( s_canonicalLocation(location) );
+    _archives.clear();
+    _regionLinks.clear();
+    _refreshLinks.clear();
+    _groundOverlays.clear();
+    _keys.clear();
+    _styleCache.clear();
+
+    // libkml creates its element factory on first use; do that here so the
+    // fetch threads never race to initialize it.
+    kmldom::KmlFactory::GetFactory();
+
+    if ( _numFetchThreads > 0 )
+        _pool = new Godzi::TaskPool( _numFetchThreads );
+
+    osg::ref_ptr<FetchTask> root = new FetchTask( location );
+    root->run();
+
     _contextStack.push( ParserContext(out_results, _nextUID) );
-    bool ok = parseLocation( location );
+    context()._region = _rootRegion;
+    bool ok = parseDocument( root.get(), 0 );
     _contextStack.pop();
-    return ok;
+
+    // joins the fetch threads:
+    _pool = 0L;
+
+    return ok && !isCanceled();
 }
 
 bool
-KMLParser::parseLocation( const std::string& location )
+KMLParser::parseDocument( FetchTask* fetch, int linkDepth )
 {
-    OE_INFO << LC << "KML: Reading from: " << location << std::endl;
+    OE_INFO << LC << "KML: Reading from: " << fetch->_location << std::endl;
 
-    // Read it.
-    std::string content;
-    if ( HTTPClient::readString( location, content ) != HTTPClient::RESULT_OK )
+    if ( !fetch->_kmlFile )
     {
-        OE_WARN << LC << location << ": read failed" << std::endl;
+        OE_WARN << LC << fetch->_errors << std::endl;
         return false;
     }
 
-    std::string errors;
-    kmlengine::KmlFilePtr kmlFile = kmlengine::KmlFile::CreateFromParse(content, &errors);
-    if (!kmlFile)
+    const kmldom::FeaturePtr rootKmlFeature = s_getRootFeature( fetch->_kmlFile->get_root() );
+    if ( !rootKmlFeature )
     {
-        OE_WARN << LC << errors << std::endl;
+        OE_WARN << LC << "No root feature" << std::endl;
         return false;
     }
 
-    // Parse it.
-    errors.clear();
-    kmldom::ElementPtr root = kmldom::Parse(content, &errors);
-    if (!root)
-    {
-        OE_WARN << LC << errors << std::endl;
-        return false;
-    }
+    ++_depth;
+    _contextStack.push( ParserContext( context(), fetch->_kmlFile, fetch->_location, linkDepth ) );
 
-    const kmldom::FeaturePtr rootKmlFeature = s_getRootFeature(root);
+    // the fetched DOM now belongs to the context.
+    fetch->_kmlFile = 0L;
 
-    if ( rootKmlFeature )
+    if ( _progress.valid() )
+        _progress->addBytesRead( fetch->_size );
+
+    // hold on to archives so their embedded resources stay readable:
+    if ( fetch->_archive.valid() && std::find(_archives.begin(), _archives.end(), fetch->_archive) == _archives.end() )
+        _archives.push_back( fetch->_archive.get() );
+
+    parseFeature( rootKmlFeature );
+
+    // Fetch every NetworkLink this document referenced at once, then merge
+    // the results in document order so feature order and UIDs stay the
+    // same from run to run. Linked content follows the linking document's
+    // own placemarks.
+    std::vector< osg::ref_ptr<FetchTask> > fetches;
+    for( std::vector<std::string>::const_iterator i = context()._links.begin(); i != context()._links.end() && !isCanceled(); ++i )
     {
-        ++_depth;
-        _contextStack.push( ParserContext( context(), kmlFile ) );
-        parseFeature( rootKmlFeature );
-        _contextStack.pop();
-        --_depth;
+        FetchTask* task = new FetchTask( *i );
+        fetches.push_back( task );
+        if ( _pool.valid() )
+            _pool->add( task );
     }
-    else
+    context()._links.clear();
+
+    for( std::vector< osg::ref_ptr<FetchTask> >::iterator i = fetches.begin(); i != fetches.end(); ++i )
     {
-        OE_WARN << LC << "No root feature" << std::endl;
-        return false;
+        if ( isCanceled() )
+        {
+            (*i)->cancel();
+            continue;
+        }
+
+        if ( _pool.valid() )
+            (*i)->wait();
+        else
+            (*i)->run();
+
+        parseDocument( i->get(), linkDepth+1 );
+
+        // release each linked DOM as soon as we're done with it.
+        *i = 0L;
     }
 
+    _contextStack.pop();
+    --_depth;
+
     return true;
 }
 
 bool
 KMLParser::parseFeature(const kmldom::FeaturePtr& kmlFeature)
 {
+    // A Region governs the feature and everything under it. Nested regions
+    // are normally inside their parents (superoverlays are built that way),
+    // so the innermost one stands in for the whole chain.
+    optional<Region> parentRegion = context()._region;
+    if ( kmlFeature->has_region() )
+    {
+        Region region;
+        if ( s_parseRegion( kmlFeature->get_region(), region ) )
+            context()._region = region;
+    }
+
     switch( kmlFeature->Type() )
     {
     case kmldom::Type_Document:
@@ -484,7 +707,7 @@ KMLParser::parseFeature(const kmldom::FeaturePtr& kmlFeature)
         break;
 
     case kmldom::Type_GroundOverlay:
-        // NYI
+        parseGroundOverlay( kmldom::AsGroundOverlay(kmlFeature) );
         break;
 
     case kmldom::Type_PhotoOverlay:
@@ -507,7 +730,7 @@ KMLParser::parseFeature(const kmldom::FeaturePtr& kmlFeature)
         break;
     }
 
-    if ( kmlFeature->has_name() )
+    if ( _verbose && kmlFeature->has_name() )
     {
         OE_INFO << " " << kmlFeature->get_name() << std::endl;
     }
@@ -516,13 +739,48 @@ KMLParser::parseFeature(const kmldom::FeaturePtr& kmlFeature)
     if ( const kmldom::ContainerPtr container = kmldom::AsContainer(kmlFeature) )
     {
         ++_depth;
-        for (size_t i = 0; i < container->get_feature_array_size(); ++i)
+        for (size_t i = 0; i < container->get_feature_array_size() && !isCanceled(); ++i)
         {
             parseFeature( container->get_feature_array_at(i) );
         }
         --_depth;
     }
 
+    context()._region = parentRegion;
+    return true;
+}
+
+bool
+KMLParser::parseGroundOverlay(const kmldom::GroundOverlayPtr& kmlOverlay)
+{
+    if ( !kmlOverlay->has_icon() || !kmlOverlay->get_icon()->has_href() || !kmlOverlay->has_latlonbox() )
+    {
+        if ( _verbose )
+            OE_INFO << LC << "Skipping GroundOverlay without an image or LatLonBox" << std::endl;
+        return false;
+    }
+
+    const kmldom::LatLonBoxPtr box = kmlOverlay->get_latlonbox();
+    if ( box->get_north() <= box->get_south() )
+        return false;
+
+    GroundOverlay overlay;
+    overlay._name = kmlOverlay->get_name();
+    overlay._url = KMZArchive::resolveHref( context()._location, kmlOverlay->get_icon()->get_href() );
+    overlay._north = box->get_north();
+    overlay._south = box->get_south();
+    overlay._west = box->get_west();
+    overlay._east = box->get_east();
+    overlay._rotation = box->get_rotation();
+    overlay._drawOrder = kmlOverlay->get_draworder();
+    if ( kmlOverlay->has_color() )
+        overlay._color = s_getColor( kmlOverlay->get_color() );
+
+    // boxes across the antimeridian keep east > west:
+    if ( overlay._east <= overlay._west )
+        overlay._east += 360.0;
+
+    _groundOverlays.push_back( overlay );
     return true;
 }
 
@@ -534,12 +792,88 @@ KMLParser::parseNetworkLink(const kmldom::NetworkLinkPtr& networkLink)
         const kmldom::LinkPtr link = networkLink->get_link();
         if ( link->has_href() )
         {
-            parseLocation( link->get_href() );
+            if ( context()._linkDepth >= _maxLinkDepth )
+            {
+                OE_WARN << LC << "NetworkLink depth limit reached, skipping " << link->get_href() << std::endl;
+                return true;
+            }
+
+            // resolve relative links against the linking document, and skip
+            // anything we've already read (duplicates and cycles alike).
+            std::string location = KMZArchive::resolveHref( context()._location, link->get_href() );
+            if ( !_visited.insert( s_canonicalLocation(location) ).second )
+            {
+                if ( _verbose )
+                    OE_INFO << LC << "Already read " << location << ", skipping" << std::endl;
+                return true;
+            }
+
+            // inside a Region: left for the caller to page in when it's in view.
+            if ( context()._region.isSet() )
+            {
+                _regionLinks.push_back( RegionLink( location, *context()._region ) );
+                return true;
+            }
+
+            // refreshing: KMLLiveLink fetches it, now and whenever it's due.
+            bool periodic = link->get_refreshmode() == kmldom::REFRESHMODE_ONINTERVAL && link->get_refreshinterval() > 0.0;
+            bool onStop = link->get_viewrefreshmode() == kmldom::VIEWREFRESHMODE_ONSTOP;
+            if ( periodic || onStop )
+            {
+                RefreshLink refresh;
+                refresh._url = location;
+                refresh._interval = periodic ? link->get_refreshinterval() : 0.0;
+                refresh._onStop = onStop;
+                refresh._viewRefreshTime = link->get_viewrefreshtime();
+                refresh._viewFormat = link->get_viewformat();
+                refresh._httpQuery = link->get_httpquery();
+                _refreshLinks.push_back( refresh );
+                return true;
+            }
+
+            // queued; parseDocument fetches it along with its siblings.
+            context()._links.push_back( location );
         }
     }
     return true;
 }
 
+const KMLParser::CachedStyle&
+KMLParser::resolveStyle( const kmldom::PlacemarkPtr& kmlPlacemark )
+{
+    std::string key = kmlPlacemark->get_styleurl();
+    key += '\n';
+    if ( kmlPlacemark->has_styleselector() )
+        key += kmldom::SerializeRaw( kmlPlacemark->get_styleselector() );
+    key += '\n';
+    key += s_geometryStyleKey( kmlPlacemark->get_geometry() );
+
+    StyleIndex::iterator i = context()._styleIndex.find( key );
+    if ( i != context()._styleIndex.end() )
+        return *i->second;
+
+    kmldom::StylePtr kmlStyle = kmlengine::CreateResolvedStyle( kmlPlacemark, context()._kmlFile, kmldom::STYLESTATE_NORMAL );
+
+    // relative hrefs resolve against the document's directory, so styles
+    // are the same across documents that share one:
+    const std::string& location = context()._location;
+    std::string content = kmldom::SerializeRaw( kmlStyle );
+    content += '\n';
+    content += s_geometryStyleKey( kmlPlacemark->get_geometry() );
+    content += '\n';
+    content += location.substr( 0, location.find_last_of("/\\") + 1 );
+
+    CachedStyle& entry = _styleCache[content];
+    if ( !entry._built )
+    {
+        entry._style = s_createStyle( kmlStyle, kmlPlacemark->get_geometry(), location, entry._label );
+        entry._built = true;
+    }
+
+    context()._styleIndex[key] = &entry;
+    return entry;
+}
+
 bool
 KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
 {
@@ -547,9 +881,8 @@ KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
         return false;
 
     Placemark* p = new Placemark( context()._nextUID++ );
-
-    // resolve the style attached to this feature:
-    kmldom::StylePtr kmlStyle = kmlengine::CreateResolvedStyle( kmlPlacemark, context()._kmlFile, kmldom::STYLESTATE_NORMAL );
+    if ( context()._region.isSet() )
+        p->region() = *context()._region;
 
     p->setName( kmlPlacemark->get_name() );
 
@@ -584,7 +917,7 @@ KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
 
             if (kmlModel->has_link())
             {
-                modelSymbol->url() = kmlModel->get_link()->get_href();
+                modelSymbol->url() = KMZArchive::resolveHref( context()._location, kmlModel->get_link()->get_href() );
             }
             else
             {
@@ -604,7 +937,12 @@ KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
             {
                 p->setGeometry(geom);
 
-                p->style() = s_createStyle(kmlStyle, kmlPlacemark->get_geometry());
+                // the symbols, label included, are shared with every other
+                // placemark that resolves to the same style.
+                const CachedStyle& style = resolveStyle( kmlPlacemark );
+                p->style() = style._style;
+                if ( style._label.valid() )
+                    p->style()->addSymbol( style._label.get() );
             } 
 
             else
@@ -613,17 +951,15 @@ KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
             }
         }
 
-        KMLLabelSymbol* label = p->style()->get<KMLLabelSymbol>();
-        if (!label)
+        // labels show the placemark's name; see KMLLabelSymbol.
+        if ( !p->style()->get<KMLLabelSymbol>() )
+            p->style()->addSymbol( _defaultLabel.get() );
+
+        if ( _verbose )
         {
-            label = new KMLLabelSymbol;
-            p->style()->addSymbol(label);
-            label->size() = DEFAULT_LABEL_SIZE;
+            OE_INFO << LC << "label " << p->getName() << std::endl;
+            s_printIndented("Placemark", _depth);
         }
-        label->content() = p->getName();
-        osg::notify(osg::NOTICE) << "label " << label->content()->expr() << std::endl;
-
-        s_printIndented("Placemark", _depth);
 
         // See if the placemark has a "lookat" location:
         bool hasView = false;
@@ -646,13 +982,25 @@ KMLParser::parsePlacemark(const kmldom::PlacemarkPtr& kmlPlacemark)
                 double range =
                     p->getGeometry()->getComponentType() == Geometry::TYPE_POINTSET || bounds.radius() < 10.0 ? 1250.0 :
                     bounds.radius() * 4.0;
-                OE_INFO << "Range = " << range << std::endl;
+                if ( _verbose )
+                    OE_INFO << LC << "Range = " << range << std::endl;
                 p->lookAt() = Viewpoint( bounds.center(), 0.0, -55.0, range );
             }
         }
 
 
         context()._results.push_back( p );
+
+        if ( _recordKeys )
+        {
+            FeatureKey key;
+            key._id = kmlPlacemark->get_id();
+            key._hash = s_hash( kmldom::SerializeRaw( kmlPlacemark ) );
+            _keys.push_back( key );
+        }
+
+        if ( _progress.valid() )
+            _progress->addFeaturesRead( 1 );
     }
 
     return true;
@@ -0,0 +1,373 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLRegionPager>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cmath>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLRegionPager] "
+
+#define DEFAULT_MAX_LOADED_LINKS 256
+
+// approximate on-screen width of a tile when the pager shows it:
+#define TILE_PIXELS 256.0
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    bool
+    s_intersects( const Bounds& a, const Bounds& b )
+    {
+        return a.xMin() <= b.xMax() && b.xMin() <= a.xMax() && a.yMin() <= b.yMax() && b.yMin() <= a.yMax();
+    }
+
+    double
+    s_log2( double x )
+    {
+        return ::log( x ) / ::log( 2.0 );
+    }
+}
+
+//------------------------------------------------------------------------
+
+KMLLevelIndex::KMLLevelIndex( const FeatureList& features, unsigned int firstLevel, unsigned int maxLevel ) :
+_maxLevel( maxLevel )
+{
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+    {
+        unsigned int minLevel = firstLevel, lastLevel = maxLevel;
+
+        const Placemark* p = dynamic_cast<const Placemark*>( i->get() );
+        if ( p && p->region().isSet() &&
+             !KMLRegionPager::getLevelRange( *p->region(), firstLevel, maxLevel, minLevel, lastLevel ) )
+        {
+            continue;
+        }
+
+        // big lines and polygons get a pyramid to draw each level from:
+        const CompactGeometry* compact = p ? p->getCompactGeometry() : 0L;
+        if ( p && minLevel < maxLevel )
+        {
+            KMLGeometryPyramid* pyramid = compact ?
+                KMLGeometryPyramid::create( compact ) :
+                KMLGeometryPyramid::create( p->getGeometry() );
+            if ( pyramid )
+                _pyramids[p] = pyramid;
+        }
+
+        Range& range = _ranges[ std::make_pair(minLevel, lastLevel) ];
+        range._minLevel = minLevel;
+        range._maxLevel = lastLevel;
+        range._features.push_back( i->get() );
+    }
+
+    for( std::map< std::pair<unsigned int, unsigned int>, Range >::iterator i = _ranges.begin(); i != _ranges.end(); ++i )
+        i->second._index = new KMLSpatialIndex( i->second._features );
+}
+
+void
+KMLLevelIndex::query( const Bounds& extent, unsigned int level, FeatureList& output ) const
+{
+    FeatureList hits;
+    for( std::map< std::pair<unsigned int, unsigned int>, Range >::const_iterator i = _ranges.begin(); i != _ranges.end(); ++i )
+    {
+        if ( level >= i->second._minLevel && level <= i->second._maxLevel )
+            i->second._index->query( extent, hits, KMLSpatialIndex::MATCH_CENTER );
+    }
+
+    output.reserve( output.size() + hits.size() );
+    for( FeatureList::const_iterator i = hits.begin(); i != hits.end(); ++i )
+    {
+        Feature* feature = i->get();
+
+        // the finest level keeps every vertex; the camera can get arbitrarily close.
+        std::map< const Feature*, osg::ref_ptr<KMLGeometryPyramid> >::const_iterator j;
+        if ( level < _maxLevel && (j = _pyramids.find( feature )) != _pyramids.end() )
+        {
+            // (NULL for a compacted one drawn in full, which stays compacted)
+            const Geometry* display = j->second->get( level );
+            if ( display && display != feature->getGeometry() )
+            {
+                Placemark* copy = new Placemark( *static_cast<const Placemark*>( feature ) );
+                copy->setGeometry( const_cast<Geometry*>( display ) );
+                feature = copy;
+            }
+        }
+
+        output.push_back( feature );
+    }
+}
+
+//------------------------------------------------------------------------
+
+/** A region-bound NetworkLink, and what it loaded while it's in memory. */
+class KMLRegionPager::Link : public osg::Referenced
+{
+public:
+    Link( const KMLParser::RegionLink& link, unsigned int minLevel, unsigned int maxLevel ) :
+    _url( link._url ),
+    _region( link._region ),
+    _minLevel( minLevel ),
+    _maxLevel( maxLevel ),
+    _loaded( false ),
+    _loading( false ),
+    _lastUsed( 0 )
+    {
+        //NOP
+    }
+
+    std::string  _url;
+    Region       _region;
+    unsigned int _minLevel;
+    unsigned int _maxLevel;
+
+    // guarded by the pager's _mutex:
+    bool                                    _loaded;
+    bool                                    _loading;   // a thread is fetching it
+    unsigned int                            _lastUsed;
+    osg::ref_ptr<KMLLevelIndex>             _content;
+    LinkList                                _children;
+    std::vector< osg::ref_ptr<KMZArchive> > _archives;
+};
+
+//------------------------------------------------------------------------
+
+KMLRegionPager::KMLRegionPager( const KMLFeatureSourceOptions& options, unsigned int firstLevel, unsigned int maxLevel, long nextUID ) :
+_options( options ),
+_firstLevel( firstLevel ),
+_maxLevel( maxLevel ),
+_maxLoaded( options.maxLoadedLinks().isSet() ? std::max( *options.maxLoadedLinks(), 1u ) : DEFAULT_MAX_LOADED_LINKS ),
+_nextUID( nextUID ),
+_clock( 0 )
+{
+    //NOP
+}
+
+bool
+KMLRegionPager::getLevelRange( const Region& region, unsigned int firstLevel, unsigned int maxLevel,
+                               unsigned int& out_minLevel, unsigned int& out_maxLevel )
+{
+    const Bounds& b = region.getBounds();
+    double size = ::sqrt( std::max( b.xMax() - b.xMin(), 0.0 ) * std::max( b.yMax() - b.yMin(), 0.0 ) );
+
+    // At level L the region spans about size * TILE_PIXELS * 2^L / 180 pixels.
+    double minLevel = firstLevel;
+    if ( region.getMinLodPixels() > 0.0 )
+    {
+        minLevel = size > 0.0 ?
+            ::ceil( s_log2( region.getMinLodPixels() * 180.0 / (TILE_PIXELS * size) ) ) :
+            (double)maxLevel;
+    }
+
+    double lastLevel = maxLevel;
+    if ( region.getMaxLodPixels() >= 0.0 && size > 0.0 )
+    {
+        lastLevel = ::floor( s_log2( region.getMaxLodPixels() * 180.0 / (TILE_PIXELS * size) ) );
+    }
+
+    if ( lastLevel < (double)firstLevel || minLevel > lastLevel )
+        return false;
+
+    out_minLevel = (unsigned int)osg::clampBetween( minLevel, (double)firstLevel, (double)maxLevel );
+    out_maxLevel = (unsigned int)osg::clampBetween( lastLevel, (double)out_minLevel, (double)maxLevel );
+    return true;
+}
+
+unsigned int
+KMLRegionPager::getTileLevel( const Bounds& extent )
+{
+    // level 0 tiles are 180 degrees tall:
+    double height = extent.yMax() - extent.yMin();
+    if ( height <= 0.0 )
+        return 0;
+
+    double level = osg::round( s_log2( 180.0 / height ) );
+    return level > 0.0 ? (unsigned int)level : 0;
+}
+
+double
+KMLRegionPager::getPixelSize( unsigned int level )
+{
+    return 180.0 / (TILE_PIXELS * ::pow( 2.0, (double)level ));
+}
+
+void
+KMLRegionPager::addLinks( const KMLParser::RegionLinkList& links )
+{
+    ScopedLock lock( _mutex );
+    addLinks( links, _roots );
+}
+
+void
+KMLRegionPager::addLinks( const KMLParser::RegionLinkList& links, LinkList& output )
+{
+    for( KMLParser::RegionLinkList::const_iterator i = links.begin(); i != links.end(); ++i )
+    {
+        unsigned int minLevel, maxLevel;
+        if ( getLevelRange( i->_region, _firstLevel, _maxLevel, minLevel, maxLevel ) )
+            output.push_back( new Link( *i, minLevel, maxLevel ) );
+    }
+}
+
+void
+KMLRegionPager::query( const Bounds& extent, unsigned int level, FeatureList& output )
+{
+    LinkList pending;
+    unsigned int now;
+    {
+        ScopedLock lock( _mutex );
+        pending = _roots;
+        now = ++_clock;
+    }
+
+    while( !pending.empty() )
+    {
+        osg::ref_ptr<Link> link = pending.back();
+        pending.pop_back();
+
+        // only links whose region is in view at this level, over this tile:
+        if ( level < link->_minLevel || level > link->_maxLevel || !s_intersects( link->_region.getBounds(), extent ) )
+            continue;
+
+        if ( !load( link.get() ) )
+            continue;
+
+        ScopedLock lock( _mutex );
+        if ( !link->_loaded ) // evicted by another query meanwhile
+            continue;
+
+        link->_lastUsed = now;
+        link->_content->query( extent, level, output );
+        pending.insert( pending.end(), link->_children.begin(), link->_children.end() );
+    }
+}
+
+bool
+KMLRegionPager::load( Link* link )
+{
+    {
+        // wait out another thread's load of the same link; its tile needs
+        // the content just as much as ours does.
+        ScopedLock lock( _mutex );
+        while( link->_loading )
+            _loadDone.wait( &_mutex );
+        if ( link->_loaded )
+            return true;
+        link->_loading = true;
+    }
+
+    // numbered from 0 here, and moved after the features already handed
+    // out once we know how many there are:
+    KMLParser parser;
+    parser.setNextUID( 0 );
+    parser.setRegion( link->_region );
+    if ( _options.maxLinkDepth().isSet() )
+        parser.setMaxLinkDepth( *_options.maxLinkDepth() );
+    if ( _options.linkFetchThreads().isSet() )
+        parser.setNumFetchThreads( *_options.linkFetchThreads() );
+
+    FeatureList features;
+    if ( !parser.parse( link->_url, features ) )
+        OE_WARN << LC << "Failed to load " << link->_url << std::endl;
+
+    long firstUID;
+    {
+        ScopedLock lock( _mutex );
+        firstUID = _nextUID;
+        _nextUID += parser.getNextUID();
+    }
+    for( FeatureList::iterator i = features.begin(); i != features.end(); ++i )
+    {
+        Placemark* p = dynamic_cast<Placemark*>( i->get() );
+        if ( p )
+            p->setFID( firstUID + p->getFID() );
+    }
+
+    // A failed link is still marked loaded (with nothing in it), so tiles
+    // don't keep refetching it; it gets another try once it's evicted.
+    osg::ref_ptr<KMLLevelIndex> content = new KMLLevelIndex( features, _firstLevel, _maxLevel );
+    LinkList children;
+    addLinks( parser.getRegionLinks(), children );
+
+    ScopedLock lock( _mutex );
+    link->_content  = content.get();
+    link->_children = children;
+    link->_archives = parser.getArchives();
+    link->_loaded   = true;
+    link->_loading  = false;
+    link->_lastUsed = _clock;
+    _loaded.push_back( link );
+
+    OE_INFO << LC << "Loaded " << link->_url << " (" << features.size() << " features, "
+        << children.size() << " links)" << std::endl;
+
+    evict();
+    _loadDone.broadcast();
+    return true;
+}
+
+void
+KMLRegionPager::evict()
+{
+    // least recently used first; a link is never evicted by its own load,
+    // since that stamped it with the latest time.
+    while( _loaded.size() > _maxLoaded )
+    {
+        LinkList::iterator oldest = _loaded.begin();
+        for( LinkList::iterator i = _loaded.begin(); i != _loaded.end(); ++i )
+        {
+            if ( (*i)->_lastUsed < (*oldest)->_lastUsed )
+                oldest = i;
+        }
+
+        if ( (*oldest)->_lastUsed == _clock )
+            break;
+
+        osg::ref_ptr<Link> link = *oldest;
+        unload( link.get() );
+    }
+}
+
+void
+KMLRegionPager::unload( Link* link )
+{
+    // what it linked to goes too:
+    for( LinkList::iterator i = link->_children.begin(); i != link->_children.end(); ++i )
+    {
+        if ( (*i)->_loaded )
+            unload( i->get() );
+    }
+
+    OE_INFO << LC << "Unloaded " << link->_url << std::endl;
+
+    link->_content = 0L;
+    link->_children.clear();
+    link->_archives.clear();
+    link->_loaded = false;
+
+    LinkList::iterator i = std::find( _loaded.begin(), _loaded.end(), link );
+    if ( i != _loaded.end() )
+        _loaded.erase( i );
+}
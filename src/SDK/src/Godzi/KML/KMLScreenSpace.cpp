@@ -0,0 +1,100 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLScreenSpace>
+#include <osgEarth/SpatialReference>
+#include <osgUtil/CullVisitor>
+#include <osg/BlendFunc>
+#include <osg/Program>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+namespace
+{
+    // The anchor is pulled a little toward the eye so the terrain it sits
+    // on doesn't swallow the symbol.
+    const char* s_vertexShader =
+        "#version 110\n"
+        "uniform vec2 godzi_viewport;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 view = gl_ModelViewMatrix * gl_Vertex;\n"
+        "    view.xyz *= 0.98;\n"
+        "    vec4 clip = gl_ProjectionMatrix * view;\n"
+        "    clip.xy += gl_MultiTexCoord1.xy * 2.0 / godzi_viewport * clip.w;\n"
+        "    gl_Position = clip;\n"
+        "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+        "    gl_FrontColor = gl_Color;\n"
+        "}\n";
+
+    /** Keeps a viewport size uniform current. */
+    class ViewportCallback : public osg::NodeCallback
+    {
+    public:
+        ViewportCallback( osg::Uniform* uniform ) : _uniform( uniform ) { }
+
+        void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( nv );
+            if ( cv && cv->getViewport() )
+                _uniform->set( osg::Vec2f(cv->getViewport()->width(), cv->getViewport()->height()) );
+            traverse( node, nv );
+        }
+
+    protected:
+        osg::ref_ptr<osg::Uniform> _uniform;
+    };
+}
+
+void
+KMLScreenSpace::install( osg::Node* node, const char* fragmentShader, const char* vertexShader )
+{
+    osg::Program* program = new osg::Program();
+    program->addShader( new osg::Shader(osg::Shader::VERTEX, vertexShader ? vertexShader : s_vertexShader) );
+    program->addShader( new osg::Shader(osg::Shader::FRAGMENT, fragmentShader) );
+
+    osg::Uniform* viewport = new osg::Uniform( "godzi_viewport", osg::Vec2f(1024.0f, 768.0f) );
+
+    osg::StateSet* ss = node->getOrCreateStateSet();
+    ss->setAttributeAndModes( program, osg::StateAttribute::ON );
+    ss->addUniform( viewport );
+    ss->setAttributeAndModes( new osg::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA), osg::StateAttribute::ON );
+    ss->setMode( GL_LIGHTING, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED );
+    ss->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
+    node->setCullCallback( new ViewportCallback(viewport) );
+}
+
+bool
+KMLScreenSpace::toWorld( const osgEarth::Map* map, const osg::Vec3d& point, osg::Vec3d& out_world )
+{
+    const SpatialReference* srs = map->getProfile()->getSRS();
+    if ( map->isGeocentric() )
+    {
+        srs->getEllipsoid()->convertLatLongHeightToXYZ(
+            osg::DegreesToRadians(point.y()), osg::DegreesToRadians(point.x()), point.z(),
+            out_world.x(), out_world.y(), out_world.z() );
+        return true;
+    }
+
+    out_world.z() = point.z();
+    return srs->getGeographicSRS()->transform( point.x(), point.y(), srs, out_world.x(), out_world.y() );
+}
@@ -0,0 +1,241 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLSpatialIndex>
+#include <Godzi/Placemark>
+#include <osgEarthSymbology/Geometry>
+#include <algorithm>
+#include <cfloat>
+#include <utility>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth::Symbology;
+
+namespace
+{
+    /** Children per node. */
+    const unsigned int NODE_SIZE = 16;
+
+    /** Resolution of the Hilbert curve used to order the leaves. */
+    const double HILBERT_MAX = 65535.0;
+
+    /**
+     * Distance of (x,y) along a Hilbert curve on a 2^16 x 2^16 grid. This
+     * is the branch-free formulation from "Fast Hilbert curve generation"
+     * (rawrunprotected.net), the same one used by flatbush.
+     */
+    unsigned int
+    s_hilbert( unsigned int x, unsigned int y )
+    {
+        unsigned int a = x ^ y;
+        unsigned int b = 0xFFFF ^ a;
+        unsigned int c = 0xFFFF ^ (x | y);
+        unsigned int d = x & (y ^ 0xFFFF);
+
+        unsigned int A = a | (b >> 1);
+        unsigned int B = (a >> 1) ^ a;
+        unsigned int C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+        unsigned int D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+        a = A; b = B; c = C; d = D;
+        A = ((a & (a >> 2)) ^ (b & (b >> 2)));
+        B = ((a & (b >> 2)) ^ (b & ((a ^ b) >> 2)));
+        C ^= ((a & (c >> 2)) ^ (b & (d >> 2)));
+        D ^= ((b & (c >> 2)) ^ ((a ^ b) & (d >> 2)));
+
+        a = A; b = B; c = C; d = D;
+        A = ((a & (a >> 4)) ^ (b & (b >> 4)));
+        B = ((a & (b >> 4)) ^ (b & ((a ^ b) >> 4)));
+        C ^= ((a & (c >> 4)) ^ (b & (d >> 4)));
+        D ^= ((b & (c >> 4)) ^ ((a ^ b) & (d >> 4)));
+
+        a = A; b = B; c = C; d = D;
+        C ^= ((a & (c >> 8)) ^ (b & (d >> 8)));
+        D ^= ((b & (c >> 8)) ^ ((a ^ b) & (d >> 8)));
+
+        a = C ^ (C >> 1);
+        b = D ^ (D >> 1);
+
+        unsigned int i0 = x ^ y;
+        unsigned int i1 = b | (0xFFFF ^ (i0 | a));
+
+        i0 = (i0 | (i0 << 8)) & 0x00FF00FF;
+        i0 = (i0 | (i0 << 4)) & 0x0F0F0F0F;
+        i0 = (i0 | (i0 << 2)) & 0x33333333;
+        i0 = (i0 | (i0 << 1)) & 0x55555555;
+
+        i1 = (i1 | (i1 << 8)) & 0x00FF00FF;
+        i1 = (i1 | (i1 << 4)) & 0x0F0F0F0F;
+        i1 = (i1 | (i1 << 2)) & 0x33333333;
+        i1 = (i1 | (i1 << 1)) & 0x55555555;
+
+        return (i1 << 1) | i0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+KMLSpatialIndex::KMLSpatialIndex( const FeatureList& features )
+{
+    _features.reserve( features.size() );
+    for( FeatureList::const_iterator i = features.begin(); i != features.end(); ++i )
+        _features.push_back( i->get() );
+
+    // leaf boxes, and the extent of them all:
+    std::vector<Box> leaves;
+    leaves.reserve( _features.size() );
+    std::vector<unsigned int> items;
+    items.reserve( _features.size() );
+
+    Box extent = { DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX };
+    for( unsigned int i = 0; i < _features.size(); ++i )
+    {
+        // compacted geometry keeps its bounds, so nothing is decoded here
+        Bounds b;
+        if ( !Placemark::getGeometryBounds( _features[i], b ) || !b.valid() )
+            continue;
+
+        Box box = { b.xMin(), b.yMin(), b.xMax(), b.yMax() };
+        leaves.push_back( box );
+        items.push_back( i );
+
+        extent.xMin = std::min( extent.xMin, box.xMin );
+        extent.yMin = std::min( extent.yMin, box.yMin );
+        extent.xMax = std::max( extent.xMax, box.xMax );
+        extent.yMax = std::max( extent.yMax, box.yMax );
+    }
+
+    if ( leaves.empty() )
+        return;
+
+    // order the leaves along the curve by box center:
+    double sx = extent.xMax > extent.xMin ? HILBERT_MAX / (extent.xMax - extent.xMin) : 0.0;
+    double sy = extent.yMax > extent.yMin ? HILBERT_MAX / (extent.yMax - extent.yMin) : 0.0;
+
+    std::vector< std::pair<unsigned int, unsigned int> > order( leaves.size() );
+    for( unsigned int i = 0; i < leaves.size(); ++i )
+    {
+        const Box& box = leaves[i];
+        unsigned int hx = (unsigned int)( (0.5 * (box.xMin + box.xMax) - extent.xMin) * sx );
+        unsigned int hy = (unsigned int)( (0.5 * (box.yMin + box.yMax) - extent.yMin) * sy );
+        order[i] = std::make_pair( s_hilbert(hx, hy), i );
+    }
+    std::sort( order.begin(), order.end() );
+
+    // size the levels up front so the tree is built without reallocating:
+    unsigned int total = 0;
+    for( unsigned int n = leaves.size(); ; n = (n + NODE_SIZE - 1) / NODE_SIZE )
+    {
+        total += n;
+        _levelEnds.push_back( total );
+        if ( n == 1 )
+            break;
+    }
+
+    _boxes.reserve( total );
+    _items.reserve( leaves.size() );
+    for( unsigned int i = 0; i < order.size(); ++i )
+    {
+        _boxes.push_back( leaves[order[i].second] );
+        _items.push_back( items[order[i].second] );
+    }
+
+    // each parent covers the next NODE_SIZE boxes of the level below:
+    unsigned int levelBegin = 0;
+    for( unsigned int level = 0; level + 1 < _levelEnds.size(); ++level )
+    {
+        unsigned int levelEnd = _levelEnds[level];
+        for( unsigned int first = levelBegin; first < levelEnd; first += NODE_SIZE )
+        {
+            Box box = _boxes[first];
+            unsigned int last = std::min( first + NODE_SIZE, levelEnd );
+            for( unsigned int i = first + 1; i < last; ++i )
+            {
+                const Box& child = _boxes[i];
+                box.xMin = std::min( box.xMin, child.xMin );
+                box.yMin = std::min( box.yMin, child.yMin );
+                box.xMax = std::max( box.xMax, child.xMax );
+                box.yMax = std::max( box.yMax, child.yMax );
+            }
+            _boxes.push_back( box );
+        }
+        levelBegin = levelEnd;
+    }
+}
+
+void
+KMLSpatialIndex::query( const Bounds& extent, FeatureList& output, Match match ) const
+{
+    if ( _boxes.empty() )
+        return;
+
+    Box queryBox = { extent.xMin(), extent.yMin(), extent.xMax(), extent.yMax() };
+
+    // centers on the far edge of the whole data set still need an owner:
+    const Box& all = _boxes.back();
+    bool closedX = queryBox.xMax >= all.xMax;
+    bool closedY = queryBox.yMax >= all.yMax;
+
+    std::vector<unsigned int> hits;
+
+    // (box index, level) pairs still to visit, starting at the root:
+    std::vector< std::pair<unsigned int, unsigned int> > stack;
+    stack.push_back( std::make_pair( (unsigned int)_boxes.size() - 1, (unsigned int)_levelEnds.size() - 1 ) );
+
+    while( !stack.empty() )
+    {
+        unsigned int node  = stack.back().first;
+        unsigned int level = stack.back().second;
+        stack.pop_back();
+
+        if ( !_boxes[node].intersects( queryBox ) )
+            continue;
+
+        if ( level == 0 )
+        {
+            if ( match == MATCH_CENTER )
+            {
+                const Box& box = _boxes[node];
+                double cx = 0.5 * (box.xMin + box.xMax);
+                double cy = 0.5 * (box.yMin + box.yMax);
+                if ( cx < queryBox.xMin || cy < queryBox.yMin ||
+                     cx > queryBox.xMax || (cx == queryBox.xMax && !closedX) ||
+                     cy > queryBox.yMax || (cy == queryBox.yMax && !closedY) )
+                    continue;
+            }
+            hits.push_back( _items[node] );
+        }
+        else
+        {
+            unsigned int levelBegin = level > 1 ? _levelEnds[level-2] : 0;
+            unsigned int parentBegin = _levelEnds[level-1];
+            unsigned int first = levelBegin + (node - parentBegin) * NODE_SIZE;
+            unsigned int last  = std::min( first + NODE_SIZE, _levelEnds[level-1] );
+            for( unsigned int i = first; i < last; ++i )
+                stack.push_back( std::make_pair( i, level - 1 ) );
+        }
+    }
+
+    // back to document order, which the renderers and the UI expect:
+    std::sort( hits.begin(), hits.end() );
+    for( std::vector<unsigned int>::const_iterator i = hits.begin(); i != hits.end(); ++i )
+        output.push_back( _features[*i] );
+}
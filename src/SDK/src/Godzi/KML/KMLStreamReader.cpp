@@ -0,0 +1,1094 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLStreamReader>
+#include <Godzi/KML/KMLCoordinates>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/KML/KMZArchive>
+#include <Godzi/Placemark>
+#include <osgEarth/HTTPClient>
+#include <osgEarth/FileUtils>
+#include <osgEarthSymbology/Geometry>
+#include <osgEarthSymbology/Style>
+#include <osgEarthUtil/Viewpoint>
+#include <osgDB/FileNameUtils>
+#include <osg/io_utils>
+#include <expat.h>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth::Util;
+using namespace osgEarth::Symbology;
+
+#define LC "[Godzi.KMLStreamReader] "
+#define DEFAULT_LABEL_SIZE 32
+#define DEFAULT_ICON_URL "http://demo.pelicanmapping.com/rmweb/godzi_marker.png"
+#define DEFAULT_CHUNK_SIZE 65536
+#define MAX_LINK_DEPTH 8
+
+namespace
+{
+    /** The subset of a KML <Style> that we convert to symbology. */
+    struct StyleSpec
+    {
+        StyleSpec() : hasLine(false), hasPoly(false), hasIcon(false), hasLabel(false), polyFill(true) { }
+
+        bool hasLine, hasPoly, hasIcon, hasLabel;
+
+        optional<osg::Vec4f> lineColor;
+        optional<float>      lineWidth;
+        optional<osg::Vec4f> polyColor;
+        bool                 polyFill;
+        optional<osg::Vec4f> iconColor;
+        optional<float>      iconScale;
+        std::string          iconHref;
+        optional<osg::Vec4f> labelColor;
+        optional<float>      labelScale;
+    };
+
+    typedef std::map<std::string, StyleSpec> StyleSpecTable;
+
+    /** Converts a KML "aabbggrr" hex color to an OSG color */
+    osg::Vec4f
+    s_parseColor( const std::string& text )
+    {
+        unsigned long c = ::strtoul( text.c_str(), 0L, 16 );
+        return osg::Vec4f(
+            (float)( c        & 0xff) / 255.0f,
+            (float)((c >>  8) & 0xff) / 255.0f,
+            (float)((c >> 16) & 0xff) / 255.0f,
+            (float)((c >> 24) & 0xff) / 255.0f );
+    }
+
+    bool
+    s_parseBool( const std::string& text )
+    {
+        return text == "1" || text == "true";
+    }
+
+    KMLAltitude::AltitudeMode
+    s_parseAltitudeMode( const std::string& text )
+    {
+        if ( text == "relativeToGround" )   return KMLAltitude::RelativeToGround;
+        if ( text == "absolute" )           return KMLAltitude::Absolute;
+        if ( text == "relativeToSeaFloor" ) return KMLAltitude::RelativeToSeaFloor;
+        if ( text == "clampToSeaFloor" )    return KMLAltitude::ClampToSeaFloor;
+        return KMLAltitude::ClampToGround;
+    }
+
+    template<typename T>
+    T*
+    s_createSymbol( const KMLAltitude::AltitudeMode& mode, bool extrude )
+    {
+        T* symbol = new T;
+        symbol->altitude()->setAltitudeMode( mode );
+        symbol->extrude()->setExtrude( extrude );
+        return symbol;
+    }
+
+    /**
+     * Creates an osgEarth Style from a streamed KML style. The label symbol
+     * is returned separately, without content: a label shows its placemark's
+     * name, so one symbol serves every placemark with the style.
+     */
+    Style
+    s_createStyle( const StyleSpec& spec, const KMLAltitude::AltitudeMode& mode, bool extrude,
+                   osg::ref_ptr<KMLLabelSymbol>& out_label )
+    {
+        Style style;
+
+        if ( spec.hasLabel )
+        {
+            KMLLabelSymbol* s = new KMLLabelSymbol;
+            if ( spec.labelColor.isSet() )
+                s->fill()->color() = *spec.labelColor;
+            s->size() = DEFAULT_LABEL_SIZE;
+            if ( spec.labelScale.isSet() )
+                s->size() = s->size().value() * (*spec.labelScale);
+            out_label = s;
+        }
+
+        if ( spec.hasLine )
+        {
+            KMLLineSymbol* s = s_createSymbol<KMLLineSymbol>( mode, extrude );
+            if ( spec.lineColor.isSet() )
+                s->stroke()->color() = *spec.lineColor;
+            if ( spec.lineWidth.isSet() )
+                s->stroke()->width() = *spec.lineWidth;
+            style.addSymbol( s );
+        }
+
+        if ( spec.hasPoly && spec.polyFill )
+        {
+            KMLPolygonSymbol* s = s_createSymbol<KMLPolygonSymbol>( mode, extrude );
+            if ( spec.polyColor.isSet() )
+                s->fill()->color() = *spec.polyColor;
+            style.addSymbol( s );
+        }
+
+        if ( spec.hasIcon )
+        {
+            KMLIconSymbol* s = s_createSymbol<KMLIconSymbol>( mode, extrude );
+            if ( spec.iconColor.isSet() )
+                s->color() = *spec.iconColor;
+            if ( spec.iconScale.isSet() )
+                s->scale() = osg::Vec3f( *spec.iconScale, *spec.iconScale, *spec.iconScale );
+            s->url() = spec.iconHref.empty() ? std::string(DEFAULT_ICON_URL) : spec.iconHref;
+            style.addSymbol( s );
+        }
+
+        return style;
+    }
+
+    /** A style built from a StyleSpec; the symbols are shared, so treat them as read-only. */
+    struct CachedStyle
+    {
+        CachedStyle() : _built(false) { }
+        Style                        _style;
+        osg::ref_ptr<KMLLabelSymbol> _label; // the style's label, if it has one
+        bool                         _built;
+    };
+
+    /**
+     * Built styles by content (see s_styleKey), shared by every document of
+     * a read, inline styles included.
+     */
+    typedef std::map<std::string, CachedStyle> CachedStyleTable;
+
+    template<typename T>
+    void
+    s_writeKey( std::ostream& buf, const optional<T>& value )
+    {
+        if ( value.isSet() )
+            buf << *value;
+        buf << ';';
+    }
+
+    /** Key of the style a StyleSpec makes with an altitude mode and extrusion. */
+    std::string
+    s_styleKey( const StyleSpec& spec, const KMLAltitude::AltitudeMode& mode, bool extrude )
+    {
+        std::stringstream buf;
+        buf << (int)mode << ';' << extrude << ';'
+            << spec.hasLine << spec.hasPoly << spec.hasIcon << spec.hasLabel << spec.polyFill << ';';
+        s_writeKey( buf, spec.lineColor );
+        s_writeKey( buf, spec.lineWidth );
+        s_writeKey( buf, spec.polyColor );
+        s_writeKey( buf, spec.iconColor );
+        s_writeKey( buf, spec.iconScale );
+        s_writeKey( buf, spec.labelColor );
+        s_writeKey( buf, spec.labelScale );
+        buf << spec.iconHref;
+        return buf.str();
+    }
+
+    /** Adds features to a list as they arrive. */
+    struct CollectFeaturesCallback : public KMLStreamReader::Callback
+    {
+        CollectFeaturesCallback( FeatureList& output ) : _output(output) { }
+        bool onFeature( Feature* feature ) { _output.push_back( feature ); return true; }
+        FeatureList& _output;
+    };
+
+    /** A geometry element under construction. */
+    struct GeomFrame
+    {
+        std::string                      _type;
+        Vec3dVector                      _points;
+        std::vector< osg::ref_ptr<Ring> > _holes;
+        osg::ref_ptr<MultiGeometry>      _multi;
+    };
+
+    /**
+     * Parse state for one KML document. NetworkLinks are followed by
+     * streaming the linked document with a nested StreamState.
+     */
+    class StreamState : public KMZArchive::Reader
+    {
+    public:
+        StreamState( const std::string& location, KMLStreamReader::Callback* callback,
+                     unsigned int chunkSize, long& nextUID, std::set<std::string>& visited,
+                     KMLStreamReader::ArchiveList& archives, CachedStyleTable& styleCache,
+                     KMLParser::GroundOverlayList& overlays, KMLProgressCallback* progress, int depth )
+            : _location(location), _callback(callback), _chunkSize(chunkSize), _nextUID(nextUID),
+              _visited(visited), _archives(archives), _styleCache(styleCache), _overlays(overlays), _progress(progress), _depth(depth), _parser(0L), _collect(false),
+              _inCoords(false), _stopped(false), _failed(false), _deferLinks(false), _hasGeomElement(false) { }
+
+        bool run();
+
+        /** KMZArchive::Reader: receives inflated document bytes. */
+        bool onData( const char* data, unsigned int size );
+
+    private:
+        static void XMLCALL s_startElement( void* data, const XML_Char* name, const XML_Char** atts ) {
+            static_cast<StreamState*>(data)->startElement( name, atts ); }
+        static void XMLCALL s_endElement( void* data, const XML_Char* name ) {
+            static_cast<StreamState*>(data)->endElement(); }
+        static void XMLCALL s_characters( void* data, const XML_Char* s, int len ) {
+            static_cast<StreamState*>(data)->characters( s, len ); }
+
+        void startElement( const char* name, const char** atts );
+        void endElement();
+        void characters( const char* s, int len );
+
+        bool parseStream( std::istream& in );
+        bool parseBuffer( const char* data, std::string::size_type size );
+        bool reportBytes( unsigned int size );
+
+        void beginPlacemark();
+        void endPlacemark();
+        void endGeometry();
+        void buildGeometry( GeomFrame& frame );
+        void followLink( const std::string& href );
+        const StyleSpec* resolveStyle() const;
+        void applyStyle( Placemark* p );
+
+        const std::string& parent( unsigned int up =1 ) const {
+            static const std::string s_empty;
+            return _path.size() > up ? _path[_path.size()-1-up] : s_empty; }
+
+        bool inside( const char* name ) const {
+            for( std::vector<std::string>::const_reverse_iterator i = _path.rbegin(); i != _path.rend(); ++i )
+                if ( *i == name ) return true;
+            return false; }
+
+        bool isGeometry( const std::string& name ) const {
+            return name == "Point" || name == "LineString" || name == "LinearRing" ||
+                   name == "Polygon" || name == "MultiGeometry" || name == "Model"; }
+
+    private:
+        std::string                _location;
+        KMLStreamReader::Callback* _callback;
+        unsigned int               _chunkSize;
+        long&                      _nextUID;
+        std::set<std::string>&     _visited;
+        KMLStreamReader::ArchiveList& _archives;
+        CachedStyleTable&          _styleCache;
+        KMLParser::GroundOverlayList& _overlays;
+        KMLProgressCallback*       _progress;
+        int                        _depth;
+        XML_Parser                 _parser;
+
+        std::vector<std::string>   _path;
+        std::string                _text;
+        bool                       _collect;
+        bool                       _inCoords;
+        bool                       _stopped;
+        bool                       _failed;
+        bool                       _deferLinks;
+
+        // shared styles
+        StyleSpecTable             _styles;
+        StyleSpec                  _style;
+        std::string                _styleId;
+        std::string                _styleMapId;
+        std::string                _pairKey;
+        std::string                _pairUrl;
+        optional<StyleSpec>        _pairStyle;
+        optional<std::string>      _normalUrl;
+        optional<StyleSpec>        _normalStyle;
+        std::map<std::string,std::string> _styleMaps;
+
+        // current placemark
+        osg::ref_ptr<Placemark>    _placemark;
+        std::string                _styleUrl;
+        optional<StyleSpec>        _inlineStyle;
+        std::vector<GeomFrame>     _geoms;
+        std::vector<Vec3dVector>   _spareBuffers; // emptied coordinate buffers, capacity kept
+        osg::ref_ptr<Geometry>     _geom;
+        bool                       _hasGeomElement;
+        optional<KMLAltitude::AltitudeMode> _altMode;
+        optional<bool>             _extrude;
+        osg::ref_ptr<KMLModelSymbol> _model;
+        std::string                _modelHref;
+        osg::Vec3d                 _modelLocation, _modelScale;
+        optional<double>           _lookLon, _lookLat, _lookAlt, _lookHeading, _lookTilt, _lookRange;
+
+        // current ground overlay
+        optional<KMLParser::GroundOverlay> _overlay;
+
+        // network links
+        std::string                _linkHref;
+        std::vector<std::string>   _pendingLinks;
+        std::string                _coordText;
+    };
+
+    bool
+    StreamState::run()
+    {
+        if ( _depth > MAX_LINK_DEPTH )
+        {
+            OE_WARN << LC << _location << ": NetworkLink depth limit reached" << std::endl;
+            return false;
+        }
+
+        if ( !_visited.insert( _location ).second )
+        {
+            OE_INFO << LC << _location << ": already read, skipping" << std::endl;
+            return true;
+        }
+
+        OE_INFO << LC << "KML: Streaming from: " << _location << std::endl;
+
+        _parser = XML_ParserCreate( 0L );
+        XML_SetUserData( _parser, this );
+        XML_SetElementHandler( _parser, &StreamState::s_startElement, &StreamState::s_endElement );
+        XML_SetCharacterDataHandler( _parser, &StreamState::s_characters );
+
+        // a document packaged in an open archive, or a KMZ to open:
+        std::string entry;
+        osg::ref_ptr<KMZArchive> archive = KMZArchive::find( _location, entry );
+        if ( !archive.valid() && KMZArchive::isArchive( _location ) )
+        {
+            archive = KMZArchive::open( _location );
+            if ( archive.valid() )
+            {
+                entry = archive->getDocumentName();
+                _location = archive->getEntryPath( entry );
+            }
+        }
+
+        bool ok;
+        if ( archive.valid() )
+        {
+            if ( std::find( _archives.begin(), _archives.end(), archive ) == _archives.end() )
+                _archives.push_back( archive.get() );
+
+            // inflate straight into the XML parser, a chunk at a time:
+            _deferLinks = true;
+            ok = archive->readEntry( entry, this, _chunkSize ) && !_failed;
+            if ( ok && !_stopped && XML_Parse( _parser, 0L, 0, XML_TRUE ) == XML_STATUS_ERROR )
+            {
+                OE_WARN << LC << _location << ": " << XML_ErrorString( XML_GetErrorCode(_parser) )
+                    << " at line " << XML_GetCurrentLineNumber(_parser) << std::endl;
+                ok = false;
+            }
+
+            for( std::vector<std::string>::const_iterator i = _pendingLinks.begin(); i != _pendingLinks.end() && !_stopped; ++i )
+                followLink( *i );
+        }
+        else if ( KMZArchive::isArchive( _location ) )
+        {
+            ok = false;
+        }
+        else if ( osgDB::containsServerAddress( _location ) )
+        {
+            std::string content;
+            if ( HTTPClient::readString( _location, content ) != HTTPClient::RESULT_OK )
+            {
+                OE_WARN << LC << _location << ": read failed" << std::endl;
+                ok = false;
+            }
+            else
+            {
+                ok = parseBuffer( content.data(), content.size() );
+            }
+        }
+        else
+        {
+            std::ifstream in( _location.c_str(), std::ios::in | std::ios::binary );
+            if ( !in.is_open() )
+            {
+                OE_WARN << LC << _location << ": read failed" << std::endl;
+                ok = false;
+            }
+            else
+            {
+                ok = parseStream( in );
+            }
+        }
+
+        XML_ParserFree( _parser );
+        _parser = 0L;
+        return ok;
+    }
+
+    bool
+    StreamState::parseStream( std::istream& in )
+    {
+        bool final = false;
+        while( !final && !_stopped )
+        {
+            void* buf = XML_GetBuffer( _parser, _chunkSize );
+            if ( !buf )
+                return false;
+
+            in.read( static_cast<char*>(buf), _chunkSize );
+            int len = (int)in.gcount();
+            final = in.eof() || !in.good();
+
+            if ( !reportBytes( len ) )
+                return true;
+
+            if ( XML_ParseBuffer( _parser, len, final ) == XML_STATUS_ERROR )
+            {
+                // a stop (callback or cancel) aborts the parser; that's not a failure
+                if ( _stopped )
+                    return true;
+
+                OE_WARN << LC << _location << ": " << XML_ErrorString( XML_GetErrorCode(_parser) )
+                    << " at line " << XML_GetCurrentLineNumber(_parser) << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool
+    StreamState::reportBytes( unsigned int size )
+    {
+        if ( _progress && !_progress->addBytesRead( size ) )
+        {
+            OE_INFO << LC << _location << ": canceled" << std::endl;
+            _stopped = true;
+        }
+        return !_stopped;
+    }
+
+    bool
+    StreamState::onData( const char* data, unsigned int size )
+    {
+        if ( !reportBytes( size ) )
+            return false;
+
+        if ( XML_Parse( _parser, data, (int)size, XML_FALSE ) == XML_STATUS_ERROR )
+        {
+            if ( !_stopped )
+            {
+                OE_WARN << LC << _location << ": " << XML_ErrorString( XML_GetErrorCode(_parser) )
+                    << " at line " << XML_GetCurrentLineNumber(_parser) << std::endl;
+                _failed = true;
+            }
+            return false;
+        }
+        return !_stopped;
+    }
+
+    bool
+    StreamState::parseBuffer( const char* data, std::string::size_type size )
+    {
+        std::string::size_type offset = 0;
+        do
+        {
+            std::string::size_type len = std::min( (std::string::size_type)_chunkSize, size - offset );
+            bool final = offset + len >= size;
+
+            if ( !reportBytes( (unsigned int)len ) )
+                return true;
+
+            if ( XML_Parse( _parser, data + offset, (int)len, final ) == XML_STATUS_ERROR )
+            {
+                if ( _stopped )
+                    return true;
+
+                OE_WARN << LC << _location << ": " << XML_ErrorString( XML_GetErrorCode(_parser) )
+                    << " at line " << XML_GetCurrentLineNumber(_parser) << std::endl;
+                return false;
+            }
+            offset += len;
+        }
+        while( offset < size && !_stopped );
+
+        return true;
+    }
+
+    void
+    StreamState::startElement( const char* qname, const char** atts )
+    {
+        // KML's own elements may carry a "kml:" prefix; extension elements
+        // (gx: and friends) are tracked in the path but otherwise ignored.
+        const char* colon = ::strchr( qname, ':' );
+        std::string name =
+            !colon ? std::string(qname) :
+            ::strncmp( qname, "kml:", 4 ) == 0 ? std::string(colon+1) :
+            std::string(qname);
+
+        _path.push_back( name );
+        _text.clear();
+        _collect = false;
+
+        std::string id;
+        for( int i=0; atts && atts[i]; i += 2 )
+            if ( ::strcmp( atts[i], "id" ) == 0 )
+                id = atts[i+1];
+
+        if ( name == "Placemark" )
+        {
+            beginPlacemark();
+        }
+        else if ( name == "Style" )
+        {
+            _style = StyleSpec();
+            _styleId = id;
+        }
+        else if ( name == "StyleMap" )
+        {
+            _styleMapId = id;
+            _normalUrl.unset();
+            _normalStyle.unset();
+        }
+        else if ( name == "Pair" )
+        {
+            _pairKey.clear();
+            _pairUrl.clear();
+            _pairStyle.unset();
+        }
+        else if ( name == "LineStyle" )  _style.hasLine  = true;
+        else if ( name == "PolyStyle" )  _style.hasPoly  = true;
+        else if ( name == "IconStyle" )  _style.hasIcon  = true;
+        else if ( name == "LabelStyle" ) _style.hasLabel = true;
+        else if ( name == "NetworkLink" )
+        {
+            _linkHref.clear();
+        }
+        else if ( name == "GroundOverlay" )
+        {
+            _overlay = KMLParser::GroundOverlay();
+        }
+        else if ( _placemark.valid() && isGeometry(name) )
+        {
+            _hasGeomElement = true;
+            _geoms.push_back( GeomFrame() );
+            _geoms.back()._type = name;
+
+            // reuse a buffer that has already grown, instead of growing a new one:
+            if ( !_spareBuffers.empty() )
+            {
+                _geoms.back()._points.swap( _spareBuffers.back() );
+                _spareBuffers.pop_back();
+            }
+            if ( name == "MultiGeometry" )
+                _geoms.back()._multi = new MultiGeometry;
+            else if ( name == "Model" )
+                _model = new KMLModelSymbol;
+        }
+        else if ( name == "coordinates" && !_geoms.empty() )
+        {
+            _inCoords = true;
+            _coordText.clear();
+        }
+        else
+        {
+            // leaf elements whose text we care about:
+            _collect =
+                name == "name"      || name == "styleUrl"     || name == "key"       ||
+                name == "color"     || name == "width"        || name == "fill"      ||
+                name == "scale"     || name == "href"         || name == "altitudeMode" ||
+                name == "extrude"   || name == "longitude"    || name == "latitude"  ||
+                name == "altitude"  || name == "heading"      || name == "tilt"      ||
+                name == "range"     || name == "roll"         || name == "x"         ||
+                name == "y"         || name == "z"            || name == "north"     ||
+                name == "south"     || name == "east"         || name == "west"      ||
+                name == "rotation"  || name == "drawOrder";
+        }
+    }
+
+    void
+    StreamState::characters( const char* s, int len )
+    {
+        if ( _inCoords )
+        {
+            // parse coordinates as they arrive so a huge <coordinates> element
+            // never has to be buffered in full.
+            _coordText.append( s, len );
+            if ( _coordText.size() >= _chunkSize )
+            {
+                std::string::size_type used = KMLCoordinates::parse( _coordText, false, _geoms.back()._points );
+                _coordText.erase( 0, used );
+            }
+        }
+        else if ( _collect )
+        {
+            _text.append( s, len );
+        }
+    }
+
+    void
+    StreamState::endElement()
+    {
+        const std::string& name = _path.back();
+        const std::string& up   = parent();
+
+        if ( name == "coordinates" && _inCoords )
+        {
+            KMLCoordinates::parse( _coordText, true, _geoms.back()._points );
+            _coordText.clear();
+            _inCoords = false;
+        }
+        else if ( _collect )
+        {
+            if ( name == "name" )
+            {
+                if ( up == "Placemark" && _placemark.valid() )
+                    _placemark->setName( _text );
+                else if ( up == "GroundOverlay" && _overlay.isSet() )
+                    _overlay->_name = _text;
+            }
+            else if ( name == "styleUrl" )
+            {
+                if ( up == "Placemark" )  _styleUrl = _text;
+                else if ( up == "Pair" )  _pairUrl = _text;
+            }
+            else if ( name == "key" && up == "Pair" )
+            {
+                _pairKey = _text;
+            }
+            else if ( name == "color" )
+            {
+                if      ( up == "LineStyle" )  _style.lineColor  = s_parseColor( _text );
+                else if ( up == "PolyStyle" )  _style.polyColor  = s_parseColor( _text );
+                else if ( up == "LabelStyle" ) _style.labelColor = s_parseColor( _text );
+                else if ( up == "IconStyle" )  _style.iconColor  = s_parseColor( _text );
+                else if ( up == "GroundOverlay" && _overlay.isSet() ) _overlay->_color = s_parseColor( _text );
+            }
+            else if ( name == "width" && up == "LineStyle" )
+            {
+                _style.lineWidth = (float)::atof( _text.c_str() );
+            }
+            else if ( name == "fill" && up == "PolyStyle" )
+            {
+                _style.polyFill = s_parseBool( _text );
+            }
+            else if ( name == "scale" )
+            {
+                if      ( up == "IconStyle" )  _style.iconScale  = (float)::atof( _text.c_str() );
+                else if ( up == "LabelStyle" ) _style.labelScale = (float)::atof( _text.c_str() );
+            }
+            else if ( name == "href" )
+            {
+                if ( up == "Icon" && parent(2) == "IconStyle" )
+                    _style.iconHref = KMZArchive::resolveHref( _location, _text );
+                else if ( (up == "Link" || up == "Url") && parent(2) == "Model" )
+                    _modelHref = KMZArchive::resolveHref( _location, _text );
+                else if ( (up == "Link" || up == "Url") && parent(2) == "NetworkLink" )
+                    _linkHref = _text;
+                else if ( up == "Icon" && parent(2) == "GroundOverlay" && _overlay.isSet() )
+                    _overlay->_url = KMZArchive::resolveHref( _location, _text );
+            }
+            else if ( _overlay.isSet() && (up == "LatLonBox" || (up == "GroundOverlay" && name == "drawOrder")) )
+            {
+                double v = ::atof( _text.c_str() );
+                if      ( name == "north" )     _overlay->_north     = v;
+                else if ( name == "south" )     _overlay->_south     = v;
+                else if ( name == "east" )      _overlay->_east      = v;
+                else if ( name == "west" )      _overlay->_west      = v;
+                else if ( name == "rotation" )  _overlay->_rotation  = v;
+                else if ( name == "drawOrder" ) _overlay->_drawOrder = (int)v;
+            }
+            else if ( name == "altitudeMode" && isGeometry(up) )
+            {
+                if ( !_altMode.isSet() )
+                    _altMode = s_parseAltitudeMode( _text );
+            }
+            else if ( name == "extrude" && isGeometry(up) )
+            {
+                if ( !_extrude.isSet() )
+                    _extrude = s_parseBool( _text );
+            }
+            else if ( up == "LookAt" && parent(2) == "Placemark" )
+            {
+                double v = ::atof( _text.c_str() );
+                if      ( name == "longitude" ) _lookLon     = v;
+                else if ( name == "latitude" )  _lookLat     = v;
+                else if ( name == "altitude" )  _lookAlt     = v;
+                else if ( name == "heading" )   _lookHeading = v;
+                else if ( name == "tilt" )      _lookTilt    = v;
+                else if ( name == "range" )     _lookRange   = v;
+            }
+            else if ( _model.valid() )
+            {
+                double v = ::atof( _text.c_str() );
+                if ( up == "Location" )
+                {
+                    if      ( name == "longitude" ) _modelLocation.x() = v;
+                    else if ( name == "latitude" )  _modelLocation.y() = v;
+                    else if ( name == "altitude" )  _modelLocation.z() = v;
+                }
+                else if ( up == "Orientation" )
+                {
+                    if      ( name == "heading" ) _model->setHeading( v );
+                    else if ( name == "tilt" )    _model->setTilt( v );
+                    else if ( name == "roll" )    _model->setRoll( v );
+                }
+                else if ( up == "Scale" )
+                {
+                    if      ( name == "x" ) _modelScale.x() = v;
+                    else if ( name == "y" ) _modelScale.y() = v;
+                    else if ( name == "z" ) _modelScale.z() = v;
+                }
+            }
+        }
+        else if ( name == "Style" )
+        {
+            if ( up == "Placemark" )
+                _inlineStyle = _style;
+            else if ( up == "Pair" )
+                _pairStyle = _style;
+            else if ( !_styleId.empty() )
+            {
+                _styles[_styleId] = _style;
+            }
+        }
+        else if ( name == "Pair" )
+        {
+            if ( _pairKey == "normal" )
+            {
+                if ( _pairStyle.isSet() )
+                    _normalStyle = *_pairStyle;
+                else if ( !_pairUrl.empty() )
+                    _normalUrl = _pairUrl;
+            }
+        }
+        else if ( name == "StyleMap" )
+        {
+            if ( !_styleMapId.empty() )
+            {
+                if ( _normalStyle.isSet() )
+                    _styles[_styleMapId] = *_normalStyle;
+                else if ( _normalUrl.isSet() )
+                    _styleMaps[_styleMapId] = *_normalUrl;
+            }
+        }
+        else if ( !_geoms.empty() && name == _geoms.back()._type )
+        {
+            endGeometry();
+        }
+        else if ( name == "Placemark" )
+        {
+            endPlacemark();
+        }
+        else if ( name == "GroundOverlay" && _overlay.isSet() )
+        {
+            // same checks as KMLParser::parseGroundOverlay:
+            KMLParser::GroundOverlay overlay = *_overlay;
+            if ( !overlay._url.empty() && overlay._north > overlay._south )
+            {
+                if ( overlay._east <= overlay._west )
+                    overlay._east += 360.0;
+                _overlays.push_back( overlay );
+            }
+            _overlay.unset();
+        }
+        else if ( name == "NetworkLink" )
+        {
+            if ( !_linkHref.empty() )
+            {
+                // an archive can't inflate two entries at once, so links out
+                // of a packaged document wait until it has been read.
+                if ( _deferLinks )
+                    _pendingLinks.push_back( _linkHref );
+                else
+                    followLink( _linkHref );
+            }
+        }
+
+        _path.pop_back();
+        _text.clear();
+        _collect = false;
+    }
+
+    void
+    StreamState::beginPlacemark()
+    {
+        _placemark = new Placemark( _nextUID++ );
+        _styleUrl.clear();
+        _inlineStyle.unset();
+        _geoms.clear();
+        _geom = 0L;
+        _hasGeomElement = false;
+        _altMode.unset();
+        _extrude.unset();
+        _model = 0L;
+        _modelHref.clear();
+        _modelLocation.set( 0, 0, 0 );
+        _modelScale.set( 1, 1, 1 );
+        _lookLon.unset(); _lookLat.unset(); _lookAlt.unset();
+        _lookHeading.unset(); _lookTilt.unset(); _lookRange.unset();
+    }
+
+    void
+    StreamState::endGeometry()
+    {
+        GeomFrame frame;
+        frame._type.swap( _geoms.back()._type );
+        frame._points.swap( _geoms.back()._points );
+        frame._holes.swap( _geoms.back()._holes );
+        frame._multi = _geoms.back()._multi.get();
+        _geoms.pop_back();
+
+        buildGeometry( frame );
+
+        // the geometry copied what it needed at its exact size; keep the
+        // buffer for the next one.
+        frame._points.clear();
+        _spareBuffers.push_back( Vec3dVector() );
+        _spareBuffers.back().swap( frame._points );
+    }
+
+    void
+    StreamState::buildGeometry( GeomFrame& frame )
+    {
+        osg::ref_ptr<Geometry> geom;
+
+        if ( frame._type == "Point" )
+        {
+            if ( frame._points.size() > 0 )
+                geom = new PointSet( &frame._points );
+        }
+        else if ( frame._type == "LineString" )
+        {
+            if ( frame._points.size() > 0 )
+                geom = new LineString( &frame._points );
+        }
+        else if ( frame._type == "LinearRing" )
+        {
+            if ( frame._points.size() > 0 )
+            {
+                // a polygon boundary is handed to the enclosing polygon:
+                if ( !_geoms.empty() && _geoms.back()._type == "Polygon" )
+                {
+                    if ( parent() == "innerBoundaryIs" )
+                    {
+                        Ring* hole = new Ring( &frame._points );
+                        hole->rewind( Ring::ORIENTATION_CW );
+                        _geoms.back()._holes.push_back( hole );
+                    }
+                    else
+                    {
+                        _geoms.back()._points.swap( frame._points );
+                    }
+                    return;
+                }
+
+                Ring* ring = new Ring( &frame._points );
+                ring->rewind( Ring::ORIENTATION_CCW );
+                geom = ring;
+            }
+        }
+        else if ( frame._type == "Polygon" )
+        {
+            if ( frame._points.size() > 0 )
+            {
+                Polygon* poly = new Polygon( &frame._points );
+                poly->rewind( Ring::ORIENTATION_CCW );
+                for( unsigned int i=0; i<frame._holes.size(); ++i )
+                    poly->getHoles().push_back( frame._holes[i].get() );
+                geom = poly;
+            }
+        }
+        else if ( frame._type == "MultiGeometry" )
+        {
+            if ( frame._multi->getComponents().size() > 0 )
+                geom = frame._multi.get();
+        }
+        else if ( frame._type == "Model" )
+        {
+            if ( _model.valid() )
+            {
+                _model->setLocation( _modelLocation );
+                _model->setScale( _modelScale );
+            }
+            return;
+        }
+
+        if ( geom.valid() )
+        {
+            if ( !_geoms.empty() && _geoms.back()._multi.valid() )
+                _geoms.back()._multi->getComponents().push_back( geom.get() );
+            else
+                _geom = geom.get();
+        }
+    }
+
+    const StyleSpec*
+    StreamState::resolveStyle() const
+    {
+        if ( _inlineStyle.isSet() )
+            return &_inlineStyle.get();
+
+        // only document-local style references ("#id") can be resolved
+        // without fetching another document.
+        std::string url = _styleUrl;
+        for( int hops = 0; hops < 4 && !url.empty(); ++hops )
+        {
+            std::string id = url[0] == '#' ? url.substr(1) : url;
+
+            StyleSpecTable::const_iterator s = _styles.find( id );
+            if ( s != _styles.end() )
+                return &s->second;
+
+            std::map<std::string,std::string>::const_iterator m = _styleMaps.find( id );
+            if ( m == _styleMaps.end() )
+                break;
+            url = m->second;
+        }
+        return 0L;
+    }
+
+    void
+    StreamState::applyStyle( Placemark* p )
+    {
+        const StyleSpec* spec = resolveStyle();
+        if ( !spec )
+        {
+            p->style() = Style();
+            return;
+        }
+
+        KMLAltitude::AltitudeMode mode = _altMode.isSet() ? *_altMode : KMLAltitude::ClampToGround;
+        bool extrude = _extrude.isSet() && *_extrude;
+
+        // every style, inline or not, is built once per read; the symbols,
+        // label included, are shared by the placemarks that use it.
+        CachedStyle& style = _styleCache[s_styleKey( *spec, mode, extrude )];
+        if ( !style._built )
+        {
+            style._style = s_createStyle( *spec, mode, extrude, style._label );
+            style._built = true;
+        }
+
+        p->style() = style._style;
+        if ( style._label.valid() )
+            p->style()->addSymbol( style._label.get() );
+    }
+
+    void
+    StreamState::endPlacemark()
+    {
+        osg::ref_ptr<Placemark> p = _placemark.get();
+        _placemark = 0L;
+
+        if ( !p.valid() || !_hasGeomElement )
+            return;
+
+        if ( _model.valid() )
+        {
+            if ( !_modelHref.empty() )
+                _model->url() = _modelHref;
+            else
+                OE_WARN << LC << "no link found on Model " << p->getName() << std::endl;
+
+            Style style;
+            style.addSymbol( _model.get() );
+            p->style() = style;
+        }
+        else if ( _geom.valid() )
+        {
+            p->setGeometry( _geom.get() );
+
+            applyStyle( p.get() );
+        }
+        else
+        {
+            OE_WARN << LC << "cant retrieve geometry for placemark " << p->getName() << std::endl;
+        }
+
+        // labels show the placemark's name; see KMLLabelSymbol.
+        if ( !p->style()->get<KMLLabelSymbol>() )
+        {
+            CachedStyle& unstyled = _styleCache[std::string()];
+            if ( !unstyled._label.valid() )
+            {
+                unstyled._label = new KMLLabelSymbol;
+                unstyled._label->size() = DEFAULT_LABEL_SIZE;
+            }
+            p->style()->addSymbol( unstyled._label.get() );
+        }
+
+        if ( _lookLon.isSet() && _lookLat.isSet() )
+        {
+            Viewpoint vp;
+            vp.setFocalPoint( osg::Vec3d( *_lookLon, *_lookLat, _lookAlt.isSet() ? *_lookAlt : 0.0 ) );
+            if ( _lookHeading.isSet() )
+                vp.setHeading( *_lookHeading );
+            if ( _lookTilt.isSet() )
+                vp.setPitch( *_lookTilt - 90.0 );
+            vp.setRange( _lookRange.isSet() ? *_lookRange : 10000.0 );
+            p->lookAt() = vp;
+        }
+        else if ( p->getGeometry() )
+        {
+            osgEarth::Bounds bounds = p->getGeometry()->getBounds();
+            double range =
+                p->getGeometry()->getComponentType() == Geometry::TYPE_POINTSET || bounds.radius() < 10.0 ? 1250.0 :
+                bounds.radius() * 4.0;
+            p->lookAt() = Viewpoint( bounds.center(), 0.0, -55.0, range );
+        }
+
+        if ( !_callback->onFeature( p.get() ) || (_progress && !_progress->addFeaturesRead( 1 )) )
+        {
+            _stopped = true;
+            XML_StopParser( _parser, XML_FALSE );
+        }
+    }
+
+    void
+    StreamState::followLink( const std::string& href )
+    {
+        std::string url = KMZArchive::resolveHref( _location, href );
+
+        StreamState child( url, _callback, _chunkSize, _nextUID, _visited, _archives, _styleCache, _overlays, _progress, _depth+1 );
+        child.run();
+
+        if ( child._stopped )
+        {
+            _stopped = true;
+            if ( !_deferLinks )
+                XML_StopParser( _parser, XML_FALSE );
+        }
+    }
+}
+
+//------------------------------------------------------------------------
+
+KMLStreamReader::KMLStreamReader() :
+_chunkSize( DEFAULT_CHUNK_SIZE ),
+_nextUID( 0L )
+{
+    //NOP
+}
+
+bool
+KMLStreamReader::read( const std::string& location, FeatureList& output )
+{
+    osg::ref_ptr<Callback> collector = new CollectFeaturesCallback( output );
+    return read( location, collector.get() );
+}
+
+bool
+KMLStreamReader::read( const std::string& location, Callback* callback )
+{
+    if ( !callback )
+        return false;
+
+    _documents.clear();
+    _archives.clear();
+    _groundOverlays.clear();
+    CachedStyleTable styleCache;
+    StreamState state( location, callback, std::max(_chunkSize, 1024u), _nextUID, _documents, _archives, styleCache, _groundOverlays, _progress.get(), 0 );
+    return state.run();
+}
@@ -0,0 +1,123 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMLSymbolSource>
+#include <Godzi/KML/KMLFeatureSource>
+#include <Godzi/KML/KMLClusterBatch>
+#include <Godzi/KML/KMLIconBatch>
+#include <Godzi/KML/KMLLabelBatch>
+#include <Godzi/KML/KMLModelBatch>
+#include <Godzi/KML/KMLSymbol>
+#include <Godzi/Placemark>
+#include <osgDB/FileNameUtils>
+#include <osg/Group>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+
+#define LC "[Godzi.KMLSymbolSource] "
+
+KMLSymbolSource::KMLSymbolSource( const KMLSymbolOptions& options ) :
+ModelSource( options ),
+_options( options ),
+_map( 0L )
+{
+    //NOP
+}
+
+bool
+KMLSymbolSource::isSymbol( Feature* feature )
+{
+    const Geometry* geom = feature->getGeometry();
+    if ( !geom || geom->getType() != Geometry::TYPE_POINTSET || !feature->style().isSet() )
+        return false;
+
+    // content under a Region is paged with the rest of the source:
+    const Placemark* placemark = dynamic_cast<const Placemark*>( feature );
+    if ( placemark && placemark->region().isSet() )
+        return false;
+
+    return !feature->style()->get<KMLModelSymbol>();
+}
+
+void
+KMLSymbolSource::initialize( const std::string& referenceURI, const osgEarth::Map* map )
+{
+    _referenceURI = referenceURI;
+    _map = map;
+}
+
+osg::Node*
+KMLSymbolSource::createNode( ProgressCallback* progress )
+{
+    osg::ref_ptr<KMLFeatureSource> source = new KMLFeatureSource( _options.featureOptions() );
+    source->initialize( _referenceURI );
+
+    osg::Group* group = new osg::Group();
+
+    // a dense point set is drawn as clusters, level by level:
+    osg::ref_ptr<KMLClusterIndex> clusters = KMLClusterIndex::create( source->getFeaturesList(), _options.featureOptions() );
+    if ( clusters.valid() )
+    {
+        group->addChild( KMLClusterBatch::create(clusters.get(), source->getFeaturesList(), _map) );
+    }
+    else
+    {
+        osg::Node* icons = KMLIconBatch::create( source->getFeaturesList(), _map );
+        if ( icons )
+            group->addChild( icons );
+
+        osg::Node* labels = KMLLabelBatch::create( source->getFeaturesList(), _map );
+        if ( labels )
+            group->addChild( labels );
+    }
+
+    osg::Node* models = KMLModelBatch::create( source->getFeaturesList(), _map );
+    if ( models )
+        group->addChild( models );
+
+    return group;
+}
+
+//------------------------------------------------------------------------
+
+class KMLSymbolSourceFactory : public ModelSourceDriver
+{
+public:
+    KMLSymbolSourceFactory()
+    {
+        supportsExtension( "osgearth_kml_symbols", "KML symbol driver for Godzi" );
+    }
+
+    virtual const char* className()
+    {
+        return "KML Symbol Reader";
+    }
+
+    virtual ReadResult readObject(const std::string& file_name, const Options* options) const
+    {
+        if ( !acceptsExtension(osgDB::getLowerCaseFileExtension( file_name )))
+            return ReadResult::FILE_NOT_HANDLED;
+
+        return ReadResult( new KMLSymbolSource( getModelSourceOptions(options) ) );
+    }
+};
+
+REGISTER_OSGPLUGIN(osgearth_kml_symbols, KMLSymbolSourceFactory)
@@ -0,0 +1,502 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/KML/KMZArchive>
+#include <osgEarth/HTTPClient>
+#include <osgEarth/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osgDB/Registry>
+#include <OpenThreads/ScopedLock>
+#include <minizip/unzip.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+using namespace Godzi;
+using namespace Godzi::KML;
+using namespace osgEarth;
+
+#define LC "[Godzi.KMZArchive] "
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+namespace
+{
+    typedef std::map< std::string, osg::ref_ptr<KMZArchive> > ArchiveRegistry;
+
+    /** Open archives by key. Holds a reference so find() can hand out new ones. */
+    OpenThreads::Mutex s_registryMutex;
+    ArchiveRegistry    s_registry;
+    unsigned int       s_nextRemoteId = 0;
+    bool               s_callbackInstalled = false;
+
+    /** Normalizes an entry name for lookup (zip names are case-insensitive in KMZ). */
+    std::string
+    s_entryKey( const std::string& name )
+    {
+        std::string key = osgDB::convertFileNameToUnixStyle( name );
+        while( key.length() > 2 && key[0] == '.' && key[1] == '/' )
+            key = key.substr( 2 );
+        std::transform( key.begin(), key.end(), key.begin(), ::tolower );
+        return key;
+    }
+
+    /** A read cursor over an in-memory zip file, for minizip's I/O hooks. */
+    struct MemoryStream
+    {
+        const char* _data;
+        uLong       _size;
+        uLong       _pos;
+    };
+
+    /** minizip I/O hook; the opaque pointer is the MemoryStream to clone. */
+    voidpf ZCALLBACK
+    s_memOpen( voidpf opaque, const char* filename, int mode )
+    {
+        if ( (mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER) != ZLIB_FILEFUNC_MODE_READ )
+            return 0L;
+        MemoryStream* stream = new MemoryStream( *static_cast<MemoryStream*>(opaque) );
+        stream->_pos = 0;
+        return stream;
+    }
+
+    /** minizip I/O hook: copies out of the mapped archive. */
+    uLong ZCALLBACK
+    s_memRead( voidpf opaque, voidpf stream, void* buf, uLong size )
+    {
+        MemoryStream* s = static_cast<MemoryStream*>( stream );
+        uLong count = std::min( size, s->_size - s->_pos );
+        ::memcpy( buf, s->_data + s->_pos, count );
+        s->_pos += count;
+        return count;
+    }
+
+    /** minizip I/O hook: archives are read-only. */
+    uLong ZCALLBACK
+    s_memWrite( voidpf opaque, voidpf stream, const void* buf, uLong size )
+    {
+        return 0;
+    }
+
+    /** minizip I/O hook. */
+    long ZCALLBACK
+    s_memTell( voidpf opaque, voidpf stream )
+    {
+        return (long)static_cast<MemoryStream*>( stream )->_pos;
+    }
+
+    /** minizip I/O hook. */
+    long ZCALLBACK
+    s_memSeek( voidpf opaque, voidpf stream, uLong offset, int origin )
+    {
+        MemoryStream* s = static_cast<MemoryStream*>( stream );
+        uLong base =
+            origin == ZLIB_FILEFUNC_SEEK_SET ? 0 :
+            origin == ZLIB_FILEFUNC_SEEK_CUR ? s->_pos :
+            s->_size;
+        if ( base + offset > s->_size )
+            return -1;
+        s->_pos = base + offset;
+        return 0;
+    }
+
+    /** minizip I/O hook. */
+    int ZCALLBACK
+    s_memClose( voidpf opaque, voidpf stream )
+    {
+        delete static_cast<MemoryStream*>( stream );
+        return 0;
+    }
+
+    /** minizip I/O hook. */
+    int ZCALLBACK
+    s_memError( voidpf opaque, voidpf stream )
+    {
+        return 0;
+    }
+
+    /**
+     * Serves osgDB reads of "<key>/<entry>" paths out of open archives, and
+     * passes everything else along to whatever callback was installed before.
+     */
+    class KMZReadFileCallback : public osgDB::Registry::ReadFileCallback
+    {
+    public:
+        KMZReadFileCallback( osgDB::Registry::ReadFileCallback* previous ) : _previous( previous ) { }
+
+        osgDB::ReaderWriter::ReadResult readImage( const std::string& filename, const osgDB::ReaderWriter::Options* options )
+        {
+            std::string entry;
+            osg::ref_ptr<KMZArchive> archive = KMZArchive::find( filename, entry );
+            if ( archive.valid() && archive->hasEntry( entry ) )
+                return archive->readImage( entry, options );
+
+            return _previous.valid() ?
+                _previous->readImage( filename, options ) :
+                osgDB::Registry::ReadFileCallback::readImage( filename, options );
+        }
+
+        osgDB::ReaderWriter::ReadResult readNode( const std::string& filename, const osgDB::ReaderWriter::Options* options )
+        {
+            std::string entry;
+            osg::ref_ptr<KMZArchive> archive = KMZArchive::find( filename, entry );
+            if ( archive.valid() && archive->hasEntry( entry ) )
+                return archive->readNode( entry, options );
+
+            return _previous.valid() ?
+                _previous->readNode( filename, options ) :
+                osgDB::Registry::ReadFileCallback::readNode( filename, options );
+        }
+
+    private:
+        osg::ref_ptr<osgDB::Registry::ReadFileCallback> _previous;
+    };
+
+    /** Copies the caller's options, searching the entry's folder in the archive first. */
+    osg::ref_ptr<osgDB::ReaderWriter::Options>
+    s_entryOptions( const std::string& entryPath, const osgDB::ReaderWriter::Options* options )
+    {
+        osg::ref_ptr<osgDB::ReaderWriter::Options> local = options ?
+            static_cast<osgDB::ReaderWriter::Options*>( options->clone( osg::CopyOp::SHALLOW_COPY ) ) :
+            new osgDB::ReaderWriter::Options();
+        local->getDatabasePathList().push_front( osgDB::getFilePath( entryPath ) );
+        return local;
+    }
+}
+
+//------------------------------------------------------------------------
+
+bool
+KMZArchive::isArchive( const std::string& location )
+{
+    return osgDB::getLowerCaseFileExtension( location ) == "kmz";
+}
+
+osg::ref_ptr<KMZArchive>
+KMZArchive::open( const std::string& location )
+{
+    bool remote = osgDB::containsServerAddress( location );
+    std::string canonical = remote ? location : osgDB::convertFileNameToUnixStyle( osgDB::getRealPath( location ) );
+
+    {
+        ScopedLock lock( s_registryMutex );
+
+        // drop archives nobody but the registry refers to any more:
+        for( ArchiveRegistry::iterator i = s_registry.begin(); i != s_registry.end(); )
+        {
+            if ( i->second->referenceCount() == 1 )
+                s_registry.erase( i++ );
+            else
+                ++i;
+        }
+
+        for( ArchiveRegistry::iterator i = s_registry.begin(); i != s_registry.end(); ++i )
+        {
+            if ( i->second->getLocation() == canonical )
+                return i->second.get();
+        }
+    }
+
+    osg::ref_ptr<KMZArchive> archive = new KMZArchive( canonical );
+
+    if ( remote )
+    {
+        if ( HTTPClient::readString( canonical, archive->_buffer ) != HTTPClient::RESULT_OK )
+        {
+            OE_WARN << LC << canonical << ": read failed" << std::endl;
+            return 0L;
+        }
+        archive->_data = archive->_buffer.data();
+        archive->_size = archive->_buffer.size();
+    }
+    else
+    {
+        archive->_mapped = new MappedFile();
+        if ( !archive->_mapped->open( canonical ) )
+        {
+            OE_WARN << LC << canonical << ": read failed" << std::endl;
+            return 0L;
+        }
+        archive->_data = archive->_mapped->data();
+        archive->_size = archive->_mapped->size();
+    }
+
+    if ( !archive->openArchive() )
+    {
+        OE_WARN << LC << canonical << ": not a valid KMZ archive" << std::endl;
+        return 0L;
+    }
+
+    ScopedLock lock( s_registryMutex );
+
+    // Remote entries get a local-style key so that embedded hrefs go
+    // through osgDB (and so through us) instead of back out to the server.
+    if ( remote )
+    {
+        std::stringstream buf;
+        buf << "/kmz/" << (s_nextRemoteId++) << "/" << osgDB::getSimpleFileName( canonical );
+        archive->_key = buf.str();
+    }
+
+    // another thread may have opened the same archive meanwhile:
+    for( ArchiveRegistry::iterator i = s_registry.begin(); i != s_registry.end(); ++i )
+    {
+        if ( i->second->getLocation() == canonical )
+            return i->second.get();
+    }
+
+    s_registry[archive->_key] = archive.get();
+
+    if ( !s_callbackInstalled )
+    {
+        osgDB::Registry* registry = osgDB::Registry::instance();
+        registry->setReadFileCallback( new KMZReadFileCallback( registry->getReadFileCallback() ) );
+        s_callbackInstalled = true;
+    }
+
+    OE_INFO << LC << "Opened " << canonical << " (" << archive->_entries.size() << " entries)" << std::endl;
+    return archive;
+}
+
+osg::ref_ptr<KMZArchive>
+KMZArchive::find( const std::string& path, std::string& out_entry )
+{
+    std::string unixPath = osgDB::convertFileNameToUnixStyle( path );
+
+    ScopedLock lock( s_registryMutex );
+    if ( s_registry.empty() )
+        return 0L;
+
+    // keys are full paths, so the longest matching key is the one that holds the path:
+    ArchiveRegistry::iterator i = s_registry.upper_bound( unixPath );
+    while( i != s_registry.begin() )
+    {
+        --i;
+        const std::string& key = i->first;
+        if ( unixPath.length() > key.length() && unixPath[key.length()] == '/' && unixPath.compare( 0, key.length(), key ) == 0 )
+        {
+            out_entry = unixPath.substr( key.length()+1 );
+            return i->second.get();
+        }
+    }
+    return 0L;
+}
+
+std::string
+KMZArchive::resolveHref( const std::string& baseLocation, const std::string& href )
+{
+    std::string full = osgEarth::getFullPath( baseLocation, href );
+
+    std::string baseEntry;
+    osg::ref_ptr<KMZArchive> archive = find( baseLocation, baseEntry );
+    if ( archive.valid() && !osgDB::containsServerAddress( href ) && osgDB::isRelativePath( href ) )
+    {
+        std::string entry;
+        if ( find( full, entry ) != archive || !archive->hasEntry( entry ) )
+            return osgEarth::getFullPath( archive->getLocation(), href );
+    }
+    return full;
+}
+
+//------------------------------------------------------------------------
+
+KMZArchive::KMZArchive( const std::string& location ) :
+_location( location ),
+_key( location ),
+_data( 0L ),
+_size( 0 ),
+_unzip( 0L )
+{
+    //nop
+}
+
+KMZArchive::~KMZArchive()
+{
+    if ( _unzip )
+        unzClose( _unzip );
+}
+
+bool
+KMZArchive::openArchive()
+{
+    // s_memOpen is only called from within unzOpen2, so the source can live on the stack.
+    MemoryStream source = { _data, _size, 0 };
+
+    zlib_filefunc_def io;
+    io.zopen_file  = s_memOpen;
+    io.zread_file  = s_memRead;
+    io.zwrite_file = s_memWrite;
+    io.ztell_file  = s_memTell;
+    io.zseek_file  = s_memSeek;
+    io.zclose_file = s_memClose;
+    io.zerror_file = s_memError;
+    io.opaque      = &source;
+
+    _unzip = unzOpen2( _location.c_str(), &io );
+    if ( !_unzip )
+        return false;
+
+    // index the central directory once, so lookups never scan it again.
+    std::string firstKml;
+    char name[1024];
+    for( int err = unzGoToFirstFile( _unzip ); err == UNZ_OK; err = unzGoToNextFile( _unzip ) )
+    {
+        unz_file_info info;
+        if ( unzGetCurrentFileInfo( _unzip, &info, name, sizeof(name), 0L, 0, 0L, 0 ) != UNZ_OK )
+            continue;
+
+        std::string entry( name );
+        if ( entry.empty() || entry[entry.length()-1] == '/' )
+            continue;
+
+        unz_file_pos pos;
+        unzGetFilePos( _unzip, &pos );
+        EntryPos& e = _entries[ s_entryKey(entry) ];
+        e.posInDir = pos.pos_in_zip_directory;
+        e.numFile  = pos.num_of_file;
+
+        if ( osgDB::getLowerCaseFileExtension( entry ) == "kml" )
+        {
+            if ( s_entryKey(entry) == "doc.kml" )
+                _docName = entry;
+            else if ( firstKml.empty() )
+                firstKml = entry;
+        }
+    }
+
+    if ( _docName.empty() )
+        _docName = firstKml;
+
+    return !_docName.empty();
+}
+
+bool
+KMZArchive::hasEntry( const std::string& entry ) const
+{
+    return _entries.find( s_entryKey(entry) ) != _entries.end();
+}
+
+bool
+KMZArchive::locate( const std::string& entry )
+{
+    EntryIndex::const_iterator i = _entries.find( s_entryKey(entry) );
+    if ( i == _entries.end() )
+        return false;
+
+    unz_file_pos pos;
+    pos.pos_in_zip_directory = i->second.posInDir;
+    pos.num_of_file          = i->second.numFile;
+    return unzGoToFilePos( _unzip, &pos ) == UNZ_OK;
+}
+
+bool
+KMZArchive::readEntry( const std::string& entry, std::string& out )
+{
+    ScopedLock lock( _mutex );
+
+    unz_file_info info;
+    if ( !locate(entry) || unzGetCurrentFileInfo( _unzip, &info, 0L, 0, 0L, 0, 0L, 0 ) != UNZ_OK )
+        return false;
+
+    if ( unzOpenCurrentFile( _unzip ) != UNZ_OK )
+        return false;
+
+    // inflate straight into the output, no intermediate buffer:
+    out.resize( info.uncompressed_size );
+    int bytes = info.uncompressed_size > 0 ?
+        unzReadCurrentFile( _unzip, &out[0], info.uncompressed_size ) : 0;
+
+    bool ok = unzCloseCurrentFile( _unzip ) == UNZ_OK && bytes == (int)info.uncompressed_size;
+    if ( !ok )
+    {
+        OE_WARN << LC << getEntryPath(entry) << ": inflate failed" << std::endl;
+        out.clear();
+    }
+    return ok;
+}
+
+bool
+KMZArchive::readEntry( const std::string& entry, Reader* reader, unsigned int chunkSize )
+{
+    if ( !reader )
+        return false;
+
+    ScopedLock lock( _mutex );
+
+    if ( !locate(entry) || unzOpenCurrentFile( _unzip ) != UNZ_OK )
+        return false;
+
+    std::vector<char> chunk( std::max(chunkSize, 1024u) );
+    int bytes;
+    while( (bytes = unzReadCurrentFile( _unzip, &chunk[0], chunk.size() )) > 0 )
+    {
+        if ( !reader->onData( &chunk[0], bytes ) )
+            break;
+    }
+
+    // closing early reports a CRC error, which only matters if we read it all:
+    int closeErr = unzCloseCurrentFile( _unzip );
+    if ( bytes < 0 || (bytes == 0 && closeErr != UNZ_OK) )
+    {
+        OE_WARN << LC << getEntryPath(entry) << ": inflate failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+osgDB::ReaderWriter::ReadResult
+KMZArchive::readImage( const std::string& entry, const osgDB::ReaderWriter::Options* options )
+{
+    osgDB::ReaderWriter* rw = osgDB::Registry::instance()->getReaderWriterForExtension(
+        osgDB::getLowerCaseFileExtension( entry ) );
+    if ( !rw )
+        return osgDB::ReaderWriter::ReadResult::FILE_NOT_HANDLED;
+
+    std::string data;
+    if ( !readEntry( entry, data ) )
+        return osgDB::ReaderWriter::ReadResult::FILE_NOT_FOUND;
+
+    std::string path = getEntryPath( entry );
+    std::istringstream in( data );
+    osgDB::ReaderWriter::ReadResult result = rw->readImage( in, s_entryOptions( path, options ).get() );
+    if ( result.validImage() )
+        result.getImage()->setFileName( path );
+    return result;
+}
+
+osgDB::ReaderWriter::ReadResult
+KMZArchive::readNode( const std::string& entry, const osgDB::ReaderWriter::Options* options )
+{
+    osgDB::ReaderWriter* rw = osgDB::Registry::instance()->getReaderWriterForExtension(
+        osgDB::getLowerCaseFileExtension( entry ) );
+    if ( !rw )
+        return osgDB::ReaderWriter::ReadResult::FILE_NOT_HANDLED;
+
+    std::string data;
+    if ( !readEntry( entry, data ) )
+        return osgDB::ReaderWriter::ReadResult::FILE_NOT_FOUND;
+
+    // textures referenced by the model resolve relative to its folder in the archive:
+    std::istringstream in( data );
+    return rw->readNode( in, s_entryOptions( getEntryPath(entry), options ).get() );
+}
@@ -0,0 +1,129 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/MappedFile>
+
+#ifdef WIN32
+#  include <windows.h>
+#else
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+using namespace Godzi;
+
+MappedFile::MappedFile() :
+_data( 0L ),
+_size( 0 ),
+#ifdef WIN32
+_file( INVALID_HANDLE_VALUE ),
+_mapping( 0L )
+#else
+_fd( -1 )
+#endif
+{
+    //nop
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool
+MappedFile::open( const std::string& path )
+{
+    close();
+    _path = path;
+
+#ifdef WIN32
+    _file = ::CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0L, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0L );
+    if ( _file == INVALID_HANDLE_VALUE )
+        return false;
+
+    LARGE_INTEGER size;
+    if ( !::GetFileSizeEx( _file, &size ) || size.QuadPart == 0 )
+    {
+        close();
+        return false;
+    }
+
+    _mapping = ::CreateFileMappingA( _file, 0L, PAGE_READONLY, 0, 0, 0L );
+    if ( !_mapping )
+    {
+        close();
+        return false;
+    }
+
+    _data = static_cast<const char*>( ::MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 ) );
+    _size = (std::size_t)size.QuadPart;
+#else
+    _fd = ::open( path.c_str(), O_RDONLY );
+    if ( _fd < 0 )
+        return false;
+
+    struct stat info;
+    if ( ::fstat( _fd, &info ) != 0 || info.st_size == 0 )
+    {
+        close();
+        return false;
+    }
+
+    void* addr = ::mmap( 0L, info.st_size, PROT_READ, MAP_PRIVATE, _fd, 0 );
+    if ( addr != MAP_FAILED )
+    {
+        _data = static_cast<const char*>( addr );
+        _size = (std::size_t)info.st_size;
+    }
+#endif
+
+    if ( !_data )
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void
+MappedFile::close()
+{
+#ifdef WIN32
+    if ( _data )
+        ::UnmapViewOfFile( _data );
+    if ( _mapping )
+        ::CloseHandle( _mapping );
+    if ( _file != INVALID_HANDLE_VALUE )
+        ::CloseHandle( _file );
+    _mapping = 0L;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if ( _data )
+        ::munmap( const_cast<char*>(_data), _size );
+    if ( _fd >= 0 )
+        ::close( _fd );
+    _fd = -1;
+#endif
+    _data = 0L;
+    _size = 0;
+}
@@ -29,6 +29,63 @@ Feature( fid )
 }
 
 Placemark::Placemark(const Placemark& pm, const osg::CopyOp& cp):
-    Feature(pm, cp)
+    Feature(pm, cp),
+    _lookAt(pm._lookAt),
+    _region(pm._region),
+    _compact(pm._compact)
 {
 }
+
+bool
+Placemark::compactGeometry()
+{
+    if ( !getGeometry() )
+        return false;
+
+    _compact = CompactGeometry::create( getGeometry() );
+    if ( !_compact.valid() )
+        return false;
+
+    Feature::setGeometry( 0L );
+    return true;
+}
+
+osg::ref_ptr<Geometry>
+Placemark::getFullGeometry( const Feature* feature )
+{
+    const Placemark* p = dynamic_cast<const Placemark*>( feature );
+    if ( p && p->getCompactGeometry() )
+        return p->getCompactGeometry()->decode();
+
+    return feature ? const_cast<Feature*>( feature )->getGeometry() : 0L;
+}
+
+bool
+Placemark::getGeometryBounds( const Feature* feature, Bounds& out_bounds )
+{
+    const Placemark* p = dynamic_cast<const Placemark*>( feature );
+    if ( p && p->getCompactGeometry() )
+    {
+        out_bounds = p->getCompactGeometry()->getBounds();
+        return true;
+    }
+
+    const Geometry* geom = feature ? feature->getGeometry() : 0L;
+    if ( !geom )
+        return false;
+
+    out_bounds = geom->getBounds();
+    return true;
+}
+
+Feature*
+Placemark::expand( Feature* feature )
+{
+    Placemark* p = dynamic_cast<Placemark*>( feature );
+    if ( !p || !p->getCompactGeometry() )
+        return feature;
+
+    Placemark* copy = new Placemark( *p );
+    copy->setGeometry( p->getCompactGeometry()->decode() );
+    return copy;
+}
@@ -27,6 +27,7 @@
 #include <osgEarth/XmlUtils>
 #include <osgEarth/MapNode>
 #include <osgEarth/Map>
+#include <QTimer>
 #include <iterator>
 
 using namespace Godzi;
@@ -78,6 +79,10 @@ Project::Project(osgEarth::Map* defaultMap, const Godzi::Config& conf)
 		_baseLayerOffset = _map->getNumImageLayers();
 		setVisibleLayers();
 
+		// built tiles never see a live feed's changes, so the layers are redrawn:
+		connect(DataSourceLoadNotifier::instance(), SIGNAL(objectsChanged(const QString&)), this, SLOT(onObjectsChanged(const QString&)));
+		connect(DataSourceLoadNotifier::instance(), SIGNAL(loadFinished(const QString&, bool)), this, SLOT(onSourceLoaded(const QString&, bool)));
+
 		osgEarth::ConfigSet sources = conf.children("datasource");
 
 		for (osgEarth::ConfigSet::const_iterator it = sources.begin(); it != sources.end(); ++it)
@@ -228,6 +233,14 @@ Project::toggleDataSource(unsigned int id, bool visible)
 		osgEarth::ModelLayer* modelLayer = layers.modelLayer.get();
 		if (modelLayer)
 			modelLayer->setEnabled(visible);
+
+		osgEarth::ModelLayer* symbolLayer = layers.symbolLayer.get();
+		if (symbolLayer)
+			symbolLayer->setEnabled(visible);
+
+		osgEarth::ModelLayer* liveLayer = layers.liveLayer.get();
+		if (liveLayer)
+			liveLayer->setEnabled(visible);
 		
 		dirty();
 		emit dataSourceToggled(id, visible);
@@ -323,7 +336,9 @@ Project::addSource(osg::ref_ptr<Godzi::DataSource> source, int index)
 
 	osgEarth::ImageLayer* imageLayer = createImageLayer(source, index);
 	osgEarth::ModelLayer* modelLayer = createModelLayer(source, index);
-	SourcedLayers layers(source, imageLayer, modelLayer);
+	osgEarth::ModelLayer* symbolLayer = createSymbolLayer(source);
+	osgEarth::ModelLayer* liveLayer = createLiveLayer(source);
+	SourcedLayers layers(source, imageLayer, modelLayer, symbolLayer, liveLayer);
 
 	if (index >= 0)
 	{
@@ -353,6 +368,8 @@ Project::removeSource(Godzi::DataSource* source, Godzi::DataSource** out_removed
 		SourcedLayers layers = _sourceLayers[layerIndex];
 		osgEarth::ImageLayer* imageLayer = layers.imageLayer.get();
 		osgEarth::ModelLayer* modelLayer = layers.modelLayer.get();
+		osgEarth::ModelLayer* symbolLayer = layers.symbolLayer.get();
+		osgEarth::ModelLayer* liveLayer = layers.liveLayer.get();
 
 		if (imageLayer)
 			_map->removeImageLayer(imageLayer);
@@ -360,6 +377,12 @@ Project::removeSource(Godzi::DataSource* source, Godzi::DataSource** out_removed
 		if (modelLayer)
 			_map->removeModelLayer(modelLayer);
 
+		if (symbolLayer)
+			_map->removeModelLayer(symbolLayer);
+
+		if (liveLayer)
+			_map->removeModelLayer(liveLayer);
+
 		if (out_removed)
 			*out_removed = layers.source.get();
 
@@ -406,6 +429,34 @@ Project::createModelLayer(osg::ref_ptr<const Godzi::DataSource> source, int inde
 	return layer;
 }
 
+osgEarth::ModelLayer*
+Project::createSymbolLayer(osg::ref_ptr<const Godzi::DataSource> source)
+{
+	// symbols are drawn over everything else, so their order doesn't matter
+	osgEarth::ModelLayer* layer = source->createSymbolLayer();
+	if (layer)
+	{
+		layer->setEnabled(source->visible());
+		_map->addModelLayer(layer);
+	}
+
+	return layer;
+}
+
+osgEarth::ModelLayer*
+Project::createLiveLayer(osg::ref_ptr<const Godzi::DataSource> source)
+{
+	// over the source's other layers, like its symbols
+	osgEarth::ModelLayer* layer = source->createLiveLayer();
+	if (layer)
+	{
+		layer->setEnabled(source->visible());
+		_map->addModelLayer(layer);
+	}
+
+	return layer;
+}
+
 int
 Project::findSourceLayersIndex(unsigned int id)
 {
@@ -416,6 +467,57 @@ Project::findSourceLayersIndex(unsigned int id)
 	return -1;
 }
 
+void
+Project::onObjectsChanged(const QString& location)
+{
+	// a feed with several links reports each one; redraw once for the lot.
+	if (_changedLocations.empty())
+		QTimer::singleShot(0, this, SLOT(refreshChangedSources()));
+
+	_changedLocations.insert(std::string(location.toUtf8().data()));
+}
+
+void
+Project::refreshChangedSources()
+{
+	std::set<std::string> changed;
+	changed.swap(_changedLocations);
+
+	for (int i=0; i < _sourceLayers.size(); i++)
+		if (_sourceLayers[i].valid() && changed.find(_sourceLayers[i].source->getLocation()) != changed.end())
+			refreshLiveLayer(i);
+}
+
+void
+Project::onSourceLoaded(const QString& location, bool canceled)
+{
+	if (canceled)
+		return;
+
+	std::string loaded(location.toUtf8().data());
+	for (int i=0; i < _sourceLayers.size(); i++)
+	{
+		SourcedLayers& layers = _sourceLayers[i];
+		if (layers.valid() && !layers.imageLayer.valid() && layers.source->getLocation() == loaded)
+			layers.imageLayer = createImageLayer(layers.source.get(), i);
+	}
+}
+
+void
+Project::refreshLiveLayer(int layerIndex)
+{
+	// Replaces the source's live layer with a new one, which reads the live
+	// links as they are now. The rest of the source's layers hold none of
+	// that content and are left alone.
+	SourcedLayers& layers = _sourceLayers[layerIndex];
+
+	if (layers.liveLayer.valid())
+	{
+		_map->removeModelLayer(layers.liveLayer.get());
+		layers.liveLayer = createLiveLayer(layers.source.get());
+	}
+}
+
 //---------------------------------------------------------------------------
 
 bool
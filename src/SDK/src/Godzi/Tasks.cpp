@@ -0,0 +1,181 @@
+/* --*-c++-*-- */
+/**
+ * Godzi
+ * Copyright 2010 Pelican Mapping
+ * http://pelicanmapping.com
+ * http://github.com/gwaldron/godzi
+ *
+ * Godzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include <Godzi/Tasks>
+#include <OpenThreads/Thread>
+#include <OpenThreads/ScopedLock>
+
+using namespace Godzi;
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+//---------------------------------------------------------------------------
+
+Task::Task() :
+_done( false ),
+_canceled( false )
+{
+    //nop
+}
+
+void
+Task::wait()
+{
+    ScopedLock lock( _mutex );
+    while( !_done )
+        _doneCond.wait( &_mutex );
+}
+
+bool
+Task::isDone() const
+{
+    ScopedLock lock( _mutex );
+    return _done;
+}
+
+void
+Task::cancel()
+{
+    ScopedLock lock( _mutex );
+    _canceled = true;
+}
+
+bool
+Task::isCanceled() const
+{
+    ScopedLock lock( _mutex );
+    return _canceled;
+}
+
+void
+Task::execute()
+{
+    if ( !isCanceled() )
+        run();
+    finish();
+}
+
+void
+Task::finish()
+{
+    ScopedLock lock( _mutex );
+    _done = true;
+    _doneCond.broadcast();
+}
+
+//---------------------------------------------------------------------------
+
+class TaskPool::Worker : public OpenThreads::Thread
+{
+public:
+    Worker( TaskPool* pool ) : _pool( pool ) { }
+
+    void run()
+    {
+        for( osg::ref_ptr<Task> task = _pool->take(); task.valid(); task = _pool->take() )
+        {
+            task->execute();
+        }
+    }
+
+private:
+    TaskPool* _pool;
+};
+
+TaskPool::TaskPool( unsigned int numThreads ) :
+_stopping( false )
+{
+    if ( numThreads == 0 )
+        numThreads = 1;
+
+    for( unsigned int i=0; i<numThreads; ++i )
+    {
+        Worker* worker = new Worker( this );
+        _workers.push_back( worker );
+        worker->start();
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        ScopedLock lock( _mutex );
+        _stopping = true;
+        _queueCond.broadcast();
+    }
+
+    cancelPending();
+
+    for( std::vector<Worker*>::iterator i = _workers.begin(); i != _workers.end(); ++i )
+    {
+        (*i)->join();
+        delete *i;
+    }
+}
+
+void
+TaskPool::add( Task* task )
+{
+    if ( !task )
+        return;
+
+    ScopedLock lock( _mutex );
+    if ( _stopping )
+    {
+        task->cancel();
+        task->finish();
+        return;
+    }
+
+    _queue.push_back( task );
+    _queueCond.signal();
+}
+
+void
+TaskPool::cancelPending()
+{
+    std::list< osg::ref_ptr<Task> > pending;
+    {
+        ScopedLock lock( _mutex );
+        pending.swap( _queue );
+    }
+
+    for( std::list< osg::ref_ptr<Task> >::iterator i = pending.begin(); i != pending.end(); ++i )
+    {
+        (*i)->cancel();
+        (*i)->finish();
+    }
+}
+
+Task*
+TaskPool::take()
+{
+    ScopedLock lock( _mutex );
+    while( _queue.empty() && !_stopping )
+        _queueCond.wait( &_mutex );
+
+    if ( _queue.empty() )
+        return 0L;
+
+    // hand the queue's reference over to the caller's ref_ptr:
+    osg::ref_ptr<Task> task = _queue.front();
+    _queue.pop_front();
+    return task.release();
+}
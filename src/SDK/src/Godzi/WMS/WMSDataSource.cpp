@@ -33,6 +33,7 @@ using namespace Godzi::WMS;
 namespace
 {
   const std::string EMPTY_STRING ="";
+  const std::vector<std::string> EMPTY_FORMATS;
 
 	std::string extractBetween(const std::string& str, const std::string &lhs, const std::string &rhs)
 	{
@@ -50,6 +51,19 @@ namespace
 	}
 }
 
+/**
+ * The layers and formats read from a server's capabilities. Never changed once
+ * read, so a source and all its clones share one instead of querying again.
+ */
+class WMSDataSource::Capabilities : public osg::Referenced
+{
+public:
+	osgEarth::Util::WMSLayer::LayerList _layers;
+	std::vector<std::string> _availableFormats;
+};
+
+/* --------------------------------------------- */
+
 const std::string WMSDataSource::TYPE_WMS = "WMS";
 
 WMSDataSource::WMSDataSource(const osgEarth::Drivers::WMSOptions& opt, bool visible)
@@ -78,6 +92,11 @@ WMSDataSource::WMSDataSource(const Godzi::Config& conf)
 	conf.getIfSet("fullurl", _fullUrl);
 }
 
+WMSDataSource::~WMSDataSource()
+{
+	//nop
+}
+
 Godzi::Config WMSDataSource::toConfig() const
 {
 	Godzi::Config conf = DataSource::toConfig();
@@ -102,7 +121,7 @@ osgEarth::ImageLayer* WMSDataSource::createImageLayer() const
 {
 	const_cast<WMSDataSource*>(this)->update();
 
-	if (_layers.size() > 0)
+	if (_capabilities.valid() && _capabilities->_layers.size() > 0)
 	{
 		//std::string name = _name.isSet() ? _name.get() : "WMS Source";
 		std::string name = (_opt.url().isSet() ? _opt.url().get() : "WMS") + "__" + (_opt.layers().isSet() ? _opt.layers().get() : "nolayers");
@@ -139,7 +158,9 @@ Godzi::DataSource* WMSDataSource::clone() const
 	c->setError(_error);
 	c->setErrorMsg(_errorMsg);
 
-	//c->setLayers(_layers);
+	// share what the server reported rather than asking it again
+	c->_capabilities = _capabilities;
+	c->_updateNeeded = _updateNeeded;
 
 	return c;
 }
@@ -150,11 +171,15 @@ void WMSDataSource::setFullUrl(const std::string& url)
 		_fullUrl.unset();
 	else
 		_fullUrl = url;
+
+	// capabilities of the old location don't apply
+	_capabilities = 0L;
+	_updateNeeded = true;
 }
 
 void WMSDataSource::update()
 {
-	if (_layers.size() > 0)
+	if (_capabilities.valid())
 		return;
 
 	std::string url = getLocation();
@@ -172,13 +197,13 @@ void WMSDataSource::update()
 	osg::ref_ptr<osgEarth::Util::WMSCapabilities> capabilities = osgEarth::Util::WMSCapabilitiesReader::read(capUrl, 0L);
 	if (capabilities.valid())
 	{
+		osg::ref_ptr<Capabilities> caps = new Capabilities();
+
 		//NOTE: Currently this flattens any layer heirarchy into a single list of layers
-		_layers.clear();
 		std::vector<std::string> opt_layers;
-		processLayerList(capabilities->getLayers(), specifiedLayers, opt_layers);
+		processLayerList(capabilities->getLayers(), specifiedLayers, caps->_layers, opt_layers);
 		_opt.layers() = Godzi::vectorToCSV(opt_layers);
 
-		_availableFormats.clear();
 		osgEarth::Util::WMSCapabilities::FormatList formats = capabilities->getFormats();
 		for (osgEarth::Util::WMSCapabilities::FormatList::const_iterator it = formats.begin(); it != formats.end(); ++it)
 		{
@@ -188,9 +213,11 @@ void WMSDataSource::update()
 			if (pos != std::string::npos && int(pos) == 0)
 				format.erase(0, 6);
 
-			_availableFormats.push_back(format);
+			caps->_availableFormats.push_back(format);
 		}
 
+		_capabilities = caps.get();
+
 		setError(false);
 		setErrorMsg("");
 	  _updateNeeded = false;
@@ -222,17 +249,17 @@ std::string WMSDataSource::parseWMSOptions(const std::string& url)
 	return layers;
 }
 
-void WMSDataSource::processLayerList(const osgEarth::Util::WMSLayer::LayerList& layerList, const std::vector<std::string>& subset, std::vector<std::string>& out_layers)
+void WMSDataSource::processLayerList(const osgEarth::Util::WMSLayer::LayerList& layerList, const std::vector<std::string>& subset, osgEarth::Util::WMSLayer::LayerList& out_layerList, std::vector<std::string>& out_layers)
 {
 	for (int i=0; i < layerList.size(); i++)
 	{
 		if (subset.size() == 0 || std::find(subset.begin(), subset.end(), layerList[i]->getName()) != subset.end())
 		{
-			_layers.push_back(layerList[i]);
+			out_layerList.push_back(layerList[i]);
 			out_layers.push_back(layerList[i]->getName());
 		}
 
-		processLayerList(layerList[i]->getLayers(), subset, out_layers);
+		processLayerList(layerList[i]->getLayers(), subset, out_layerList, out_layers);
 	}
 }
 
@@ -240,19 +267,19 @@ const std::vector<std::string>& WMSDataSource::getAvailableFormats() const
 {
 	const_cast<WMSDataSource*>(this)->update();
 
-	return _availableFormats;
+	return _capabilities.valid() ? _capabilities->_availableFormats : EMPTY_FORMATS;
 }
 
 const std::string& WMSDataSource::getLayerName(int id)
 {
 	const_cast<WMSDataSource*>(this)->update();
-	return (id >= 0 && _layers.size() > id) ? _layers[id]->getName() : EMPTY_STRING;
+	return (id >= 0 && _capabilities.valid() && _capabilities->_layers.size() > id) ? _capabilities->_layers[id]->getName() : EMPTY_STRING;
 }
 
 const osgEarth::Util::WMSLayer* WMSDataSource::getLayer(int id) const
 {
 	const_cast<WMSDataSource*>(this)->update();
-	return (id >= 0 && _layers.size() > id) ? _layers[id] : 0L;
+	return (id >= 0 && _capabilities.valid() && _capabilities->_layers.size() > id) ? _capabilities->_layers[id].get() : 0L;
 }
 
 bool WMSDataSource::getDataObjectSpecs( Godzi::DataObjectSpecVector& out_objectSpecs ) const
@@ -260,8 +287,12 @@ bool WMSDataSource::getDataObjectSpecs( Godzi::DataObjectSpecVector& out_objectS
 	const_cast<WMSDataSource*>(this)->update();
 
 	out_objectSpecs.clear();
-	for (int i=0; i < _layers.size(); i++)
-		out_objectSpecs.push_back(Godzi::DataObjectSpec(i, getDisplayName(_layers[i].get())));
+	if (_capabilities.valid())
+	{
+		const osgEarth::Util::WMSLayer::LayerList& layers = _capabilities->_layers;
+		for (int i=0; i < layers.size(); i++)
+			out_objectSpecs.push_back(Godzi::DataObjectSpec(i, getDisplayName(layers[i].get())));
+	}
 
 	return true;
 }